@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_policy.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "radix_sort.h"
+#include "util.h"
+
+/*
+ * Batches are formed by taking max_inodes files at a time in whatever order
+ * the inode array is in, so a batching policy is just a sort key for each
+ * inode, computed once its blocks have been mapped. Inodes with equal keys keep
+ * their relative order, which is inode number order.
+ *
+ * Files with no blocks to read (empty ones and ones that are all hole) get a
+ * key of 0, and so come first.
+ */
+typedef uint64_t (*batch_key_func)(ext2_filsys fs, struct inode_list *inode,
+                                   struct block_list *blocks);
+
+struct batch_policy
+{
+    char *name;
+    batch_key_func key;
+};
+
+uint64_t batch_key_inode(ext2_filsys fs, struct inode_list *inode,
+                         struct block_list *blocks)
+{
+    return inode->index;
+}
+
+/*
+ * Lowest physical block of the file's data, wherever it comes in the file.
+ */
+uint64_t batch_key_first_block(ext2_filsys fs, struct inode_list *inode,
+                               struct block_list *blocks)
+{
+    uint64_t first_block = 0;
+    for (size_t i = 0; i < inode->blocks_count; i++)
+    {
+        blk64_t physical_block = blocks[i].physical_block;
+        if (physical_block != 0
+            && (first_block == 0 || physical_block < first_block))
+        {
+            first_block = physical_block;
+        }
+    }
+    return first_block;
+}
+
+/*
+ * Block group of the file's lowest block. Files in the same group stay in
+ * inode order, since the allocator tries to put a directory's files' inodes
+ * and blocks in the same group.
+ */
+uint64_t batch_key_block_group(ext2_filsys fs, struct inode_list *inode,
+                               struct block_list *blocks)
+{
+    uint64_t first_block = batch_key_first_block(fs, inode, blocks);
+    return first_block == 0 ? 0 : ext2fs_group_of_blk2(fs, first_block) + 1;
+}
+
+/*
+ * Physical position of the middle block of the file's data, which a single
+ * far-flung extent can't drag around the way it can the lowest block.
+ */
+uint64_t batch_key_median_extent(ext2_filsys fs, struct inode_list *inode,
+                                 struct block_list *blocks)
+{
+    e2_blkcnt_t data_blocks = 0;
+    for (size_t i = 0; i < inode->blocks_count; i++)
+    {
+        if (blocks[i].physical_block != 0)
+            data_blocks += blocks[i].num_blocks;
+    }
+
+    e2_blkcnt_t median = data_blocks / 2;
+    for (size_t i = 0; i < inode->blocks_count; i++)
+    {
+        if (blocks[i].physical_block == 0)
+            continue;
+        if (median < blocks[i].num_blocks)
+            return blocks[i].physical_block + median;
+        median -= blocks[i].num_blocks;
+    }
+    return 0;
+}
+
+// indexed by the DJ_BATCH_* constants
+static struct batch_policy batch_policies[] = {
+    { "inode", batch_key_inode },
+    { "first_block", batch_key_first_block },
+    { "block_group", batch_key_block_group },
+    { "median_extent", batch_key_median_extent },
+};
+
+#define BATCH_POLICIES_COUNT \
+    (int)(sizeof(batch_policies) / sizeof(batch_policies[0]))
+
+int dj_batch_policy(char *name)
+{
+    for (int i = 0; i < BATCH_POLICIES_COUNT; i++)
+    {
+        if (!strcmp(batch_policies[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Reorder the inode array according to the policy, ready to be cut up into
+ * batches.
+ */
+void order_batches(ext2_filsys fs, int policy, struct inode_vec *inodes,
+                   struct block_vec *blocks)
+{
+    if (policy < 0 || policy >= BATCH_POLICIES_COUNT)
+        exit_str("Unknown batching policy %d", policy);
+
+    // the inodes are already in inode order
+    if (policy == DJ_BATCH_INODE || inodes->count < 2)
+        return;
+
+    LogInfo("Ordering batches by %s", batch_policies[policy].name);
+
+    batch_key_func key = batch_policies[policy].key;
+    uint64_t *keys = emalloc(sizeof(uint64_t) * inodes->count);
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        struct inode_list *inode = &inodes->inodes[i];
+        keys[i] = key(fs, inode, &blocks->blocks[inode->blocks_start]);
+    }
+
+    sort_inodes_by_keys(inodes->inodes, inodes->count, keys);
+
+    free(keys);
+}
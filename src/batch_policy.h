@@ -0,0 +1,12 @@
+#ifndef DJ_BATCH_POLICY_H
+#define DJ_BATCH_POLICY_H
+
+#include "dj_internal.h"
+
+uint64_t batch_key_first_block(ext2_filsys fs, struct inode_list *inode,
+                               struct block_list *blocks);
+
+void order_batches(ext2_filsys fs, int policy, struct inode_vec *inodes,
+                   struct block_vec *blocks);
+
+#endif
@@ -0,0 +1,169 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_read.h"
+#include "callback_pool.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "elevator.h"
+#include "pipeline.h"
+#include "radix_sort.h"
+#include "stripe.h"
+#include "stripe_uring.h"
+#include "util.h"
+
+/*
+ * Read every block of a set of inodes, max_inodes of them at a time in the
+ * order they're in, and hand each inode's data to cb in logical order (or all
+ * of them at once, in physical order, with ITERATE_OPT_PHYSICAL_ORDER), on
+ * callbacks' threads if it isn't NULL, or by way of batch if that isn't.
+ */
+void read_batches(struct batch_reader *reader, block_cb cb,
+                  struct callback_pool *callbacks, struct chunk_batch *batch,
+                  struct inode_vec *inodes, struct block_vec *blocks)
+{
+    ext2_filsys fs = reader->fs;
+    int flags = reader->flags;
+    // with nothing to put back in order, there's nothing to bound by batching
+    int max_inodes = flags & ITERATE_OPT_PHYSICAL_ORDER
+        ? INT_MAX : reader->max_inodes;
+    int max_blocks = reader->max_blocks;
+
+    int open_inodes_count = 0;
+    size_t next_inode = 0;
+
+    // every inode has been delivered in full (or dropped) at the end of a
+    // batch, so that's where to stop; within one, the rest of its blocks are
+    // dropped unread
+    while (next_inode < inodes->count
+           && (reader->stop == NULL
+               || !__atomic_load_n(reader->stop, __ATOMIC_RELAXED)))
+    {
+        if (flags & ITERATE_OPT_ELEVATOR)
+        {
+            elevator_admit(fs, reader->head, max_inodes,
+                           &inodes->inodes[next_inode],
+                           inodes->count - next_inode, blocks);
+        }
+
+        /*
+         * While there are inodes remaining and we're below the limit on open
+         * inodes, add those inodes' blocks to the batch.
+         */
+        size_t batch_start = next_inode;
+        size_t batch_count = 0;
+        while (next_inode < inodes->count && open_inodes_count < max_inodes)
+        {
+            struct inode_list *inode_list = &inodes->inodes[next_inode++];
+            LogDebug("Adding blocks of inode %d (%llu bytes) to block read list", inode_list->index, inode_list->len);
+
+            if (inode_list->blocks_count > 0)
+            {
+                batch_count += inode_list->blocks_count;
+                open_inodes_count++;
+                struct inode_cb_info *inode_info =
+                    blocks->blocks[inode_list->blocks_start].inode_info;
+                inode_info->callbacks = callbacks;
+                inode_info->batch = batch;
+                inode_info->physical_order =
+                    (flags & ITERATE_OPT_PHYSICAL_ORDER) != 0;
+            }
+        }
+
+        struct block_list *batch_blocks =
+            emalloc(sizeof(struct block_list)
+                    * (batch_count > 0 ? batch_count : 1));
+        size_t pos = 0;
+        for (size_t i = batch_start; i < next_inode; i++)
+        {
+            struct inode_list *inode_list = &inodes->inodes[i];
+            memcpy(&batch_blocks[pos],
+                   &blocks->blocks[inode_list->blocks_start],
+                   sizeof(struct block_list) * inode_list->blocks_count);
+            pos += inode_list->blocks_count;
+        }
+
+        // sort the blocks into the order in which they're laid out on disk
+        sort_blocks(batch_blocks, batch_count);
+        if (flags & ITERATE_OPT_ELEVATOR)
+            reader->head = elevator_sweep(reader->head, batch_blocks,
+                                          batch_count);
+
+        int max_inode_blocks = open_inodes_count > 0
+            ? (max_blocks+open_inodes_count-1)/open_inodes_count : max_blocks;
+
+        LogInfo("BEGIN BLOCK READ");
+
+        pos = heapify_holes(fs, cb, batch_blocks, batch_count,
+                            &open_inodes_count);
+
+        if (reader->pipeline != NULL)
+        {
+            pipeline_read_blocks(reader->pipeline, cb, max_inode_blocks,
+                                 &batch_blocks[pos], batch_count - pos,
+                                 &open_inodes_count, reader->stop);
+            pos = batch_count;
+        }
+
+#ifdef DJ_HAVE_URING
+        if (reader->uring != NULL)
+        {
+            uring_read_blocks(reader->uring, fs, cb, reader->coalesce_distance,
+                              max_inode_blocks, &batch_blocks[pos],
+                              batch_count - pos, &open_inodes_count,
+                              reader->stop);
+            pos = batch_count;
+        }
+#endif
+
+        int stopped = 0;
+        while (pos < batch_count)
+        {
+            if (!stopped)
+            {
+                stopped = skip_if_stopped(reader->stop, &batch_blocks[pos],
+                                          batch_count - pos);
+            }
+
+            struct stripe *stripe = next_stripe(fs->blocksize,
+                                                reader->coalesce_distance,
+                                                max_inode_blocks, SIZE_MAX,
+                                                &batch_blocks[pos],
+                                                batch_count - pos);
+            pos += stripe->blocks_count;
+
+            LogDebug("Found stripe of %lu blocks", stripe->consecutive_blocks);
+            // every block in it may belong to files that have been skipped
+            if (stripe->consecutive_blocks > 0)
+            {
+                read_stripe_data(reader->pool, fs->blocksize,
+                                 stripe->physical_block,
+                                 flags & ITERATE_OPT_DIRECT, reader->fd,
+                                 stripe);
+            }
+
+            heapify_stripe(fs, cb, stripe, max_inode_blocks,
+                           &open_inodes_count);
+        }
+
+        // every inode in the batch has been delivered in full, so nothing
+        // points into its blocks any more
+        free(batch_blocks);
+
+        LogInfo("END BLOCK READ");
+    }
+
+    // nothing may still be running once the read's been torn down
+    if (callbacks != NULL)
+        callback_pool_wait(callbacks, 0);
+
+    // a stopped read still holds the block maps of the inodes it never got to
+    for (; next_inode < inodes->count; next_inode++)
+    {
+        struct inode_list *inode_list = &inodes->inodes[next_inode];
+        for (size_t i = 0; i < inode_list->blocks_count; i++)
+            deref_inode(blocks->blocks[inode_list->blocks_start + i].inode_info);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef DJ_BATCH_READ_H
+#define DJ_BATCH_READ_H
+
+#include "dj_internal.h"
+
+/*
+ * Everything the read loop needs to get a set of inodes' blocks off the disk
+ * and into a callback, shared by the directory walk and the file reads.
+ */
+struct batch_reader
+{
+    ext2_filsys fs;
+    int fd;
+    int flags;
+    int max_inodes;
+    int max_blocks;
+    int coalesce_distance;
+
+    struct buffer_pool *pool;
+    struct pipeline *pipeline;
+    struct uring_reader *uring;
+
+    // where the last batch left the disk head, for the elevator
+    blk64_t head;
+
+    // set to end the read, dropping whatever's left of the current batch; may
+    // be NULL
+    int *stop;
+};
+
+void read_batches(struct batch_reader *reader, block_cb cb,
+                  struct callback_pool *callbacks, struct chunk_batch *batch,
+                  struct inode_vec *inodes, struct block_vec *blocks);
+
+#endif
@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_index.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "util.h"
+
+/*
+ * A block index remembers every file's path and block map from one run to the
+ * next, so that files that haven't changed since don't need their extent trees
+ * or indirect blocks read again. An inode's entry is only trusted if its
+ * generation (which changes when the inode number is reused), ctime and mtime
+ * (which change whenever its blocks do), i_version and size all still match.
+ * Seconds alone aren't enough, since a file can easily be rewritten within
+ * the second it was indexed in, so the times' nanoseconds count too, on file
+ * systems whose inodes are big enough to have them.
+ *
+ * The directory walk has to read every file's inode anyway (to tell files from
+ * directories, and for the filter), so it stamps each file as it goes, and a
+ * file the index has gets its blocks without its inode being read again. What
+ * the index saves, then, is a second inode read per file and the reads of its
+ * extent tree or indirect blocks, which for fragmented files on ext2/3 can be
+ * several random reads each. It doesn't save the walk itself, which still
+ * reads every directory's blocks and every file's inode. Files found by the
+ * inode table scan (ITERATE_OPT_INODE_SCAN) aren't stamped, so theirs are
+ * read again either way.
+ */
+
+// whether a large inode has room for a field, going by how much of it past
+// the original 128 bytes is in use
+#define INODE_HAS_FIELD(inode, field) \
+    (EXT2_GOOD_OLD_INODE_SIZE + (inode)->i_extra_isize \
+     >= offsetof(struct ext2_inode_large, field) + sizeof((inode)->field))
+
+/*
+ * Whether every entry's runs and path lie within the index, so that nothing
+ * read through it can stray outside the mapping.
+ */
+int block_index_check(struct block_index *index)
+{
+    struct block_index_header *header = index->header;
+    if (header->paths_len > 0 && index->paths[header->paths_len-1] != '\0')
+        return 0;
+
+    for (uint64_t i = 0; i < header->inodes_count; i++)
+    {
+        struct block_index_inode *entry = &index->inodes[i];
+        if (entry->runs_start > header->runs_count
+            || entry->runs_count > header->runs_count - entry->runs_start
+            || entry->path_offset >= header->paths_len)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Map the index at path, or return NULL if there isn't a usable one, such as
+ * on the first run, or if it was written for another file system.
+ */
+struct block_index *block_index_open(ext2_filsys fs, char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            LogWarn("Error opening block index %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct block_index_header))
+    {
+        LogWarn("Ignoring truncated block index %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        LogWarn("Error mapping block index %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct block_index *index = ecalloc(sizeof(struct block_index));
+    index->data = data;
+    index->len = st.st_size;
+    index->header = (struct block_index_header *)data;
+
+    struct block_index_header *header = index->header;
+    size_t expected_len = sizeof(struct block_index_header)
+        + header->inodes_count * sizeof(struct block_index_inode)
+        + header->runs_count * sizeof(struct block_index_run)
+        + header->paths_len;
+
+    if (memcmp(header->magic, BLOCK_INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != BLOCK_INDEX_VERSION)
+    {
+        LogWarn("Ignoring block index %s of unknown format", path);
+    }
+    else if (header->block_size != fs->blocksize
+             || memcmp(header->uuid, fs->super->s_uuid,
+                       sizeof(header->uuid)) != 0)
+    {
+        LogWarn("Ignoring block index %s of another file system", path);
+    }
+    // the counts are checked on their own first so that a wild one can't
+    // wrap expected_len around to the right length
+    else if (header->inodes_count > index->len
+             || header->runs_count > index->len
+             || index->len != expected_len)
+    {
+        LogWarn("Ignoring block index %s of the wrong length", path);
+    }
+    else
+    {
+        index->inodes = (struct block_index_inode *)(header + 1);
+        index->runs = (struct block_index_run *)
+            (index->inodes + header->inodes_count);
+        index->paths = (char *)(index->runs + header->runs_count);
+
+        if (block_index_check(index))
+        {
+            LogInfo("Loaded block index of %lu files from %s",
+                    header->inodes_count, path);
+            return index;
+        }
+        LogWarn("Ignoring corrupt block index %s", path);
+    }
+
+    block_index_close(index);
+    return NULL;
+}
+
+void block_index_close(struct block_index *index)
+{
+    munmap(index->data, index->len);
+    free(index);
+}
+
+/*
+ * The index's first entry for an inode number, whatever its contents, or NULL.
+ * Safe to call from several threads at once, as is block_index_lookup().
+ */
+struct block_index_inode *block_index_find(struct block_index *index,
+                                           ext2_ino_t ino)
+{
+    size_t lo = 0, hi = index->header->inodes_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->inodes[mid].ino < ino)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == index->header->inodes_count || index->inodes[lo].ino != ino)
+        return NULL;
+    return &index->inodes[lo];
+}
+
+/*
+ * Read the whole of an inode, large fields and all, for block_index_stamp().
+ * It starts with an ordinary struct ext2_inode, for everything else.
+ */
+void block_index_read_inode(ext2_filsys fs, ext2_ino_t ino,
+                            struct ext2_inode_large *inode)
+{
+    memset(inode, 0, sizeof(struct ext2_inode_large));
+    CHECK_FATAL(ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)inode,
+                                       sizeof(struct ext2_inode_large)),
+            "while reading inode contents");
+}
+
+/*
+ * Fill in what the index keys an inode on, out of the inode as read with
+ * block_index_read_inode(), along with whether its data is inline, which is
+ * the one other thing scanning its blocks needs to know if the index has them.
+ * The parts that only large inodes have are left at 0 on file systems with
+ * 128-byte inodes, and on inodes that predate them.
+ */
+void block_index_stamp(ext2_filsys fs, struct ext2_inode_large *inode,
+                       struct inode_list *inode_list)
+{
+    inode_list->stamped = 1;
+    inode_list->inline_data = (inode->i_flags & EXT4_INLINE_DATA_FL) != 0;
+    inode_list->generation = inode->i_generation;
+    inode_list->ctime = inode->i_ctime;
+    inode_list->mtime = inode->i_mtime;
+    inode_list->version = inode->osd1.linux1.l_i_version;
+    inode_list->ctime_extra = 0;
+    inode_list->mtime_extra = 0;
+
+    if (EXT2_INODE_SIZE(fs->super) <= EXT2_GOOD_OLD_INODE_SIZE)
+        return;
+    if (INODE_HAS_FIELD(inode, i_ctime_extra))
+        inode_list->ctime_extra = inode->i_ctime_extra;
+    if (INODE_HAS_FIELD(inode, i_mtime_extra))
+        inode_list->mtime_extra = inode->i_mtime_extra;
+    if (INODE_HAS_FIELD(inode, i_version_hi))
+        inode_list->version |= (uint64_t)inode->i_version_hi << 32;
+}
+
+/*
+ * Whether an entry still describes an inode, as stamped.
+ */
+int block_index_current(struct block_index_inode *entry,
+                        struct inode_list *inode_list)
+{
+    return entry->generation == inode_list->generation
+        && entry->ctime == inode_list->ctime
+        && entry->ctime_extra == inode_list->ctime_extra
+        && entry->mtime == inode_list->mtime
+        && entry->mtime_extra == inode_list->mtime_extra
+        && entry->version == inode_list->version
+        && entry->len == inode_list->len;
+}
+
+/*
+ * The index's entry for an inode, if it's still good for the inode's current
+ * contents. The inode must have been stamped with block_index_stamp().
+ */
+struct block_index_inode *block_index_lookup(struct block_index *index,
+                                             struct inode_list *inode_list)
+{
+    struct block_index_inode *entry = block_index_find(index,
+                                                       inode_list->index);
+    if (entry == NULL || !block_index_current(entry, inode_list))
+        return NULL;
+    return entry;
+}
+
+/*
+ * Write out every inode's path and blocks, as scanned, for the next run. The
+ * inodes must be in inode number order. The index is written alongside and
+ * renamed over the old one, so a run that dies halfway leaves the old one be.
+ */
+void block_index_write(ext2_filsys fs, char *path, struct inode_vec *inodes,
+                       struct block_vec *blocks)
+{
+    struct block_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BLOCK_INDEX_MAGIC, sizeof(header.magic));
+    header.version = BLOCK_INDEX_VERSION;
+    header.block_size = fs->blocksize;
+    memcpy(header.uuid, fs->super->s_uuid, sizeof(header.uuid));
+    header.inodes_count = inodes->count;
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        header.runs_count += inodes->inodes[i].blocks_count;
+        header.paths_len += path_arena_path_len(&inodes->paths,
+                                                inodes->inodes[i].dir,
+                                                inodes->inodes[i].name) + 1;
+    }
+
+    char tmp_path[strlen(path) + 5];
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL)
+    {
+        LogWarn("Error creating block index %s: %s", tmp_path,
+                strerror(errno));
+        return;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+
+    uint64_t runs_start = 0;
+    uint64_t path_offset = 0;
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        struct inode_list *inode_list = &inodes->inodes[i];
+        struct block_index_inode entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.ino = inode_list->index;
+        entry.generation = inode_list->generation;
+        entry.ctime = inode_list->ctime;
+        entry.ctime_extra = inode_list->ctime_extra;
+        entry.mtime = inode_list->mtime;
+        entry.mtime_extra = inode_list->mtime_extra;
+        entry.version = inode_list->version;
+        entry.len = inode_list->len;
+        entry.path_offset = path_offset;
+        entry.runs_start = runs_start;
+        entry.runs_count = inode_list->blocks_count;
+        fwrite(&entry, sizeof(entry), 1, file);
+
+        runs_start += inode_list->blocks_count;
+        path_offset += path_arena_path_len(&inodes->paths, inode_list->dir,
+                                           inode_list->name) + 1;
+    }
+
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        struct inode_list *inode_list = &inodes->inodes[i];
+        for (size_t j = 0; j < inode_list->blocks_count; j++)
+        {
+            struct block_list *block =
+                &blocks->blocks[inode_list->blocks_start + j];
+            struct block_index_run run = {
+                block->physical_block, block->logical_block, block->num_blocks
+            };
+            fwrite(&run, sizeof(run), 1, file);
+        }
+    }
+
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        char *inode_path = path_arena_path(&inodes->paths,
+                                           inodes->inodes[i].dir,
+                                           inodes->inodes[i].name);
+        fwrite(inode_path, strlen(inode_path) + 1, 1, file);
+        free(inode_path);
+    }
+
+    int write_error = ferror(file);
+    if (fclose(file) != 0 || write_error)
+    {
+        LogWarn("Error writing block index %s", tmp_path);
+        unlink(tmp_path);
+        return;
+    }
+
+    if (rename(tmp_path, path) != 0)
+    {
+        LogWarn("Error replacing block index %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+
+    LogInfo("Wrote block index of %lu files to %s", inodes->count, path);
+}
@@ -0,0 +1,74 @@
+#ifndef DJ_BLOCK_INDEX_H
+#define DJ_BLOCK_INDEX_H
+
+#include "dj_internal.h"
+
+/*
+ * On-disk layout of a block index: a header, then the inodes sorted on inode
+ * number, then their runs of blocks, then their NUL-terminated paths. All in
+ * native byte order, since the index is only meant to be reused on the machine
+ * that wrote it.
+ */
+#define BLOCK_INDEX_MAGIC "DJINDEX"
+#define BLOCK_INDEX_VERSION 2
+
+struct block_index_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint8_t uuid[16];
+    uint64_t inodes_count;
+    uint64_t runs_count;
+    uint64_t paths_len;
+};
+
+struct block_index_inode
+{
+    uint32_t ino;
+    uint32_t generation;
+    uint32_t ctime;
+    uint32_t ctime_extra;
+    uint32_t mtime;
+    uint32_t mtime_extra;
+    uint64_t version;
+    uint64_t len;
+    uint64_t path_offset;
+    uint64_t runs_start;
+    uint64_t runs_count;
+};
+
+struct block_index_run
+{
+    uint64_t physical_block;
+    uint64_t logical_block;
+    uint64_t num_blocks;
+};
+
+struct block_index
+{
+    char *data;
+    size_t len;
+
+    struct block_index_header *header;
+    struct block_index_inode *inodes;
+    struct block_index_run *runs;
+    char *paths;
+};
+
+struct block_index *block_index_open(ext2_filsys fs, char *path);
+void block_index_close(struct block_index *index);
+struct block_index_inode *block_index_find(struct block_index *index,
+                                           ext2_ino_t ino);
+void block_index_read_inode(ext2_filsys fs, ext2_ino_t ino,
+                            struct ext2_inode_large *inode);
+void block_index_stamp(ext2_filsys fs, struct ext2_inode_large *inode,
+                       struct inode_list *inode_list);
+int block_index_current(struct block_index_inode *entry,
+                        struct inode_list *inode_list);
+struct block_index_inode *block_index_lookup(struct block_index *index,
+                                             struct inode_list *inode_list);
+void block_index_write(ext2_filsys fs, char *path, struct inode_vec *inodes,
+                       struct block_vec *blocks);
+
+#endif
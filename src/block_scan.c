@@ -1,66 +1,53 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "block_index.h"
 #include "block_scan.h"
 #include "clog.h"
+#include "path_arena.h"
 #include "util.h"
+#include "vec.h"
 
 /*
- * Callback (indirectly) invoked by libext2fs for each block of a file.
- * - Increments the reference count of the block's inode.
- * - Sets the block's metadata (such as logical and physical numbers and length)
- *   in a block_list struct.
- * - Inserts the block_list struct into the inode's linked list of its blocks.
- * - Recursively calls itself to add blocks for holes.
+ * Add a run of num_blocks blocks, starting at the given physical and logical
+ * block, to the end of the inode's block list, extending the last entry if
+ * the run continues it. A physical block of 0 means the run is a hole.
  */
-void scan_block(uint64_t block_size, blk64_t physical_block,
-                e2_blkcnt_t logical_block, struct scan_blocks_info *scan_info)
+void scan_block_run(uint64_t block_size, blk64_t physical_block,
+                    e2_blkcnt_t logical_block, e2_blkcnt_t num_blocks,
+                    struct scan_blocks_info *scan_info)
 {
-    // Ignore the extra "empty" block at the end of a file, to allow appending
-    // for writers, when we pass in BLOCK_FLAG_HOLE, unless the file is empty
-    if (logical_block * block_size >= scan_info->inode_info->len
-        || scan_info->inode_info->len == 0)
-    {
-        return;
-    }
-
     struct inode_list *inode_list = scan_info->inode_list;
-    struct block_list *blocks_end = inode_list->blocks_end;
+    struct block_vec *blocks = scan_info->blocks;
+    struct block_list *blocks_end = inode_list->blocks_count > 0
+        ? &blocks->blocks[blocks->count-1] : NULL;
     struct block_list *list;
 
-    if (blocks_end != NULL && (blocks_end->physical_block + blocks_end->num_blocks) == physical_block)
+    int continues_hole = physical_block == 0 && blocks_end != NULL
+                         && blocks_end->physical_block == 0;
+    int continues_run = physical_block != 0 && blocks_end != NULL
+                        && blocks_end->physical_block != 0
+                        && (blocks_end->physical_block + blocks_end->num_blocks) == physical_block;
+
+    if (continues_hole || continues_run)
     {
         list = blocks_end;
     }
     else
     {
-        list = ecalloc(sizeof(struct block_list));
+        if (inode_list->blocks_count == 0)
+            inode_list->blocks_start = blocks->count;
+        inode_list->blocks_count++;
+
+        list = block_vec_append(blocks);
         list->inode_info = scan_info->inode_info;
         list->inode_info->references++;
         list->physical_block = physical_block;
         list->logical_block = logical_block;
-
-        // FIXME what happens when holes are at the end of the file?
-        for (e2_blkcnt_t i = list->inode_info->blocks_scanned;
-             i < logical_block; i++)
-        {
-            // sparse files' hole blocks should be passed to this function, since we
-            // passed BLOCK_FLAG_HOLE to the iterator function, but that doesn't
-            // seem to be happening - so fix it
-            scan_block(block_size, 0, i, scan_info);
-        }
-
-        if (inode_list->blocks_start == NULL)
-        {
-            inode_list->blocks_start = list;
-            inode_list->blocks_end = list;
-        }
-        else
-        {
-            inode_list->blocks_end->next = list;
-            inode_list->blocks_end = list;
-        }
     }
 
-    scan_info->inode_info->blocks_scanned++;
-    list->num_blocks++;
+    scan_info->inode_info->blocks_scanned += num_blocks;
+    list->num_blocks += num_blocks;
 
     uint64_t logical_pos = list->logical_block * block_size;
     uint64_t remaining_len = list->inode_info->len - logical_pos;
@@ -70,6 +57,67 @@ void scan_block(uint64_t block_size, blk64_t physical_block,
     LogTrace("Physical block %lu (%lu) is logical block %lu (%lu) of size %lu for inode %d", list->physical_block + list->num_blocks - 1, list->physical_block, list->logical_block + list->num_blocks - 1, list->logical_block, list->stripe_ptr.len, scan_info->inode_info->inode);
 }
 
+/*
+ * Add num_blocks blocks of a file, starting at the given physical and logical
+ * block, to its block list.
+ * - Increments the reference count of the blocks' inode.
+ * - Sets the blocks' metadata (such as logical and physical numbers and
+ *   length) in a block_list struct.
+ * - Appends the block_list struct to the inode's range of the block array.
+ * - Adds a single hole entry for any blocks skipped since the last call.
+ */
+void scan_extent(uint64_t block_size, blk64_t physical_block,
+                 e2_blkcnt_t logical_block, e2_blkcnt_t num_blocks,
+                 struct scan_blocks_info *scan_info)
+{
+    // Ignore blocks past the end of the file, such as the extra "empty" block
+    // that we get for passing in BLOCK_FLAG_HOLE, or extents preallocated
+    // with FALLOC_FL_KEEP_SIZE
+    e2_blkcnt_t len_blocks =
+        (scan_info->inode_info->len + block_size - 1) / block_size;
+    if (logical_block >= len_blocks)
+        return;
+    if (logical_block + num_blocks > len_blocks)
+        num_blocks = len_blocks - logical_block;
+
+    // sparse files' hole blocks should be passed to this function, since we
+    // passed BLOCK_FLAG_HOLE to the iterator function, but that doesn't seem
+    // to be happening - so fill them in here
+    e2_blkcnt_t blocks_scanned = scan_info->inode_info->blocks_scanned;
+    if (logical_block > blocks_scanned)
+    {
+        scan_block_run(block_size, 0, blocks_scanned,
+                       logical_block - blocks_scanned, scan_info);
+    }
+
+    scan_block_run(block_size, physical_block, logical_block, num_blocks,
+                   scan_info);
+}
+
+/*
+ * Callback (indirectly) invoked by libext2fs for each block of a file.
+ */
+void scan_block(uint64_t block_size, blk64_t physical_block,
+                e2_blkcnt_t logical_block, struct scan_blocks_info *scan_info)
+{
+    scan_extent(block_size, physical_block, logical_block, 1, scan_info);
+}
+
+/*
+ * Add a hole for any blocks between the last one scanned and the end of the
+ * file, which the block iterator never tells us about.
+ */
+void scan_trailing_hole(uint64_t block_size, struct scan_blocks_info *scan_info)
+{
+    struct inode_cb_info *info = scan_info->inode_info;
+    e2_blkcnt_t len_blocks = (info->len + block_size - 1) / block_size;
+    if (info->blocks_scanned < len_blocks)
+    {
+        scan_block_run(block_size, 0, info->blocks_scanned,
+                       len_blocks - info->blocks_scanned, scan_info);
+    }
+}
+
 /*
  * Wraps the actual callback with a function whose signature libext2fs expects,
  * which makes the actual function easier to test.
@@ -81,47 +129,316 @@ int scan_block_cb(ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt,
     return 0;
 }
 
-void scan_blocks(ext2_filsys fs, block_cb cb, struct inode_list *inode_list)
+/*
+ * Add the blocks of one leaf extent. Unwritten extents read as zeros, so
+ * they're added as holes.
+ */
+void scan_leaf_extent(uint64_t block_size, struct ext2fs_extent *extent,
+                      struct scan_blocks_info *scan_info)
+{
+    blk64_t physical_block = extent->e_flags & EXT2_EXTENT_FLAGS_UNINIT
+        ? 0 : extent->e_pblk;
+    scan_extent(block_size, physical_block, extent->e_lblk, extent->e_len,
+                scan_info);
+}
+
+/*
+ * Add an extent-mapped inode's blocks a whole leaf extent at a time, rather
+ * than have ext2fs_block_iterate3() split the extents back up into blocks.
+ */
+void scan_extents(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                  struct scan_blocks_info *scan_info)
 {
-    char block_buf[fs->blocksize * 3];
-    struct scan_blocks_info scan_info = { cb, NULL, NULL };
+    ext2_extent_handle_t handle;
+    CHECK_FATAL(ext2fs_extent_open2(fs, ino, inode, &handle),
+            "while opening extent tree of inode %d", ino);
 
-    /*
-     * For each inode, add the metadata for each of that inode's blocks to the
-     * inode's block list.
-     */
-    struct inode_list *scan_inode_list = inode_list;
-    while (scan_inode_list != NULL)
+    struct ext2fs_extent extent;
+    int op = EXT2_EXTENT_ROOT;
+    while (1)
     {
-        struct inode_cb_info *info = ecalloc(sizeof(struct inode_cb_info));
-        info->inode = scan_inode_list->index;
-        info->path = emalloc(strlen(scan_inode_list->path)+1);
-        strcpy(info->path, scan_inode_list->path);
-        info->len = scan_inode_list->len;
+        errcode_t err = ext2fs_extent_get(handle, op, &extent);
+        if (err == EXT2_ET_EXTENT_NO_NEXT)
+            break;
+        CHECK_FATAL(err, "while reading extents of inode %d", ino);
+        op = EXT2_EXTENT_NEXT;
+
+        // index nodes get visited on the way back up, too
+        if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF))
+            continue;
+
+        scan_leaf_extent(fs->blocksize, &extent, scan_info);
+    }
+
+    ext2fs_extent_free(handle);
+}
+
+/*
+ * Add an inode's blocks as they were recorded in the block index.
+ */
+void scan_indexed_blocks(uint64_t block_size, struct block_index *index,
+                         struct block_index_inode *entry,
+                         struct scan_blocks_info *scan_info)
+{
+    for (uint64_t i = 0; i < entry->runs_count; i++)
+    {
+        struct block_index_run *run = &index->runs[entry->runs_start + i];
+        scan_block_run(block_size, run->physical_block, run->logical_block,
+                       run->num_blocks, scan_info);
+    }
+}
+
+/*
+ * Add the metadata for each of an inode's blocks to the inode's block list.
+ * Empty files have no blocks, and are left with an empty range. Returns 1 if
+ * the blocks came out of the index rather than the inode's block map.
+ */
+int scan_inode_blocks(ext2_filsys fs, char *block_buf, block_cb cb,
+                      struct path_arena *paths, struct inode_list *inode_list,
+                      struct block_vec *blocks, struct block_index *index)
+{
+    // the whole of a large inode, for the block index's nanosecond times,
+    // though the walk has usually already stamped the file out of its own read
+    // of it, so that one the index has needn't be read again
+    struct ext2_inode_large large_inode;
+    struct ext2_inode *inode_contents = (struct ext2_inode *)&large_inode;
+    int inode_read = 0;
+    if (!inode_list->stamped)
+    {
+        block_index_read_inode(fs, inode_list->index, &large_inode);
+        block_index_stamp(fs, &large_inode, inode_list);
+        inode_read = 1;
+    }
+
+    // there are no blocks to map when the data is in the inode itself; see
+    // inline_data.c
+    if (inode_list->inline_data)
+        return 0;
+
+    // the path itself isn't built until the client needs it
+    struct inode_cb_info *info = ecalloc(sizeof(struct inode_cb_info));
+    info->inode = inode_list->index;
+    info->paths = paths;
+    info->dir = inode_list->dir;
+    info->name = inode_list->name;
+    info->len = inode_list->len;
+    info->links_start = inode_list->links_start;
+    info->links_count = inode_list->links_count;
+    if (info->links_count > 0)
+        info->links = ecalloc(sizeof(struct link_cb_info) * info->links_count);
 
-        LogDebug("Scanning blocks of inode %d: %s", info->inode, info->path);
+    LogDebug("Scanning blocks of inode %d", info->inode);
 
-        // there's some duplication of information (path and len) between
-        // scan_info.inode_info and .inode_list, but that's ok
-        scan_info.inode_info = info;
-        scan_info.inode_list = scan_inode_list;
+    // there's some duplication of information (len) between
+    // scan_info.inode_info and .inode_list, but that's ok
+    struct scan_blocks_info scan_info = { cb, info, inode_list, blocks };
 
+    struct block_index_inode *entry = index != NULL
+        ? block_index_lookup(index, inode_list) : NULL;
+    if (entry == NULL && !inode_read)
+        block_index_read_inode(fs, inode_list->index, &large_inode);
+
+    if (entry != NULL)
+        scan_indexed_blocks(fs->blocksize, index, entry, &scan_info);
+    else if (inode_contents->i_flags & EXT4_EXTENTS_FL)
+        scan_extents(fs, info->inode, inode_contents, &scan_info);
+    else
+    {
+        // ext2/3 indirect block maps really are a block at a time
         int iter_flags = BLOCK_FLAG_HOLE | BLOCK_FLAG_DATA_ONLY
                          | BLOCK_FLAG_READ_ONLY;
         CHECK_FATAL(ext2fs_block_iterate3(fs, info->inode, iter_flags,
-                                          block_buf, scan_block_cb, &scan_info),
+                                          block_buf, scan_block_cb,
+                                          &scan_info),
                 "while iterating over blocks of inode %d", info->inode);
+    }
+
+    scan_trailing_hole(fs->blocksize, &scan_info);
+
+    if (info->references == 0)
+    {
+        free(info->links);
+        free(info->path);
+        free(info);
+    }
+
+    return entry != NULL;
+}
+
+/*
+ * Empty files generate no blocks, so they'd never reach the callback through
+ * the read loop; give it their one, empty call directly, under each name.
+ */
+void notify_empty_file(block_cb cb, struct path_arena *paths,
+                       struct inode_list *inode_list)
+{
+    void *cb_private = NULL;
+    char *path = path_arena_path(paths, inode_list->dir, inode_list->name);
+    cb(inode_list->index, path, 0, 0, NULL, 0, &cb_private);
+    free(path);
+
+    for (size_t i = 0; i < inode_list->links_count; i++)
+    {
+        struct path_link *link = &paths->links[inode_list->links_start + i];
+        cb_private = NULL;
+        path = path_arena_path(paths, link->dir, link->name);
+        cb(inode_list->index, path, 0, 0, NULL, 0, &cb_private);
+        free(path);
+    }
+}
 
-        if (info->references == 0)
+/*
+ * Give every empty file still in the read plan its call. This comes after the
+ * incremental plan, if any, so that on_change always comes first.
+ */
+void notify_empty_files(block_cb cb, struct inode_vec *inodes)
+{
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        struct inode_list *inode_list = &inodes->inodes[i];
+        if (inode_list->blocks_count == 0 && !inode_list->inline_data
+            && !inode_list->dropped)
         {
-            // empty files generate no blocks, so we'd get into an infinite loop
-            // below
-            scan_info.cb(info->inode, info->path, 0, 0, NULL, 0,
-                         &info->cb_private);
-            free(info->path);
-            free(info);
+            notify_empty_file(cb, &inodes->paths, inode_list);
         }
+    }
+}
+
+void log_indexed_count(struct block_index *index, size_t indexed,
+                       size_t count)
+{
+    if (index != NULL)
+    {
+        LogInfo("Took block maps of %lu of %lu files from the block index",
+                indexed, count);
+    }
+}
+
+void scan_blocks(ext2_filsys fs, block_cb cb, struct inode_vec *inodes,
+                 struct block_vec *blocks, struct block_index *index)
+{
+    char block_buf[fs->blocksize * 3];
+    size_t indexed = 0;
+
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        struct inode_list *inode_list = &inodes->inodes[i];
+        indexed += scan_inode_blocks(fs, block_buf, cb, &inodes->paths,
+                                     inode_list, blocks, index);
+    }
 
-        scan_inode_list = scan_inode_list->next;
+    log_indexed_count(index, indexed, inodes->count);
+}
+
+struct block_scan_chunk
+{
+    pthread_t thread;
+    char *dev_path;
+    block_cb cb;
+    struct path_arena *paths;
+    struct inode_list *start;
+    size_t count;
+    struct block_index *index;
+    size_t indexed;
+
+    // the chunk's own blocks, with its inodes' ranges relative to them until
+    // they're all joined up
+    struct block_vec blocks;
+
+    // the thread's own handle on the file system, and where its errors go, to
+    // be raised again once it's been joined
+    ext2_filsys fs;
+    int failed;
+    struct error_trap trap;
+};
+
+void block_scan_chunk_run(struct block_scan_chunk *chunk)
+{
+    // libext2fs handles aren't thread-safe, so each thread gets its own
+    CHECK_FATAL(ext2fs_open(chunk->dev_path, 0, 0, 0, unix_io_manager,
+                            &chunk->fs),
+            "while opening file system on device %s", chunk->dev_path);
+    char block_buf[chunk->fs->blocksize * 3];
+
+    for (size_t i = 0; i < chunk->count; i++)
+    {
+        chunk->indexed += scan_inode_blocks(chunk->fs, block_buf, chunk->cb,
+                                            chunk->paths, &chunk->start[i],
+                                            &chunk->blocks, chunk->index);
     }
-}
\ No newline at end of file
+}
+
+void *block_scan_worker(void *private)
+{
+    struct block_scan_chunk *chunk = private;
+    if (setjmp(chunk->trap.jump))
+        chunk->failed = 1;
+    else
+    {
+        error_trap_set(&chunk->trap);
+        block_scan_chunk_run(chunk);
+        error_trap_clear();
+    }
+
+    if (chunk->fs != NULL)
+        ext2fs_close(chunk->fs);
+    return NULL;
+}
+
+/*
+ * Same as scan_blocks(), with the inode array split into a contiguous chunk per
+ * thread. The block array comes out exactly as it would serially, and empty
+ * files are reported afterwards, from this thread, in array order. An error
+ * on any of the threads is raised on this one once they've all finished, and
+ * the blocks the threads had mapped are lost.
+ */
+void scan_blocks_parallel(char *dev_path, block_cb cb, struct inode_vec *inodes,
+                          struct block_vec *blocks, struct block_index *index,
+                          int threads)
+{
+    size_t indexed = 0;
+    size_t count = inodes->count;
+    size_t chunk_len = (count + threads - 1) / threads;
+    struct block_scan_chunk chunks[threads];
+    int chunks_count = 0;
+
+    for (size_t scanned = 0; scanned < count; scanned += chunk_len)
+    {
+        struct block_scan_chunk *chunk = &chunks[chunks_count++];
+        memset(chunk, 0, sizeof(struct block_scan_chunk));
+        chunk->dev_path = dev_path;
+        chunk->cb = cb;
+        chunk->index = index;
+        chunk->paths = &inodes->paths;
+        chunk->start = &inodes->inodes[scanned];
+        chunk->count = count - scanned < chunk_len ? count - scanned : chunk_len;
+
+        if (pthread_create(&chunk->thread, NULL, block_scan_worker, chunk))
+            exit_str("Error creating block scan thread");
+    }
+
+    struct block_scan_chunk *failed = NULL;
+    for (int i = 0; i < chunks_count; i++)
+    {
+        pthread_join(chunks[i].thread, NULL);
+        if (chunks[i].failed && failed == NULL)
+            failed = &chunks[i];
+    }
+    if (failed != NULL)
+    {
+        for (int i = 0; i < chunks_count; i++)
+            free(chunks[i].blocks.blocks);
+        error_trap_raise(&failed->trap);
+    }
+
+    for (int i = 0; i < chunks_count; i++)
+    {
+        struct block_scan_chunk *chunk = &chunks[i];
+        size_t offset = block_vec_concat(blocks, &chunk->blocks);
+        for (size_t j = 0; j < chunk->count; j++)
+            chunk->start[j].blocks_start += offset;
+        indexed += chunk->indexed;
+    }
+
+    log_indexed_count(index, indexed, count);
+}
@@ -8,8 +8,24 @@ struct scan_blocks_info
     block_cb cb;
     struct inode_cb_info *inode_info;
     struct inode_list *inode_list;
+    struct block_vec *blocks;
 };
 
-void scan_blocks(ext2_filsys fs, block_cb cb, struct inode_list *inode_list);
+void scan_extent(uint64_t block_size, blk64_t physical_block,
+                 e2_blkcnt_t logical_block, e2_blkcnt_t num_blocks,
+                 struct scan_blocks_info *scan_info);
+void scan_trailing_hole(uint64_t block_size, struct scan_blocks_info *scan_info);
+void scan_leaf_extent(uint64_t block_size, struct ext2fs_extent *extent,
+                      struct scan_blocks_info *scan_info);
+
+int scan_inode_blocks(ext2_filsys fs, char *block_buf, block_cb cb,
+                      struct path_arena *paths, struct inode_list *inode_list,
+                      struct block_vec *blocks, struct block_index *index);
+void notify_empty_files(block_cb cb, struct inode_vec *inodes);
+void scan_blocks(ext2_filsys fs, block_cb cb, struct inode_vec *inodes,
+                 struct block_vec *blocks, struct block_index *index);
+void scan_blocks_parallel(char *dev_path, block_cb cb, struct inode_vec *inodes,
+                          struct block_vec *blocks, struct block_index *index,
+                          int threads);
 
 #endif
\ No newline at end of file
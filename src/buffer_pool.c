@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+#include "clog.h"
+#include "util.h"
+
+/*
+ * Size class of a buffer of len bytes, or -1 if it's too big to pool.
+ */
+int buffer_pool_class(size_t len)
+{
+    int class = 0;
+    while (((size_t)1 << (class + BUFFER_POOL_MIN_SHIFT)) < len)
+    {
+        if (++class == BUFFER_POOL_CLASSES)
+            return -1;
+    }
+    return class;
+}
+
+struct buffer_pool *buffer_pool_create(size_t max_bytes)
+{
+    struct buffer_pool *pool = ecalloc(sizeof(struct buffer_pool));
+    pool->max_bytes = max_bytes;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->retained_cond, NULL);
+    return pool;
+}
+
+void buffer_pool_destroy(struct buffer_pool *pool)
+{
+    LogInfo("Buffer pool: %lu hits, %lu misses, %lu buffers dropped",
+            pool->hits, pool->misses, pool->drops);
+
+    for (int class = 0; class < BUFFER_POOL_CLASSES; class++)
+    {
+        while (pool->free_lists[class] != NULL)
+        {
+            void *buf = pool->free_lists[class];
+            pool->free_lists[class] = *(void **)buf;
+            free(buf);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->retained_cond);
+    free(pool);
+}
+
+/*
+ * Get a 4096-byte aligned buffer (which also satisfies O_DIRECT's 512-byte
+ * alignment) of at least len bytes.
+ */
+void *buffer_pool_get(struct buffer_pool *pool, size_t len)
+{
+    int class = buffer_pool_class(len);
+    size_t alloc_len = len;
+
+    if (class >= 0)
+    {
+        alloc_len = (size_t)1 << (class + BUFFER_POOL_MIN_SHIFT);
+
+        pthread_mutex_lock(&pool->lock);
+        void *buf = pool->free_lists[class];
+        if (buf != NULL)
+        {
+            pool->free_lists[class] = *(void **)buf;
+            pool->free_bytes -= alloc_len;
+            pool->hits++;
+            pthread_mutex_unlock(&pool->lock);
+            return buf;
+        }
+        pool->misses++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    else
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->misses++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    void *buf;
+    if (posix_memalign(&buf, 4096, alloc_len))
+        exit_str("Error allocating %lu bytes of aligned memory", alloc_len);
+    return buf;
+}
+
+/*
+ * Return a buffer of len bytes (the length it was requested with, not the
+ * size of its class) to the pool, or free it if the pool is full.
+ */
+void buffer_pool_put(struct buffer_pool *pool, void *buf, size_t len)
+{
+    int class = buffer_pool_class(len);
+    if (class >= 0)
+    {
+        size_t alloc_len = (size_t)1 << (class + BUFFER_POOL_MIN_SHIFT);
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free_bytes + alloc_len <= pool->max_bytes)
+        {
+            *(void **)buf = pool->free_lists[class];
+            pool->free_lists[class] = buf;
+            pool->free_bytes += alloc_len;
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+        pool->drops++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(buf);
+}
+
+/*
+ * Count a buffer the client has retained, and uncount it once it's been
+ * released (and given back).
+ */
+void buffer_pool_retain(struct buffer_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->retained++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void buffer_pool_unretain(struct buffer_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->retained == 0)
+        pthread_cond_broadcast(&pool->retained_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for the client to release every buffer it's retained, which it may be
+ * doing from other threads, before the memory behind them is torn down.
+ */
+void buffer_pool_wait_retained(struct buffer_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->retained > 0)
+        LogInfo("Waiting for %lu retained buffers to be released",
+                pool->retained);
+    while (pool->retained > 0)
+        pthread_cond_wait(&pool->retained_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,43 @@
+#ifndef DJ_BUFFER_POOL_H
+#define DJ_BUFFER_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// buffers are sized in powers of two from 4 KiB up to 64 MiB; anything bigger
+// bypasses the pool
+#define BUFFER_POOL_MIN_SHIFT 12
+#define BUFFER_POOL_CLASSES 15
+
+struct buffer_pool
+{
+    pthread_mutex_t lock;
+
+    // free buffers of each size class, linked through their first bytes
+    void *free_lists[BUFFER_POOL_CLASSES];
+
+    // total size of the free buffers, which never exceeds max_bytes; buffers
+    // that have been handed out aren't counted or capped here
+    size_t max_bytes;
+    size_t free_bytes;
+
+    // reported through dj_options.stats
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t drops;
+
+    // buffers the client has kept past its callback; see retain.c
+    size_t retained;
+    pthread_cond_t retained_cond;
+};
+
+struct buffer_pool *buffer_pool_create(size_t max_bytes);
+void buffer_pool_destroy(struct buffer_pool *pool);
+void *buffer_pool_get(struct buffer_pool *pool, size_t len);
+void buffer_pool_put(struct buffer_pool *pool, void *buf, size_t len);
+void buffer_pool_retain(struct buffer_pool *pool);
+void buffer_pool_unretain(struct buffer_pool *pool);
+void buffer_pool_wait_retained(struct buffer_pool *pool);
+
+#endif
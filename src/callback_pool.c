@@ -0,0 +1,285 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "callback_pool.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "stripe.h"
+#include "util.h"
+
+/*
+ * Runs the client's callbacks on a pool of threads, for clients that spend
+ * longer on each chunk (hashing it, say) than it takes to read it. Every
+ * inode's chunks go to the same thread, picked by inode number, and each
+ * thread works through its own queue in order, so an inode's chunks still
+ * arrive one at a time and in logical order, and its private pointer is only
+ * ever touched by one thread at once.
+ *
+ * A chunk keeps its stripe and inode alive until its callback has returned.
+ * Finished chunks are handed back to the reading thread, which drops those
+ * references itself, so that inode reference counts are still only ever
+ * touched from the one thread. The number of chunks in flight is capped, which also
+ * caps the memory they hold on to.
+ *
+ * A worker that fails stops taking chunks, and the reading thread raises its
+ * error the next time it waits on the pool.
+ */
+
+// chunks queued or running per thread before the reading thread waits
+#define CALLBACK_POOL_CHUNKS_PER_THREAD 16
+
+struct callback_task
+{
+    block_cb cb;
+    struct inode_cb_info *inode_info;
+    uint64_t pos;
+    char *data;
+    uint64_t data_len;
+    struct stripe *stripe;
+    struct callback_task *next;
+};
+
+struct callback_queue
+{
+    struct callback_task *head;
+    struct callback_task *tail;
+};
+
+struct callback_worker
+{
+    pthread_t thread;
+    struct callback_pool *pool;
+    struct callback_queue queue;
+    pthread_cond_t cond;
+
+    // where the worker's errors go
+    struct error_trap trap;
+};
+
+struct callback_pool
+{
+    pthread_mutex_t lock;
+
+    struct callback_worker *workers;
+    int workers_count;
+
+    // finished chunks, waiting for the reading thread to let go of them
+    struct callback_queue done;
+    pthread_cond_t done_cond;
+
+    size_t in_flight;
+    size_t max_in_flight;
+    int stop;
+
+    // the first worker to have failed, if any
+    struct callback_worker *failed;
+};
+
+void callback_queue_push(struct callback_queue *queue,
+                         struct callback_task *task)
+{
+    task->next = NULL;
+    if (queue->tail != NULL)
+        queue->tail->next = task;
+    else
+        queue->head = task;
+    queue->tail = task;
+}
+
+struct callback_task *callback_queue_pop(struct callback_queue *queue)
+{
+    struct callback_task *task = queue->head;
+    if (task != NULL)
+    {
+        queue->head = task->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+    }
+    return task;
+}
+
+void callback_worker_loop(struct callback_worker *worker)
+{
+    struct callback_pool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        struct callback_task *task;
+        while ((task = callback_queue_pop(&worker->queue)) == NULL
+               && !pool->stop)
+        {
+            pthread_cond_wait(&worker->cond, &pool->lock);
+        }
+        if (task == NULL)
+            break;
+        pthread_mutex_unlock(&pool->lock);
+
+        // chunks already queued when the file was skipped aren't wanted
+        if (!inode_skipped(task->inode_info))
+        {
+            deliver_data(task->cb, task->inode_info, task->pos, task->data,
+                         task->data_len, task->stripe);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        callback_queue_push(&pool->done, task);
+        pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *callback_worker_run(void *private)
+{
+    struct callback_worker *worker = private;
+    struct callback_pool *pool = worker->pool;
+    if (setjmp(worker->trap.jump))
+    {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->failed == NULL)
+            pool->failed = worker;
+        pthread_cond_signal(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    error_trap_set(&worker->trap);
+    callback_worker_loop(worker);
+    error_trap_clear();
+    return NULL;
+}
+
+struct callback_pool *callback_pool_create(int threads)
+{
+    struct callback_pool *pool = ecalloc(sizeof(struct callback_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->max_in_flight = (size_t)threads * CALLBACK_POOL_CHUNKS_PER_THREAD;
+
+    pool->workers = ecalloc(sizeof(struct callback_worker) * threads);
+    pool->workers_count = threads;
+    for (int i = 0; i < threads; i++)
+    {
+        struct callback_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        pthread_cond_init(&worker->cond, NULL);
+        if (pthread_create(&worker->thread, NULL, callback_worker_run, worker))
+            exit_str("Error creating callback thread");
+    }
+
+    LogInfo("Running callbacks on %d threads", threads);
+    return pool;
+}
+
+/*
+ * Call once every chunk has been waited for.
+ */
+void callback_pool_destroy(struct callback_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    for (int i = 0; i < pool->workers_count; i++)
+        pthread_cond_signal(&pool->workers[i].cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->workers_count; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_cond_destroy(&pool->workers[i].cond);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ * Let go of what a finished chunk was holding on to.
+ */
+void callback_task_finish(struct callback_task *task)
+{
+    if (task->stripe != NULL)
+        deref_stripe(task->stripe);
+
+    struct inode_cb_info *inode_info = task->inode_info;
+    if (--inode_info->tasks == 0 && inode_info->references == 0)
+        free_inode_info(inode_info);
+
+    free(task);
+}
+
+/*
+ * Wait until no more than max_in_flight chunks are queued or running, and let
+ * go of every chunk that's finished. Only ever called from the reading thread,
+ * which fails here if a worker has.
+ */
+void callback_pool_wait(struct callback_pool *pool, size_t max_in_flight)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        if (pool->failed != NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            error_trap_raise(&pool->failed->trap);
+        }
+
+        struct callback_task *done = pool->done.head;
+        pool->done.head = pool->done.tail = NULL;
+        if (done == NULL && pool->in_flight > max_in_flight)
+        {
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+            continue;
+        }
+
+        // the references aren't the workers' business, so no need to hold the
+        // lock while they're dropped
+        pthread_mutex_unlock(&pool->lock);
+        size_t finished = 0;
+        while (done != NULL)
+        {
+            struct callback_task *next = done->next;
+            callback_task_finish(done);
+            done = next;
+            finished++;
+        }
+        pthread_mutex_lock(&pool->lock);
+
+        pool->in_flight -= finished;
+        if (pool->in_flight <= max_in_flight)
+            break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Queue a chunk of an inode's data on the inode's thread, holding on to its
+ * stripe (if it isn't a hole) and the inode until it's been delivered.
+ */
+void callback_pool_submit(struct callback_pool *pool, block_cb cb,
+                          struct inode_cb_info *inode_info, uint64_t pos,
+                          char *data, uint64_t data_len, struct stripe *stripe)
+{
+    callback_pool_wait(pool, pool->max_in_flight - 1);
+
+    struct callback_task *task = emalloc(sizeof(struct callback_task));
+    task->cb = cb;
+    task->inode_info = inode_info;
+    task->pos = pos;
+    task->data = data;
+    task->data_len = data_len;
+    task->stripe = stripe;
+    if (stripe != NULL)
+        ref_stripe(stripe);
+    inode_info->tasks++;
+
+    struct callback_worker *worker =
+        &pool->workers[inode_info->inode % pool->workers_count];
+    pthread_mutex_lock(&pool->lock);
+    callback_queue_push(&worker->queue, task);
+    pool->in_flight++;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
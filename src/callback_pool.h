@@ -0,0 +1,14 @@
+#ifndef DJ_CALLBACK_POOL_H
+#define DJ_CALLBACK_POOL_H
+
+#include "dj_internal.h"
+
+struct callback_pool *callback_pool_create(int threads);
+void callback_pool_destroy(struct callback_pool *pool);
+
+void callback_pool_submit(struct callback_pool *pool, block_cb cb,
+                          struct inode_cb_info *inode_info, uint64_t pos,
+                          char *data, uint64_t data_len, struct stripe *stripe);
+void callback_pool_wait(struct callback_pool *pool, size_t max_in_flight);
+
+#endif
@@ -41,6 +41,16 @@ int action_info(uint32_t inode, char *path, uint64_t pos, uint64_t file_len,
     return 0;
 }
 
+char *change_names[] = {"unchanged", "changed", "appended", "new", "deleted"};
+
+void print_change(uint32_t inode, char *path, int change, uint64_t pos)
+{
+    if (change == DJ_FILE_APPENDED)
+        printf("%s from %lu: %s\n", change_names[change], pos, path);
+    else
+        printf("%s: %s\n", change_names[change], path);
+}
+
 int action_none(uint32_t inode, char *path, uint64_t pos, uint64_t file_len,
                 char *data, uint64_t data_len, void **private)
 {
@@ -50,10 +60,122 @@ int action_none(uint32_t inode, char *path, uint64_t pos, uint64_t file_len,
 void usage(char *prog_name)
 {
     fprintf(stderr, "Usage: %s [-cat|-info|-cat_info|-md5|-list] [-direct] "
-                    "DEVICE DIRECTORY\n", prog_name);
+                    "[-pipeline] [-inode_scan] [-dir_bfs] [-elevator] [-physical] "
+                    "[-i MAX_INODES] "
+                    "[-b MAX_BLOCKS] [-c COALESCE_DISTANCE] [-q QUEUE_DEPTH] "
+                    "[-t SCAN_THREADS] [-w CALLBACK_THREADS] "
+                    "[-batch inode|first_block|block_group|median_extent] "
+                    "[-index INDEX_FILE] [-since MANIFEST_FILE [-trust_appends]] "
+                    "[-name GLOB] [-exclude GLOB] [-prune GLOB] "
+                    "[-min_size BYTES] [-max_size BYTES] "
+                    "[-mtime_after SECS] [-mtime_before SECS] "
+                    "[-ctime_after SECS] [-ctime_before SECS] [-uid UID] "
+                    "[-type f|c|b|p|s] [-stdin [-0]] "
+                    "DEVICE [TARGET...]\n"
+                    "Each TARGET is a path or inode:N; with -stdin, more are "
+                    "read from standard input, one per line (or NUL-separated "
+                    "with -0)\n", prog_name);
     exit(1);
 }
 
+char *filter_opts[] = {"-name", "-exclude", "-prune", "-min_size", "-max_size",
+                       "-mtime_after", "-mtime_before", "-ctime_after",
+                       "-ctime_before", "-uid", "-type", NULL};
+
+char *filter_opt_name(char *arg)
+{
+    for (int i = 0; filter_opts[i] != NULL; i++)
+    {
+        if (!strcmp(filter_opts[i], arg))
+            return filter_opts[i];
+    }
+    return NULL;
+}
+
+/*
+ * Let files of a -type through the filter, returning 0 for a type find(1)
+ * has that libdj doesn't read, or one it's never heard of.
+ */
+int set_filter_type(struct dj_filter *filter, char *value)
+{
+    if (!strcmp(value, "f"))
+        filter->types |= DJ_TYPE_REG;
+    else if (!strcmp(value, "c"))
+        filter->types |= DJ_TYPE_CHR;
+    else if (!strcmp(value, "b"))
+        filter->types |= DJ_TYPE_BLK;
+    else if (!strcmp(value, "p"))
+        filter->types |= DJ_TYPE_FIFO;
+    else if (!strcmp(value, "s"))
+        filter->types |= DJ_TYPE_SOCK;
+    else
+        return 0;
+    return 1;
+}
+
+/*
+ * Add the value of one of filter_opts to the filter, returning 0 if the value
+ * makes no sense. The pattern lists are allocated big enough for every
+ * argument up front.
+ */
+int set_filter_opt(struct dj_filter *filter, char *opt, char *value)
+{
+    if (!strcmp(opt, "-name"))
+        filter->include_names[filter->include_names_count++] = value;
+    else if (!strcmp(opt, "-exclude"))
+        filter->exclude_names[filter->exclude_names_count++] = value;
+    else if (!strcmp(opt, "-prune"))
+        filter->prune_names[filter->prune_names_count++] = value;
+    else if (!strcmp(opt, "-min_size"))
+        filter->min_size = strtoull(value, NULL, 10);
+    else if (!strcmp(opt, "-max_size"))
+        filter->max_size = strtoull(value, NULL, 10);
+    else if (!strcmp(opt, "-mtime_after"))
+        filter->min_mtime = atoll(value);
+    else if (!strcmp(opt, "-mtime_before"))
+        filter->max_mtime = atoll(value);
+    else if (!strcmp(opt, "-ctime_after"))
+        filter->min_ctime = atoll(value);
+    else if (!strcmp(opt, "-ctime_before"))
+        filter->max_ctime = atoll(value);
+    else if (!strcmp(opt, "-uid"))
+        filter->uid = atoll(value);
+    else if (!strcmp(opt, "-type"))
+        return set_filter_type(filter, value);
+    else
+        return 0;
+    return 1;
+}
+
+/*
+ * Add every target listed on stdin to targets, returning the new count.
+ */
+int read_stdin_targets(char ***targets, int count, int delim)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &line_size, delim, stdin)) > 0)
+    {
+        if (line[len-1] == delim)
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        char **grown = realloc(*targets, sizeof(char *) * (count + 1));
+        char *target = strdup(line);
+        if (grown == NULL || target == NULL)
+        {
+            fprintf(stderr, "Out of memory reading targets\n");
+            exit(1);
+        }
+        *targets = grown;
+        (*targets)[count++] = target;
+    }
+    free(line);
+    return count;
+}
+
 enum action {
     ACTION_MD5,
     ACTION_CAT,
@@ -74,16 +196,31 @@ int main(int argc, char **argv)
     dj_init(argv[0]);
 
     enum action action = ACTION_NONE;
-    int flags = 0;
     int device_index = 0;
-    int dir_index = 0;
+    char **targets = malloc(sizeof(char *) * argc);
+    int targets_count = 0;
+    int stdin_opt = 0;
+    int stdin_delim = '\n';
 
-    int max_inodes = 100;
-    int max_blocks = 128000;
-    int coalesce_distance = 1;
+    struct dj_options opts;
+    dj_options_init(&opts);
     int inodes_opt = 0;
     int blocks_opt = 0;
     int coalesce_opt = 0;
+    int queue_opt = 0;
+    int threads_opt = 0;
+    int workers_opt = 0;
+    int batch_opt = 0;
+    int index_opt = 0;
+    int since_opt = 0;
+
+    struct dj_filter filter;
+    dj_filter_init(&filter);
+    char *include_names[argc], *exclude_names[argc], *prune_names[argc];
+    filter.include_names = include_names;
+    filter.exclude_names = exclude_names;
+    filter.prune_names = prune_names;
+    char *filter_opt = NULL;
 
     for (int i = 0; i < argc; i++)
     {
@@ -98,55 +235,149 @@ int main(int argc, char **argv)
         else if (!strcmp(argv[i], "-list"))
             action = ACTION_LIST;
         else if (!strcmp(argv[i], "-direct"))
-            flags |= ITERATE_OPT_DIRECT;
+            opts.flags |= ITERATE_OPT_DIRECT;
+        else if (!strcmp(argv[i], "-pipeline"))
+            opts.flags |= ITERATE_OPT_PIPELINE;
+        else if (!strcmp(argv[i], "-inode_scan"))
+            opts.flags |= ITERATE_OPT_INODE_SCAN;
+        else if (!strcmp(argv[i], "-dir_bfs"))
+            opts.flags |= ITERATE_OPT_DIR_BFS;
+        else if (!strcmp(argv[i], "-elevator"))
+            opts.flags |= ITERATE_OPT_ELEVATOR;
+        else if (!strcmp(argv[i], "-physical"))
+            opts.flags |= ITERATE_OPT_PHYSICAL_ORDER;
+        else if (!strcmp(argv[i], "-trust_appends"))
+            opts.trust_appends = 1;
+        else if (!strcmp(argv[i], "-stdin"))
+            stdin_opt = 1;
+        else if (!strcmp(argv[i], "-0"))
+            stdin_delim = '\0';
         else if (!strcmp(argv[i], "-i"))
             inodes_opt = 1;
         else if (!strcmp(argv[i], "-b"))
             blocks_opt = 1;
         else if (!strcmp(argv[i], "-c"))
             coalesce_opt = 1;
+        else if (!strcmp(argv[i], "-q"))
+            queue_opt = 1;
+        else if (!strcmp(argv[i], "-t"))
+            threads_opt = 1;
+        else if (!strcmp(argv[i], "-w"))
+            workers_opt = 1;
+        else if (!strcmp(argv[i], "-batch"))
+            batch_opt = 1;
+        else if (!strcmp(argv[i], "-index"))
+            index_opt = 1;
+        else if (!strcmp(argv[i], "-since"))
+            since_opt = 1;
+        else if (filter_opt == NULL && filter_opt_name(argv[i]) != NULL)
+        {
+            filter_opt = filter_opt_name(argv[i]);
+            opts.filter = &filter;
+        }
         else if (inodes_opt)
         {
-            max_inodes = atoi(argv[i]);
+            opts.max_inodes = atoi(argv[i]);
             inodes_opt = 0;
         }
         else if (blocks_opt)
         {
-            max_blocks = atoi(argv[i]);
+            opts.max_blocks = atoi(argv[i]);
             blocks_opt = 0;
         }
         else if (coalesce_opt)
         {
-            coalesce_distance = atoi(argv[i]);
+            opts.coalesce_distance = atoi(argv[i]);
             coalesce_opt = 0;
         }
+        else if (queue_opt)
+        {
+            opts.queue_depth = atoi(argv[i]);
+            queue_opt = 0;
+        }
+        else if (threads_opt)
+        {
+            opts.scan_threads = atoi(argv[i]);
+            threads_opt = 0;
+        }
+        else if (workers_opt)
+        {
+            opts.callback_threads = atoi(argv[i]);
+            workers_opt = 0;
+        }
+        else if (batch_opt)
+        {
+            if ((opts.batch_policy = dj_batch_policy(argv[i])) < 0)
+            {
+                fprintf(stderr, "Unrecognized batching policy %s\n", argv[i]);
+                usage(argv[0]);
+            }
+            batch_opt = 0;
+        }
+        else if (index_opt)
+        {
+            opts.index_path = argv[i];
+            index_opt = 0;
+        }
+        else if (since_opt)
+        {
+            opts.manifest_path = argv[i];
+            since_opt = 0;
+        }
+        else if (filter_opt != NULL)
+        {
+            if (!set_filter_opt(&filter, filter_opt, argv[i]))
+            {
+                fprintf(stderr, "Unrecognized %s value %s\n", filter_opt,
+                        argv[i]);
+                usage(argv[0]);
+            }
+            filter_opt = NULL;
+        }
         else if (device_index == 0)
             device_index = i;
-        else if (dir_index == 0)
-            dir_index = i;
         else
-        {
-            fprintf(stderr, "Unrecognized option %s\n", argv[i]);
-            usage(argv[0]);
-        }
+            targets[targets_count++] = argv[i];
     }
 
+    if (stdin_opt)
+        targets_count = read_stdin_targets(&targets, targets_count, stdin_delim);
+
     if (device_index == 0)
     {
         fprintf(stderr, "Please specify device file\n");
         usage(argv[0]);
     }
-    else if (device_index == 0)
+    else if (targets_count == 0)
     {
         fprintf(stderr, "Please specify directory on device\n");
         usage(argv[0]);
     }
 
+    // each is a different way of finding the files; only one can be used
+    if ((opts.flags & ITERATE_OPT_INODE_SCAN)
+        && (opts.flags & ITERATE_OPT_DIR_BFS))
+    {
+        fprintf(stderr, "-inode_scan and -dir_bfs can't be used together\n");
+        usage(argv[0]);
+    }
+
+    // files' data can't be hashed or written out in pieces out of order
+    if ((opts.flags & ITERATE_OPT_PHYSICAL_ORDER)
+        && (action == ACTION_MD5 || action == ACTION_CAT
+            || action == ACTION_CAT_INFO))
+    {
+        fprintf(stderr, "-physical only works with -info and -list\n");
+        usage(argv[0]);
+    }
+
     char *device = argv[device_index];
-    char *dir = argv[dir_index];
 
-    dj_read(device, dir, actions[action], max_inodes, max_blocks,
-            coalesce_distance, flags, POSIX_FADV_NORMAL);
+    // only list what's changed when listing is all we're doing
+    if (action == ACTION_LIST || action == ACTION_INFO)
+        opts.on_change = print_change;
+
+    dj_read_targets(device, targets, targets_count, actions[action], &opts);
 
     dj_free();
 
@@ -0,0 +1,279 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clog.h"
+#include "consumer.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "stripe.h"
+#include "util.h"
+
+/*
+ * The v2 interface tells the client outright where each file begins and ends,
+ * rather than leaving it to work that out from pos and file_len, and hands the
+ * data over in batches: every chunk that reading one stripe completes, in a
+ * single call. The read loop queues chunks up here instead of calling the
+ * callback, holding on to their stripes and inodes (as the callback pool does)
+ * until the stripe has been dealt with and the batch is flushed.
+ *
+ * Files that never go through the read loop (empty and inline ones) are
+ * delivered whole, in a batch of their own, by consumer_cb().
+ *
+ * A nonzero return from on_file_begin skips the file: it's ended there and
+ * then, and the rest of it is never read.
+ */
+
+// where a file's got to, in inode_cb_info's file_begun
+#define FILE_NOT_BEGUN 0
+#define FILE_BEGUN 1
+#define FILE_ENDED 2
+
+struct batch_entry
+{
+    struct inode_cb_info *inode_info;
+    uint64_t pos;
+    char *data;
+    uint64_t data_len;
+    struct stripe *stripe;
+};
+
+struct chunk_batch
+{
+    struct dj_consumer *consumer;
+
+    struct batch_entry *entries;
+    size_t count;
+    size_t size;
+
+    // what on_chunks is handed: one chunk per entry per name
+    struct dj_chunk *chunks;
+    size_t chunks_size;
+};
+
+// the batch the thread running a v2 read is filling, for consumer_cb()
+static pthread_key_t batch_key;
+static pthread_once_t batch_key_once = PTHREAD_ONCE_INIT;
+
+void create_batch_key()
+{
+    if (pthread_key_create(&batch_key, NULL))
+        exit_str("Error creating batch key");
+}
+
+/*
+ * A file's names are numbered from 0, its first, as in the block_cb calls.
+ */
+char *file_name_path(struct inode_cb_info *inode_info, size_t name)
+{
+    return name == 0
+        ? inode_info_path(inode_info) : inode_info_link_path(inode_info, name-1);
+}
+
+void **file_name_private(struct inode_cb_info *inode_info, size_t name)
+{
+    return name == 0
+        ? &inode_info->cb_private : &inode_info->links[name-1].cb_private;
+}
+
+void chunk_batch_end_file(struct dj_consumer *consumer,
+                          struct inode_cb_info *inode_info)
+{
+    for (size_t name = 0; name <= inode_info->links_count
+                          && consumer->on_file_end; name++)
+    {
+        consumer->on_file_end(inode_info->inode,
+                              file_name_path(inode_info, name),
+                              *file_name_private(inode_info, name));
+    }
+    inode_info->file_begun = FILE_ENDED;
+}
+
+struct chunk_batch *chunk_batch_create(struct dj_consumer *consumer)
+{
+    struct chunk_batch *batch = ecalloc(sizeof(struct chunk_batch));
+    batch->consumer = consumer;
+    return batch;
+}
+
+void chunk_batch_destroy(struct chunk_batch *batch)
+{
+    free(batch->entries);
+    free(batch->chunks);
+    free(batch);
+}
+
+/*
+ * Queue up a run of an inode's data, holding on to its stripe (if it isn't a
+ * hole) and the inode until the batch is flushed.
+ */
+void chunk_batch_add(struct chunk_batch *batch,
+                     struct inode_cb_info *inode_info, uint64_t pos,
+                     char *data, uint64_t data_len, struct stripe *stripe)
+{
+    if (batch->count == batch->size)
+    {
+        batch->size = batch->size > 0 ? batch->size * 2 : 256;
+        batch->entries = erealloc(batch->entries,
+                                  sizeof(struct batch_entry) * batch->size);
+    }
+
+    struct batch_entry *entry = &batch->entries[batch->count++];
+    entry->inode_info = inode_info;
+    entry->pos = pos;
+    entry->data = data;
+    entry->data_len = data_len;
+    entry->stripe = stripe;
+
+    if (stripe != NULL)
+        ref_stripe(stripe);
+    inode_info->tasks++;
+}
+
+/*
+ * Hand everything queued up to the client: the beginnings of any files it
+ * hasn't seen yet, then all the chunks in one call (leaving out any files
+ * skipped on beginning), then the ends of any files that have now been
+ * delivered in full.
+ */
+void chunk_batch_flush(struct chunk_batch *batch)
+{
+    struct dj_consumer *consumer = batch->consumer;
+    if (batch->count == 0)
+        return;
+
+    size_t n = 0;
+    for (size_t i = 0; i < batch->count; i++)
+    {
+        struct batch_entry *entry = &batch->entries[i];
+        struct inode_cb_info *inode_info = entry->inode_info;
+        size_t names = inode_info->links_count + 1;
+
+        if (inode_info->file_begun == FILE_NOT_BEGUN)
+        {
+            int skip = 0;
+            for (size_t name = 0; name < names && consumer->on_file_begin;
+                 name++)
+            {
+                skip |= consumer->on_file_begin(inode_info->inode,
+                                                file_name_path(inode_info,
+                                                               name),
+                                                inode_info->len,
+                                                file_name_private(inode_info,
+                                                                  name));
+            }
+            inode_info->file_begun = FILE_BEGUN;
+
+            // the file's over before it's started, and what's left of it is
+            // dropped by the read loop as it comes across it
+            if (skip)
+            {
+                skip_inode(inode_info);
+                chunk_batch_end_file(consumer, inode_info);
+            }
+        }
+        if (inode_info->file_begun == FILE_ENDED)
+            continue;
+
+        if (n + names > batch->chunks_size)
+        {
+            while (n + names > batch->chunks_size)
+            {
+                batch->chunks_size = batch->chunks_size > 0
+                    ? batch->chunks_size * 2 : 256;
+            }
+            batch->chunks = erealloc(batch->chunks, sizeof(struct dj_chunk)
+                                                    * batch->chunks_size);
+        }
+
+        for (size_t name = 0; name < names; name++)
+        {
+            struct dj_chunk *chunk = &batch->chunks[n++];
+            chunk->inode = inode_info->inode;
+            chunk->path = file_name_path(inode_info, name);
+            chunk->pos = entry->pos;
+            chunk->file_len = inode_info->len;
+            chunk->data = entry->data;
+            chunk->data_len = entry->data_len;
+            chunk->private = *file_name_private(inode_info, name);
+        }
+    }
+
+    if (n > 0)
+        consumer->on_chunks(batch->chunks, n);
+
+    for (size_t i = 0; i < batch->count; i++)
+    {
+        struct batch_entry *entry = &batch->entries[i];
+        struct inode_cb_info *inode_info = entry->inode_info;
+        if (entry->stripe != NULL)
+            deref_stripe(entry->stripe);
+
+        // only the inode's last queued chunk, once it's been read in full
+        if (--inode_info->tasks == 0 && inode_info->references == 0)
+        {
+            if (inode_info->file_begun == FILE_BEGUN)
+                chunk_batch_end_file(consumer, inode_info);
+            free_inode_info(inode_info);
+        }
+    }
+
+    batch->count = 0;
+}
+
+/*
+ * The block callback of a v2 read, which only ever sees the files that are
+ * delivered whole, straight out of the block scan.
+ */
+int consumer_cb(uint32_t inode, char *path, uint64_t pos, uint64_t file_len,
+                char *data, uint64_t data_len, void **private)
+{
+    struct chunk_batch *batch = pthread_getspecific(batch_key);
+    struct dj_consumer *consumer = batch->consumer;
+
+    int skip = consumer->on_file_begin != NULL
+        && consumer->on_file_begin(inode, path, file_len, private);
+    if (data_len > 0 && !skip)
+    {
+        struct dj_chunk chunk = { inode, path, pos, file_len, data, data_len,
+                                  *private };
+        consumer->on_chunks(&chunk, 1);
+    }
+    if (consumer->on_file_end != NULL)
+        consumer->on_file_end(inode, path, *private);
+    return 0;
+}
+
+int read_consumer(struct dj_ctx *ctx, char *dev_path, char **targets,
+                  int targets_count, struct dj_consumer *consumer,
+                  struct dj_options *opts)
+{
+    pthread_once(&batch_key_once, create_batch_key);
+
+    struct chunk_batch *batch = chunk_batch_create(consumer);
+    pthread_setspecific(batch_key, batch);
+
+    int ret = read_targets(ctx, dev_path, targets, targets_count, consumer_cb,
+                           batch, opts, NULL);
+
+    pthread_setspecific(batch_key, NULL);
+    chunk_batch_destroy(batch);
+    return ret;
+}
+
+void dj_read_consumer(char *dev_path, char **targets, int targets_count,
+                      struct dj_consumer *consumer, struct dj_options *opts)
+{
+    struct dj_ctx ctx;
+    ctx_init(&ctx, 0);
+    read_consumer(&ctx, dev_path, targets, targets_count, consumer, opts);
+}
+
+int dj_ctx_read_consumer(struct dj_ctx *ctx, char *dev_path, char **targets,
+                         int targets_count, struct dj_consumer *consumer,
+                         struct dj_options *opts)
+{
+    ctx->trap.message[0] = '\0';
+    return read_consumer(ctx, dev_path, targets, targets_count, consumer,
+                         opts);
+}
@@ -0,0 +1,14 @@
+#ifndef DJ_CONSUMER_H
+#define DJ_CONSUMER_H
+
+#include "dj_internal.h"
+
+struct chunk_batch *chunk_batch_create(struct dj_consumer *consumer);
+void chunk_batch_destroy(struct chunk_batch *batch);
+
+void chunk_batch_add(struct chunk_batch *batch,
+                     struct inode_cb_info *inode_info, uint64_t pos,
+                     char *data, uint64_t data_len, struct stripe *stripe);
+void chunk_batch_flush(struct chunk_batch *batch);
+
+#endif
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "batch_policy.h"
+#include "batch_read.h"
+#include "block_index.h"
+#include "block_scan.h"
+#include "clog.h"
+#include "dir_bfs.h"
+#include "dir_scan.h"
+#include "dj_internal.h"
+#include "filter.h"
+#include "path_arena.h"
+#include "radix_sort.h"
+#include "util.h"
+#include "vec.h"
+
+/*
+ * The recursive walk reads each directory's blocks as it comes to it, which on
+ * a big tree is a seek per directory in whatever order the names happen to
+ * sort in. Instead, the tree can be walked a level at a time: map the blocks
+ * of every directory at one depth, read them all through the same batched,
+ * coalesced, physically-sorted read loop as file data, and parse the entries
+ * out of memory. The entries' inodes are then read in inode number order,
+ * which is the order they sit in the inode tables, and the directories among
+ * them make up the next level.
+ */
+
+// the fixed part of a directory entry, before the name
+#define DIRENT_HEADER_LEN 8
+
+struct bfs_dir
+{
+    ext2_ino_t ino;
+    uint32_t id;
+
+    // only kept for filters and logging, as in the recursive walk
+    char *path;
+
+    // the directory's blocks, gathered up as they're delivered, in whatever
+    // order that is
+    char *data;
+    uint64_t received;
+
+    struct bfs_walk *walk;
+};
+
+// an entry of a directory in the current level, waiting for its inode
+struct bfs_entry
+{
+    ext2_ino_t ino;
+    size_t dir;
+    size_t name;
+};
+
+struct bfs_walk
+{
+    ext2_filsys fs;
+    struct dj_filter *filter;
+    struct inode_vec *inodes;
+
+    struct bfs_dir *level;
+    size_t level_count;
+    struct bfs_dir *next_level;
+    size_t next_level_count;
+    size_t next_level_size;
+
+    struct bfs_entry *entries;
+    size_t entries_count;
+    size_t entries_size;
+
+    // the entries' names, until they're sorted into files and directories
+    struct path_arena names;
+};
+
+void bfs_add_entry(struct bfs_dir *dir, ext2_ino_t ino, char *name,
+                   int name_len)
+{
+    struct bfs_walk *walk = dir->walk;
+    if (walk->entries_count == walk->entries_size)
+    {
+        walk->entries_size = walk->entries_size > 0
+            ? walk->entries_size * 2 : 1024;
+        walk->entries = erealloc(walk->entries,
+                                 sizeof(struct bfs_entry) * walk->entries_size);
+    }
+
+    char name_buf[name_len+1];
+    memcpy(name_buf, name, name_len);
+    name_buf[name_len] = '\0';
+
+    struct bfs_entry *entry = &walk->entries[walk->entries_count++];
+    entry->ino = ino;
+    entry->dir = dir - walk->level;
+    entry->name = path_arena_add_name(&walk->names, name_buf);
+}
+
+/*
+ * Pull the entries out of one directory block. htree index blocks look like a
+ * single unused entry spanning the block, so they fall out on their own.
+ */
+void bfs_parse_dir_block(struct bfs_dir *dir, char *block,
+                         unsigned int block_size)
+{
+    unsigned int offset = 0;
+    while (offset + DIRENT_HEADER_LEN <= block_size)
+    {
+        struct ext2_dir_entry *dirent = (struct ext2_dir_entry *)&block[offset];
+        unsigned int rec_len;
+        if (ext2fs_get_rec_len(dir->walk->fs, dirent, &rec_len) != 0
+            || rec_len < DIRENT_HEADER_LEN || offset + rec_len > block_size)
+        {
+            LogWarn("Corrupt entry in directory %s at offset %u", dir->path,
+                    offset);
+            break;
+        }
+
+        int name_len = dirent->name_len & 0xFF;
+        int dot = (name_len == 1 && dirent->name[0] == '.')
+                  || (name_len == 2 && dirent->name[0] == '.'
+                      && dirent->name[1] == '.');
+        if (dirent->inode != 0 && name_len > 0 && !dot
+            && DIRENT_HEADER_LEN + name_len <= rec_len)
+        {
+            bfs_add_entry(dir, dirent->inode, dirent->name, name_len);
+        }
+
+        offset += rec_len;
+    }
+}
+
+/*
+ * Read loop callback for directories, whose private pointers are set to their
+ * bfs_dirs before the read. Each one is parsed once all of it has arrived.
+ */
+int bfs_dir_block_cb(uint32_t inode, char *path, uint64_t pos,
+                     uint64_t file_len, char *data, uint64_t data_len,
+                     void **private)
+{
+    struct bfs_dir *dir = *private;
+    if (dir->data == NULL)
+        dir->data = emalloc(file_len);
+    memcpy(&dir->data[pos], data, data_len);
+    dir->received += data_len;
+
+    if (dir->received == file_len)
+    {
+        unsigned int block_size = dir->walk->fs->blocksize;
+        for (uint64_t offset = 0; offset + block_size <= file_len;
+             offset += block_size)
+        {
+            bfs_parse_dir_block(dir, &dir->data[offset], block_size);
+        }
+        free(dir->data);
+        dir->data = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Directories with their entries inside the inode (inline_data) have no blocks
+ * to read, so they're iterated the old way.
+ */
+int bfs_inline_entry_cb(ext2_ino_t dir_ino, int entry,
+                        struct ext2_dir_entry *dirent, int offset,
+                        int blocksize, char *buf, void *private)
+{
+    if (entry == DIRENT_OTHER_FILE)
+        bfs_add_entry(private, dirent->inode, dirent->name,
+                      dirent->name_len & 0xFF);
+    return 0;
+}
+
+/*
+ * Read every directory in the current level and collect their entries.
+ */
+void bfs_read_level(struct batch_reader *reader, struct bfs_walk *walk)
+{
+    ext2_filsys fs = walk->fs;
+    struct path_arena *paths = &walk->inodes->paths;
+
+    struct inode_vec dirs = { 0 };
+    struct block_vec blocks = { NULL, 0, 0 };
+    char block_buf[fs->blocksize * 3];
+
+    for (size_t i = 0; i < walk->level_count; i++)
+    {
+        struct bfs_dir *dir = &walk->level[i];
+        struct inode_list *inode_list = inode_vec_append(&dirs);
+        inode_list->index = dir->ino;
+        inode_list->dir = paths->dirs[dir->id].parent;
+        inode_list->name = paths->dirs[dir->id].name;
+
+        struct ext2_inode inode_contents;
+        CHECK_FATAL(ext2fs_read_inode(fs, dir->ino, &inode_contents),
+                "while reading inode contents");
+        inode_list->len = EXT2_I_SIZE(&inode_contents);
+
+        if (inode_contents.i_flags & EXT4_INLINE_DATA_FL)
+        {
+            CHECK_FATAL(ext2fs_dir_iterate2(fs, dir->ino, 0, block_buf,
+                                            bfs_inline_entry_cb, dir),
+                    "while iterating over directory %s", dir->path);
+            continue;
+        }
+
+        scan_inode_blocks(fs, block_buf, bfs_dir_block_cb, paths, inode_list,
+                          &blocks, NULL);
+        if (inode_list->blocks_count > 0)
+            blocks.blocks[inode_list->blocks_start].inode_info->cb_private = dir;
+    }
+
+    // the directories' blocks are usually one or two apiece, so batching by
+    // where they start is as good as sorting them all
+    order_batches(fs, DJ_BATCH_FIRST_BLOCK, &dirs, &blocks);
+    // the entries go into the walk's shared arrays, so the callbacks stay on
+    // this thread
+    read_batches(reader, bfs_dir_block_cb, NULL, NULL, &dirs, &blocks);
+
+    free(dirs.inodes);
+    free(blocks.blocks);
+}
+
+void bfs_add_dir(struct bfs_walk *walk, ext2_ino_t ino, uint32_t id,
+                 char *path)
+{
+    if (walk->next_level_count == walk->next_level_size)
+    {
+        walk->next_level_size = walk->next_level_size > 0
+            ? walk->next_level_size * 2 : 64;
+        walk->next_level = erealloc(walk->next_level, sizeof(struct bfs_dir)
+                                                      * walk->next_level_size);
+    }
+
+    struct bfs_dir *dir = &walk->next_level[walk->next_level_count++];
+    dir->ino = ino;
+    dir->id = id;
+    dir->path = path;
+    dir->data = NULL;
+    dir->received = 0;
+    dir->walk = walk;
+}
+
+/*
+ * Read the inodes of the current level's entries in inode order, adding files
+ * to the list and directories to the next level.
+ */
+void bfs_sort_entries(struct bfs_walk *walk)
+{
+    struct path_arena *paths = &walk->inodes->paths;
+
+    uint64_t *keys = emalloc(sizeof(uint64_t)
+                             * (walk->entries_count > 0 ? walk->entries_count : 1));
+    size_t *order = emalloc(sizeof(size_t)
+                            * (walk->entries_count > 0 ? walk->entries_count : 1));
+    for (size_t i = 0; i < walk->entries_count; i++)
+    {
+        keys[i] = walk->entries[i].ino;
+        order[i] = i;
+    }
+    radix_sort(keys, order, walk->entries_count);
+
+    for (size_t i = 0; i < walk->entries_count; i++)
+    {
+        struct bfs_entry *entry = &walk->entries[order[i]];
+        struct bfs_dir *dir = &walk->level[entry->dir];
+        char *name = &walk->names.names[entry->name];
+
+        struct ext2_inode_large inode_contents;
+        block_index_read_inode(walk->fs, entry->ino, &inode_contents);
+
+        if (LINUX_S_ISDIR(inode_contents.i_mode)
+            && filter_prune_dir(walk->filter, name, dir->path))
+        {
+            LogDebug("Pruning directory %s", name);
+        }
+        else if (LINUX_S_ISDIR(inode_contents.i_mode))
+        {
+            size_t dir_path_len = strlen(dir->path);
+            char *path = emalloc(dir_path_len + strlen(name) + 2);
+            char *sep = dir_path_len > 0 && dir->path[dir_path_len-1] == '/'
+                ? "" : "/";
+            sprintf(path, "%s%s%s", dir->path, sep, name);
+
+            bfs_add_dir(walk, entry->ino,
+                        path_arena_add_dir(paths, dir->id, name), path);
+        }
+        else if (!S_ISLNK(inode_contents.i_mode)
+                 && filter_inode(walk->filter,
+                                 (struct ext2_inode *)&inode_contents)
+                 && filter_name(walk->filter, name, dir->path))
+        {
+            LogDebug("Adding file %s", name);
+            struct inode_list *list = inode_vec_append(walk->inodes);
+            list->index = entry->ino;
+            list->len = EXT2_I_SIZE(&inode_contents);
+            block_index_stamp(walk->fs, &inode_contents, list);
+            list->dir = dir->id;
+            list->name = path_arena_add_name(paths, name);
+        }
+    }
+
+    free(keys);
+    free(order);
+}
+
+/*
+ * Same as get_inode_list(), walking the tree a level at a time and reading its
+ * directories through reader. The files come out in a different order, but
+ * they're sorted by inode afterwards anyway.
+ */
+void get_inode_list_bfs(struct batch_reader *reader, char *target_path,
+                        struct dj_filter *filter, struct inode_vec *inodes)
+{
+    ext2_filsys fs = reader->fs;
+
+    ext2_ino_t ino;
+    CHECK_FATAL(ext2fs_namei_follow(fs, EXT2_ROOT_INO, EXT2_ROOT_INO,
+                                    target_path, &ino),
+            "while looking up path %s", target_path);
+
+    struct ext2_inode inode_contents;
+    CHECK_FATAL(ext2fs_read_inode(fs, ino, &inode_contents),
+            "while reading inode contents");
+    if (!LINUX_S_ISDIR(inode_contents.i_mode))
+    {
+        get_inode_list(fs, target_path, filter, inodes);
+        return;
+    }
+
+    LogInfo("Getting inodes of start directory %s a level at a time",
+            target_path);
+    path_arena_init(&inodes->paths, target_path);
+
+    struct bfs_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.fs = fs;
+    walk.filter = filter;
+    walk.inodes = inodes;
+
+    char *root_path = emalloc(strlen(target_path) + 1);
+    strcpy(root_path, target_path);
+    bfs_add_dir(&walk, ino, 0, root_path);
+
+    for (int depth = 0; walk.next_level_count > 0; depth++)
+    {
+        // the next level becomes this one, and gets a fresh array
+        free(walk.level);
+        walk.level = walk.next_level;
+        walk.level_count = walk.next_level_count;
+        walk.next_level = NULL;
+        walk.next_level_count = 0;
+        walk.next_level_size = 0;
+
+        LogInfo("Reading %lu directories at depth %d", walk.level_count,
+                depth);
+        bfs_read_level(reader, &walk);
+        bfs_sort_entries(&walk);
+
+        for (size_t i = 0; i < walk.level_count; i++)
+            free(walk.level[i].path);
+        walk.entries_count = 0;
+        walk.names.names_len = 0;
+    }
+
+    free(walk.level);
+    free(walk.next_level);
+    free(walk.entries);
+    path_arena_free(&walk.names);
+}
@@ -0,0 +1,10 @@
+#ifndef DJ_DIR_BFS_H
+#define DJ_DIR_BFS_H
+
+#include "batch_read.h"
+#include "dj_internal.h"
+
+void get_inode_list_bfs(struct batch_reader *reader, char *target_path,
+                        struct dj_filter *filter, struct inode_vec *inodes);
+
+#endif
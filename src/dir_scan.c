@@ -1,25 +1,34 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include "block_index.h"
 #include "clog.h"
 #include "dir_scan.h"
 #include "dj_internal.h"
+#include "filter.h"
+#include "path_arena.h"
 #include "util.h"
+#include "vec.h"
 
 struct dir_tree_entry
 {
+    // only kept while the directory's being walked, for filters and logging;
+    // files remember the directory by its id in the path arena
     char *path;
     struct dir_tree_entry *parent;
+    uint32_t id;
 };
 
 struct dir_entry_cb_data
 {
     ext2_filsys fs;
     struct dir_tree_entry *dir;
-    struct inode_list *list_start;
-    struct inode_list *list_end;
+    struct dj_filter *filter;
+    struct inode_vec *inodes;
 };
 
 char *dir_path_append_name(struct dir_tree_entry *dir, char *name)
@@ -41,23 +50,15 @@ char *dir_path_append_name(struct dir_tree_entry *dir, char *name)
 }
 
 void dir_entry_add_file(ext2_ino_t ino, char *name,
-                        struct dir_entry_cb_data *cb_data, uint64_t len)
+                        struct dir_entry_cb_data *cb_data,
+                        struct ext2_inode_large *inode)
 {
-    struct inode_list *list = ecalloc(sizeof(struct inode_list));
+    struct inode_list *list = inode_vec_append(cb_data->inodes);
     list->index = ino;
-    list->len = len;
-    list->path = dir_path_append_name(cb_data->dir, name);
-
-    if (cb_data->list_start == NULL)
-    {
-        cb_data->list_start = list;
-        cb_data->list_end = list;
-    }
-    else
-    {
-        cb_data->list_end->next = list;
-        cb_data->list_end = list;
-    }
+    list->len = EXT2_I_SIZE(inode);
+    block_index_stamp(cb_data->fs, inode, list);
+    list->dir = cb_data->dir != NULL ? cb_data->dir->id : 0;
+    list->name = path_arena_add_name(&cb_data->inodes->paths, name);
 }
 
 int dir_entry_cb(ext2_ino_t dir_ino, int entry, struct ext2_dir_entry *dirent,
@@ -75,13 +76,18 @@ int dir_entry_cb(ext2_ino_t dir_ino, int entry, struct ext2_dir_entry *dirent,
 
         struct dir_entry_cb_data *cb_data = private;
 
-        // read the entry's inode contents
-        struct ext2_inode inode_contents;
-        CHECK_FATAL(ext2fs_read_inode(cb_data->fs, dirent->inode,
-                                      &inode_contents),
-                "while reading inode contents");
+        // read the entry's inode contents, all of them, for the block index
+        struct ext2_inode_large inode_contents;
+        block_index_read_inode(cb_data->fs, dirent->inode, &inode_contents);
 
-        if (LINUX_S_ISDIR(inode_contents.i_mode))
+        char *dir_path = cb_data->dir != NULL ? cb_data->dir->path : NULL;
+
+        if (LINUX_S_ISDIR(inode_contents.i_mode)
+            && filter_prune_dir(cb_data->filter, name, dir_path))
+        {
+            LogDebug("Pruning directory %s", name);
+        }
+        else if (LINUX_S_ISDIR(inode_contents.i_mode))
         {
             // if it's a directory, create a new leaf object in the in-memory
             // tree containing the fully-qualified name (for convenience) and a
@@ -89,6 +95,9 @@ int dir_entry_cb(ext2_ino_t dir_ino, int entry, struct ext2_dir_entry *dirent,
             struct dir_tree_entry dir;
             dir.parent = cb_data->dir;
             dir.path = dir_path_append_name(dir.parent, name);
+            dir.id = path_arena_add_dir(&cb_data->inodes->paths,
+                                        dir.parent != NULL ? dir.parent->id : 0,
+                                        name);
 
             // TODO I think this size is mandated by the docs?
             char block_buf[cb_data->fs->blocksize*3];
@@ -107,20 +116,23 @@ int dir_entry_cb(ext2_ino_t dir_ino, int entry, struct ext2_dir_entry *dirent,
             // whee memory leaks
             free(dir.path);
         }
-        else if (!S_ISLNK(inode_contents.i_mode))
+        else if (!S_ISLNK(inode_contents.i_mode)
+                 && filter_inode(cb_data->filter,
+                                 (struct ext2_inode *)&inode_contents)
+                 && filter_name(cb_data->filter, name, dir_path))
         {
             LogDebug("Adding file %s", name);
-            // if it's a file, add it to the linked list that was passed it (and
+            // if it's a file, add it to the list that was passed in (and
             // therefore shared by all directories that we're interested in)
-            dir_entry_add_file(dirent->inode, name, cb_data,
-                               inode_contents.i_size);
+            dir_entry_add_file(dirent->inode, name, cb_data, &inode_contents);
         }
     }
 
     return 0;
 }
 
-struct inode_list *get_inode_list(ext2_filsys fs, char *target_path)
+void get_inode_list(ext2_filsys fs, char *target_path,
+                    struct dj_filter *filter, struct inode_vec *inodes)
 {
     // look up the file whose blocks we want to read, or the directory whose
     // constituent files (and their block) we want to read
@@ -130,16 +142,16 @@ struct inode_list *get_inode_list(ext2_filsys fs, char *target_path)
             "while looking up path %s", target_path);
 
     // get that inode
-    struct dir_entry_cb_data cb_data = { fs, NULL, NULL, NULL };
-    struct ext2_inode inode_contents;
-    CHECK_FATAL(ext2fs_read_inode(fs, ino, &inode_contents),
-            "while reading inode contents");
+    struct dir_entry_cb_data cb_data = { fs, NULL, filter, inodes };
+    struct ext2_inode_large inode_contents;
+    block_index_read_inode(fs, ino, &inode_contents);
 
     if (LINUX_S_ISDIR(inode_contents.i_mode))
     {
         // if it's a directory, recursively iterate through its contents
         LogInfo("Getting inodes of start directory %s", target_path);
-        struct dir_tree_entry dir = { target_path, NULL };
+        path_arena_init(&inodes->paths, target_path);
+        struct dir_tree_entry dir = { target_path, NULL, 0 };
         cb_data.dir = &dir;
         CHECK_FATAL(ext2fs_dir_iterate2(fs, ino, 0, NULL, dir_entry_cb,
                                         &cb_data),
@@ -147,21 +159,375 @@ struct inode_list *get_inode_list(ext2_filsys fs, char *target_path)
     }
     else if (!S_ISLNK(inode_contents.i_mode))
     {
-        // if it's a regular file, just add it
+        // if it's a regular file, just add it; it was asked for by name, so
+        // the filter doesn't get a say. A file at the top keeps the slash.
         int dir_path_len = strrchr(target_path, '/') - target_path;
+        if (dir_path_len == 0)
+            dir_path_len = 1;
         char dir_path[dir_path_len+1];
         memcpy(dir_path, target_path, dir_path_len);;
         dir_path[dir_path_len] = '\0';
 
-        struct dir_tree_entry dir = { dir_path, NULL };
+        path_arena_init(&inodes->paths, dir_path);
+        struct dir_tree_entry dir = { dir_path, NULL, 0 };
         cb_data.dir = &dir;
         dir_entry_add_file(ino, strrchr(target_path, '/')+1, &cb_data,
-                           inode_contents.i_size);
+                           &inode_contents);
 
         LogDebug("Added start file %s", target_path);
     }
     else
         exit_str("Unexpected file mode %x", inode_contents.i_mode);
+}
+
+/*
+ * The parallel walk hands out every directory as a job of its own, through
+ * one queue that all the threads take from and add to, so that however the
+ * tree is shaped, no thread's left walking a huge subtree on its own. What
+ * each directory holds is recorded in the order the serial walk would have
+ * come across it: runs of files (in the list of whichever thread read the
+ * directory), each followed by the subdirectory that came after it.
+ */
+struct dir_part
+{
+    size_t files_start;
+    size_t files_count;
+    struct dir_job *subdir;
+};
+
+struct dir_job
+{
+    ext2_ino_t ino;
+    char *name;
+
+    // only kept until the directory's been read, for filters and logging
+    char *path;
+
+    // thread whose list the directory's files went into
+    struct inode_vec *files;
+    struct dir_part *parts;
+    size_t parts_count;
+    size_t parts_size;
+
+    struct dir_job *next;
+};
+
+struct dir_scan_thread
+{
+    pthread_t thread;
+    struct parallel_dir_scan *scan;
+
+    // the thread's files, with their names in its own arena
+    struct inode_vec files;
+
+    // its own handle on the file system, and where its errors go, to be
+    // raised again once it's been joined
+    ext2_filsys fs;
+    int failed;
+    struct error_trap trap;
+};
+
+struct parallel_dir_scan
+{
+    char *dev_path;
+    struct dj_filter *filter;
+
+    // directories waiting to be read, and how many are queued or being read;
+    // failed is set to have every thread give up
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dir_job *queue;
+    size_t pending;
+    int failed;
+};
+
+struct dir_job_cb_data
+{
+    ext2_filsys fs;
+    struct parallel_dir_scan *scan;
+    struct dir_job *job;
+    struct inode_vec *files;
+};
+
+struct dir_job *dir_job_create(ext2_ino_t ino, char *name, char *path)
+{
+    struct dir_job *job = ecalloc(sizeof(struct dir_job));
+    job->ino = ino;
+    job->name = strdup(name);
+    job->path = path;
+    return job;
+}
+
+struct dir_part *dir_job_add_part(struct dir_job *job, size_t files_start)
+{
+    if (job->parts_count == job->parts_size)
+    {
+        job->parts_size = job->parts_size > 0 ? job->parts_size * 2 : 4;
+        job->parts = erealloc(job->parts,
+                              sizeof(struct dir_part) * job->parts_size);
+    }
+
+    struct dir_part *part = &job->parts[job->parts_count++];
+    part->files_start = files_start;
+    part->files_count = 0;
+    part->subdir = NULL;
+    return part;
+}
+
+void dir_job_push(struct parallel_dir_scan *scan, struct dir_job *job)
+{
+    pthread_mutex_lock(&scan->lock);
+    job->next = scan->queue;
+    scan->queue = job;
+    scan->pending++;
+    pthread_cond_signal(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ * Next directory to read, or NULL once there are none left and none being
+ * read that could turn up more, or another thread has failed.
+ */
+struct dir_job *dir_job_pop(struct parallel_dir_scan *scan)
+{
+    pthread_mutex_lock(&scan->lock);
+    while (scan->queue == NULL && scan->pending > 0 && !scan->failed)
+        pthread_cond_wait(&scan->cond, &scan->lock);
+
+    struct dir_job *job = scan->failed ? NULL : scan->queue;
+    if (job != NULL)
+        scan->queue = job->next;
+    pthread_mutex_unlock(&scan->lock);
+    return job;
+}
+
+void dir_job_done(struct parallel_dir_scan *scan)
+{
+    pthread_mutex_lock(&scan->lock);
+    if (--scan->pending == 0)
+        pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ * Same as dir_entry_cb(), except that rather than being recursed into,
+ * subdirectories are queued up for whichever thread gets to them first.
+ */
+int dir_job_entry_cb(ext2_ino_t dir_ino, int entry,
+                     struct ext2_dir_entry *dirent, int offset, int blocksize,
+                     char *buf, void *private)
+{
+    if (entry != DIRENT_OTHER_FILE)
+        return 0;
+
+    int name_len = dirent->name_len & 0xFF;
+    char name[name_len+1];
+    memcpy(name, dirent->name, name_len);
+    name[name_len] = '\0';
+
+    struct dir_job_cb_data *cb_data = private;
+    struct dir_job *job = cb_data->job;
+
+    struct ext2_inode_large inode_contents;
+    block_index_read_inode(cb_data->fs, dirent->inode, &inode_contents);
+
+    if (LINUX_S_ISDIR(inode_contents.i_mode)
+        && filter_prune_dir(cb_data->scan->filter, name, job->path))
+    {
+        LogDebug("Pruning directory %s", name);
+    }
+    else if (LINUX_S_ISDIR(inode_contents.i_mode))
+    {
+        struct dir_tree_entry dir = { job->path, NULL, 0 };
+        struct dir_job *subdir = dir_job_create(
+            dirent->inode, name, dir_path_append_name(&dir, name));
+
+        // the directory ends the current run of files, and starts the next
+        job->parts[job->parts_count-1].subdir = subdir;
+        dir_job_add_part(job, cb_data->files->count);
+        dir_job_push(cb_data->scan, subdir);
+    }
+    else if (!S_ISLNK(inode_contents.i_mode)
+             && filter_inode(cb_data->scan->filter,
+                             (struct ext2_inode *)&inode_contents)
+             && filter_name(cb_data->scan->filter, name, job->path))
+    {
+        LogDebug("Adding file %s", name);
+        struct inode_list *list = inode_vec_append(cb_data->files);
+        list->index = dirent->inode;
+        list->len = EXT2_I_SIZE(&inode_contents);
+        block_index_stamp(cb_data->fs, &inode_contents, list);
+        list->name = path_arena_add_name(&cb_data->files->paths, name);
+        job->parts[job->parts_count-1].files_count++;
+    }
+
+    return 0;
+}
+
+void dir_scan_thread_run(struct dir_scan_thread *thread)
+{
+    struct parallel_dir_scan *scan = thread->scan;
+
+    // libext2fs handles aren't thread-safe, so each thread gets its own
+    CHECK_FATAL(ext2fs_open(scan->dev_path, 0, 0, 0, unix_io_manager,
+                            &thread->fs),
+            "while opening file system on device %s", scan->dev_path);
+    ext2_filsys fs = thread->fs;
+    struct inode_vec *files = &thread->files;
+
+    char block_buf[fs->blocksize*3];
+    struct dir_job *job;
+    while ((job = dir_job_pop(scan)) != NULL)
+    {
+        job->files = files;
+        dir_job_add_part(job, files->count);
+        struct dir_job_cb_data cb_data = { fs, scan, job, files };
+
+        LogDebug("Entering directory %s", job->path);
+        CHECK_FATAL(ext2fs_dir_iterate2(fs, job->ino, 0, block_buf,
+                                        dir_job_entry_cb, &cb_data),
+                "while iterating over directory %s", job->path);
+
+        free(job->path);
+        job->path = NULL;
+        dir_job_done(scan);
+    }
+}
+
+void *dir_scan_worker(void *private)
+{
+    struct dir_scan_thread *thread = private;
+    struct parallel_dir_scan *scan = thread->scan;
+    if (setjmp(thread->trap.jump))
+    {
+        thread->failed = 1;
+        pthread_mutex_lock(&scan->lock);
+        scan->failed = 1;
+        pthread_cond_broadcast(&scan->cond);
+        pthread_mutex_unlock(&scan->lock);
+    }
+    else
+    {
+        error_trap_set(&thread->trap);
+        dir_scan_thread_run(thread);
+        error_trap_clear();
+    }
+
+    if (thread->fs != NULL)
+        ext2fs_close(thread->fs);
+    return NULL;
+}
+
+/*
+ * Put what the threads found under a directory into inodes, in the order the
+ * serial walk would have, under the directory dir in inodes' path arena, and
+ * free the job along with all of those under it.
+ */
+void dir_job_collect(struct dir_job *job, uint32_t dir,
+                     struct inode_vec *inodes)
+{
+    for (size_t i = 0; i < job->parts_count; i++)
+    {
+        struct dir_part *part = &job->parts[i];
+        for (size_t j = 0; j < part->files_count; j++)
+        {
+            struct inode_list *file = &job->files->inodes[part->files_start+j];
+            struct inode_list *list = inode_vec_append(inodes);
+            *list = *file;
+            list->dir = dir;
+            list->name = path_arena_add_name(&inodes->paths,
+                                             &job->files->paths.names[file->name]);
+        }
 
-    return cb_data.list_start;
-}
\ No newline at end of file
+        if (part->subdir != NULL)
+        {
+            uint32_t subdir = path_arena_add_dir(&inodes->paths, dir,
+                                                 part->subdir->name);
+            dir_job_collect(part->subdir, subdir, inodes);
+        }
+    }
+
+    // only left if the scan failed before the directory was read
+    free(job->path);
+    free(job->parts);
+    free(job->name);
+    free(job);
+}
+
+/*
+ * Same as get_inode_list(), except that directories are read by a pool of
+ * threads, each taking whichever directory's next in the queue. The result is
+ * put together in directory order afterwards, so it's identical to the serial
+ * walk's. If any of the threads fails, the rest give up, and the error is
+ * raised on this thread once they've all finished.
+ */
+void get_inode_list_parallel(char *dev_path, ext2_filsys fs,
+                             char *target_path, int threads,
+                             struct dj_filter *filter, struct inode_vec *inodes)
+{
+    ext2_ino_t ino;
+    CHECK_FATAL(ext2fs_namei_follow(fs, EXT2_ROOT_INO, EXT2_ROOT_INO,
+                                    target_path, &ino),
+            "while looking up path %s", target_path);
+
+    struct ext2_inode inode_contents;
+    CHECK_FATAL(ext2fs_read_inode(fs, ino, &inode_contents),
+            "while reading inode contents");
+    if (!LINUX_S_ISDIR(inode_contents.i_mode))
+    {
+        get_inode_list(fs, target_path, filter, inodes);
+        return;
+    }
+
+    struct parallel_dir_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.dev_path = dev_path;
+    scan.filter = filter;
+    struct dir_scan_thread *scan_threads =
+        ecalloc(sizeof(struct dir_scan_thread) * threads);
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+
+    LogInfo("Getting inodes of start directory %s with %d threads",
+            target_path, threads);
+    struct dir_job *root = dir_job_create(ino, target_path,
+                                          strdup(target_path));
+    dir_job_push(&scan, root);
+
+    for (int i = 0; i < threads; i++)
+    {
+        struct dir_scan_thread *thread = &scan_threads[i];
+        thread->scan = &scan;
+        path_arena_init(&thread->files.paths, "");
+        if (pthread_create(&thread->thread, NULL, dir_scan_worker, thread))
+            exit_str("Error creating directory scan thread");
+    }
+    struct dir_scan_thread *failed = NULL;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(scan_threads[i].thread, NULL);
+        if (scan_threads[i].failed && failed == NULL)
+            failed = &scan_threads[i];
+    }
+
+    // a failed scan is still collected, to free the jobs, though the files
+    // are only partly there
+    path_arena_init(&inodes->paths, target_path);
+    dir_job_collect(root, 0, inodes);
+
+    for (int i = 0; i < threads; i++)
+    {
+        free(scan_threads[i].files.inodes);
+        path_arena_free(&scan_threads[i].files.paths);
+    }
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.lock);
+
+    if (failed != NULL)
+    {
+        struct error_trap trap = failed->trap;
+        free(scan_threads);
+        error_trap_raise(&trap);
+    }
+    free(scan_threads);
+}
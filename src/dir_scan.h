@@ -3,6 +3,12 @@
 
 #include <ext2fs/ext2fs.h>
 
-struct inode_list *get_inode_list(ext2_filsys fs, char *target_path);
+#include "dj_internal.h"
+
+void get_inode_list(ext2_filsys fs, char *target_path,
+                    struct dj_filter *filter, struct inode_vec *inodes);
+void get_inode_list_parallel(char *dev_path, ext2_filsys fs,
+                             char *target_path, int threads,
+                             struct dj_filter *filter, struct inode_vec *inodes);
 
 #endif
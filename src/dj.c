@@ -1,155 +1,352 @@
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "batch_policy.h"
+#include "batch_read.h"
+#include "block_index.h"
 #include "block_scan.h"
+#include "buffer_pool.h"
+#include "callback_pool.h"
 #include "clog.h"
-#include "dir_scan.h"
 #include "dj_internal.h"
-#include "listsort.h"
-#include "stripe.h"
+#include "incremental.h"
+#include "inline_data.h"
+#include "path_arena.h"
+#include "pipeline.h"
+#include "radix_sort.h"
+#include "stripe_uring.h"
+#include "targets.h"
 #include "util.h"
+#include "vec.h"
 
-// inode indexes are unsigned ints, so don't subtract them; semicolons seem to
-// help Sublime Text's syntax parser
-SORT_FUNC(inode_list_sort, struct inode_list, (p->index < q->index ? -1 : 1));
-SORT_FUNC(block_list_sort, struct block_list,
-          (p->physical_block < q->physical_block ? -1 : 1));
+void dj_options_init(struct dj_options *opts)
+{
+    opts->max_inodes = 100;
+    opts->max_blocks = 128000;
+    opts->coalesce_distance = 1;
+    opts->queue_depth = 1;
+    opts->pool_bytes = 0;
+    opts->scan_threads = 1;
+    opts->callback_threads = 1;
+    opts->batch_policy = DJ_BATCH_INODE;
+    opts->index_path = NULL;
+    opts->manifest_path = NULL;
+    opts->on_change = NULL;
+    opts->trust_appends = 0;
+    opts->filter = NULL;
+    opts->flags = 0;
+    opts->advice_flags = POSIX_FADV_NORMAL;
+    opts->stats = NULL;
+}
 
 void dj_read(char *dev_path, char *target_path, block_cb cb, int max_inodes,
              int max_blocks, int coalesce_distance, int flags, int advice_flags)
 {
+    struct dj_options opts;
+    dj_options_init(&opts);
+    opts.max_inodes = max_inodes;
+    opts.max_blocks = max_blocks;
+    opts.coalesce_distance = coalesce_distance;
+    opts.flags = flags;
+    opts.advice_flags = advice_flags;
+    dj_read_opts(dev_path, target_path, cb, &opts);
+}
+
+void dj_read_opts(char *dev_path, char *target_path, block_cb cb,
+                  struct dj_options *opts)
+{
+    dj_read_targets(dev_path, &target_path, 1, cb, opts);
+}
+
+void dj_read_targets(char *dev_path, char **targets, int targets_count,
+                     block_cb cb, struct dj_options *opts)
+{
+    struct dj_ctx ctx;
+    ctx_init(&ctx, 0);
+    read_targets(&ctx, dev_path, targets, targets_count, cb, NULL, opts, NULL);
+}
+
+/*
+ * Start a context off with nothing open. If catch_errors is set, fatal errors
+ * during its reads are caught and reported rather than exiting.
+ */
+void ctx_init(struct dj_ctx *ctx, int catch_errors)
+{
+    memset(ctx, 0, sizeof(struct dj_ctx));
+    ctx->fd = -1;
+    ctx->catch_errors = catch_errors;
+}
+
+/*
+ * Tear down whatever a read has open, which is everything at the end of the
+ * read, or whatever it had got as far as opening if it failed.
+ */
+void read_cleanup(struct dj_ctx *ctx)
+{
+    if (ctx->callbacks != NULL)
+        callback_pool_destroy(ctx->callbacks);
+    if (ctx->index != NULL)
+        block_index_close(ctx->index);
+    if (ctx->manifest != NULL)
+        block_index_close(ctx->manifest);
+
+    free(ctx->inodes.inodes);
+    path_arena_free(&ctx->inodes.paths);
+    free(ctx->blocks.blocks);
+
+    // retained chunks point into the memory torn down below
+    if (ctx->pool != NULL)
+        buffer_pool_wait_retained(ctx->pool);
+
+    if (ctx->pipeline != NULL)
+        pipeline_destroy(ctx->pipeline);
+
+#ifdef DJ_HAVE_URING
+    if (ctx->uring != NULL)
+        uring_reader_destroy(ctx->uring);
+#endif
+
+    if (ctx->pool != NULL && ctx->stats != NULL)
+    {
+        ctx->stats->buffer_hits = ctx->pool->hits;
+        ctx->stats->buffer_misses = ctx->pool->misses;
+        ctx->stats->buffer_drops = ctx->pool->drops;
+    }
+    if (ctx->pool != NULL)
+        buffer_pool_destroy(ctx->pool);
+
+    if (ctx->fd >= 0 && close(ctx->fd) != 0)
+        LogWarn("Error closing block device");
+
+    if (ctx->fs != NULL && ext2fs_close(ctx->fs) != 0)
+        LogWarn("Error closing file system");
+
+    // ready for the next read, with the error (if any) left for the client
+    ctx->fs = NULL;
+    ctx->fd = -1;
+    ctx->pool = NULL;
+    ctx->pipeline = NULL;
+    ctx->uring = NULL;
+    ctx->callbacks = NULL;
+    ctx->index = NULL;
+    ctx->manifest = NULL;
+    ctx->stats = NULL;
+    memset(&ctx->inodes, 0, sizeof(struct inode_vec));
+    memset(&ctx->blocks, 0, sizeof(struct block_vec));
+}
+
+/*
+ * The whole read, from opening the device to closing it, with everything it
+ * opens kept in ctx. If batch isn't NULL, the data is queued up there rather
+ * than passed to cb, which then only gets the files that are delivered whole.
+ * If stop isn't NULL, setting it (atomically, from any thread) ends the read at
+ * the end of the current batch. Returns 0, or if ctx catches errors and there
+ * was one, -1 with the error in ctx's trap.
+ */
+int read_targets(struct dj_ctx *ctx, char *dev_path, char **targets,
+                 int targets_count, block_cb cb, struct chunk_batch *batch,
+                 struct dj_options *opts, int *stop)
+{
+    if (ctx->catch_errors)
+    {
+        if (setjmp(ctx->trap.jump))
+        {
+            LogError("Read of %s failed: %s", dev_path, ctx->trap.message);
+            read_cleanup(ctx);
+            return -1;
+        }
+        error_trap_set(&ctx->trap);
+    }
+
+    int max_inodes = opts->max_inodes;
+    int max_blocks = opts->max_blocks;
+    int coalesce_distance = opts->coalesce_distance;
+    int flags = opts->flags;
+    int advice_flags = opts->advice_flags;
+
     // open file system from block device
-    ext2_filsys fs;
-    CHECK_FATAL(ext2fs_open(dev_path, 0, 0, 0, unix_io_manager, &fs),
+    CHECK_FATAL(ext2fs_open(dev_path, 0, 0, 0, unix_io_manager, &ctx->fs),
             "while opening file system on device %s", dev_path);
+    ext2_filsys fs = ctx->fs;
 
     // open the block device in order to read data from it later
-    int fd;
     int open_flags = O_RDONLY;
     if (flags & ITERATE_OPT_DIRECT)
         open_flags |= O_DIRECT;
-    if ((fd = open(dev_path, open_flags)) < 0)
+    if ((ctx->fd = open(dev_path, open_flags)) < 0)
         exit_str("Error opening block device %s", dev_path);
+    int fd = ctx->fd;
 
     CHECK_WARN(posix_fadvise(fd, 0, 0, advice_flags), "setting advice flags 0x%x", advice_flags);
 
+    // stripe buffers are recycled through a pool that never holds on to more
+    // idle memory than the block budget
+    ctx->stats = opts->stats;
+    size_t pool_bytes = opts->pool_bytes > 0
+        ? opts->pool_bytes : (size_t)max_blocks * fs->blocksize;
+    ctx->pool = buffer_pool_create(pool_bytes);
+
+    // the pipeline's read-ahead shares the budget the heaps are sized from
+    if (flags & ITERATE_OPT_PIPELINE)
+    {
+        ctx->pipeline = pipeline_create(fs, ctx->pool, fd,
+                                        flags & ITERATE_OPT_DIRECT,
+                                        coalesce_distance,
+                                        (size_t)max_blocks * fs->blocksize);
+    }
+
+#ifdef DJ_HAVE_URING
+    if (opts->queue_depth > 1 && ctx->pipeline != NULL)
+        LogWarn("Pipelined reads use pread; ignoring queue depth %d",
+                opts->queue_depth);
+    else if (opts->queue_depth > 1)
+    {
+        ctx->uring = uring_reader_create(ctx->pool, fd, opts->queue_depth,
+                                         flags & ITERATE_OPT_DIRECT,
+                                         fs->blocksize,
+                                         (size_t)max_blocks * fs->blocksize);
+    }
+#else
+    if (opts->queue_depth > 1)
+    {
+        LogWarn("Built without io_uring support; ignoring queue depth %d",
+                opts->queue_depth);
+    }
+#endif
+
+    struct batch_reader reader = { fs, fd, flags, max_inodes, max_blocks,
+                                   coalesce_distance, ctx->pool, ctx->pipeline,
+                                   ctx->uring, 0, stop };
+
     LogInfo("BEGIN INODE SCAN");
 
-    struct inode_list *inode_list = get_inode_list(fs, target_path);
+    struct inode_vec *inodes = &ctx->inodes;
+    get_inode_list_targets(&reader, dev_path, targets, targets_count, opts,
+                           inodes);
 
     /*
-     * We now have a linked list of file paths to be scanned in
-     * cb_data.list_start.
+     * We now have an array of file paths to be scanned in inodes.
      */
 
     LogInfo("END INODE SCAN");
 
-    inode_list = inode_list_sort(inode_list);
+    sort_inodes(inodes);
+    inode_vec_merge_links(inodes);
 
     LogInfo("BEGIN BLOCK SCAN");
 
-    scan_blocks(fs, cb, inode_list);
+    if (opts->index_path != NULL)
+        ctx->index = block_index_open(fs, opts->index_path);
+    if (opts->manifest_path != NULL)
+    {
+        ctx->manifest = block_index_open(fs, opts->manifest_path);
+        if (ctx->manifest == NULL)
+            LogWarn("No usable manifest; reading every file in full");
+    }
 
-    LogInfo("END BLOCK SCAN");
+    // the manifest has block maps for unchanged files, too
+    struct block_index *scan_index = ctx->index != NULL
+        ? ctx->index : ctx->manifest;
 
-    int open_inodes_count = 0;
+    struct block_vec *blocks = &ctx->blocks;
+    if (opts->scan_threads > 1)
+    {
+        scan_blocks_parallel(dev_path, cb, inodes, blocks, scan_index,
+                             opts->scan_threads);
+    }
+    else
+        scan_blocks(fs, cb, inodes, blocks, scan_index);
 
-    struct block_list *block_list_start = NULL;
-    struct block_list *block_list_end = NULL;
+    // written before the incremental plan cuts the block maps down
+    if (opts->index_path != NULL)
+        block_index_write(fs, opts->index_path, inodes, blocks);
+    if (ctx->index != NULL)
+    {
+        block_index_close(ctx->index);
+        ctx->index = NULL;
+    }
 
-    while (inode_list != NULL)
+    if (opts->manifest_path != NULL)
     {
-        /*
-         * While there are inodes remaining and we're below the limit on open
-         * inodes, add those inodes' blocks to the global list.
-         */
-        while (inode_list != NULL && open_inodes_count < max_inodes)
-        {
-            LogDebug("Adding blocks of inode %s (%llu bytes) to block read list", inode_list->path, inode_list->len);
-
-            if (inode_list->blocks_start != NULL)
-            {
-                if (block_list_start == NULL)
-                {
-                    block_list_start = inode_list->blocks_start;
-                    block_list_end = inode_list->blocks_end;
-                }
-                else
-                {
-                    block_list_end->next = inode_list->blocks_start;
-                    block_list_end = inode_list->blocks_end;
-                }
-                open_inodes_count++;
-            }
-
-            struct inode_list *old = inode_list;
-            inode_list = inode_list->next;
-
-            free(old->path);
-            free(old);
-        }
+        plan_incremental(fs, ctx->manifest, opts->on_change,
+                         opts->trust_appends, inodes, blocks);
+    }
+    if (ctx->manifest != NULL)
+    {
+        block_index_close(ctx->manifest);
+        ctx->manifest = NULL;
+    }
 
-        // sort the blocks into the order in which they're laid out on disk
-        block_list_start = block_list_sort(block_list_start);
+    // after the plan, so that unchanged ones can be left out, and so that
+    // on_change comes first
+    notify_empty_files(cb, inodes);
+    deliver_inline_files(fs, cb, inodes);
 
-        struct block_list *block_list = block_list_start;
-        block_list_start = NULL;
-        struct block_list **prev_next_ptr = &block_list_start;
+    LogInfo("END BLOCK SCAN");
 
-        int max_inode_blocks = open_inodes_count > 0
-            ? (max_blocks+open_inodes_count-1)/open_inodes_count : max_blocks;
+    order_batches(fs, opts->batch_policy, inodes, blocks);
 
-        LogInfo("BEGIN BLOCK READ");
+    // a v2 client gets its batches on this thread
+    if (opts->callback_threads > 1 && batch == NULL)
+        ctx->callbacks = callback_pool_create(opts->callback_threads);
+    read_batches(&reader, cb, ctx->callbacks, batch, inodes, blocks);
 
-        while (block_list != NULL)
-        {
-            struct stripe *stripe = next_stripe(fs->blocksize,
-                                                coalesce_distance,
-                                                max_inode_blocks, block_list);
-
-            LogDebug("Found stripe of %lu blocks", stripe->consecutive_blocks);
-            if (stripe->consecutive_blocks > 0)
-            {
-                read_stripe_data(fs->blocksize, block_list->physical_block,
-                                 flags & ITERATE_OPT_DIRECT, fd, stripe);
-            }
-            else
-                free(stripe);
-
-            // stripe can be freed in heapify_stripe, so save consecutive_len here
-            size_t consecutive_len = stripe->consecutive_len;
-
-            block_list = heapify_stripe(fs, cb, block_list, stripe,
-                                        max_inode_blocks, &open_inodes_count);
-
-            // block is out of range
-            if (consecutive_len == 0 && block_list != NULL)
-            {
-                struct block_list *old_next = block_list->next;
-                *(prev_next_ptr) = block_list;
-                block_list_end = block_list;
-                prev_next_ptr = &block_list->next;
-                block_list->next = NULL;
-
-                block_list = old_next;
-            }
-        }
+    // errors from here on are only warned about
+    if (ctx->catch_errors)
+        error_trap_clear();
+    read_cleanup(ctx);
+    return 0;
+}
 
-        LogInfo("END BLOCK READ");
-    }
+/*
+ * Everything libdj needs set up once per process, whether by dj_init() or the
+ * first context.
+ */
+static pthread_once_t library_once = PTHREAD_ONCE_INIT;
 
-    if (close(fd) != 0)
-        exit_str("Error closing block device");
+void init_library()
+{
+    if (prog_name == NULL)
+        prog_name = "libdj";
+    initialize_ext2_error_table();
+    clog_init();
+}
 
-    if (ext2fs_close(fs) != 0)
-        exit_str("Error closing file system");
+struct dj_ctx *dj_ctx_new()
+{
+    pthread_once(&library_once, init_library);
+
+    struct dj_ctx *ctx = malloc(sizeof(struct dj_ctx));
+    if (ctx != NULL)
+        ctx_init(ctx, 1);
+    return ctx;
+}
+
+void dj_ctx_free(struct dj_ctx *ctx)
+{
+    free(ctx);
+}
+
+int dj_ctx_read(struct dj_ctx *ctx, char *dev_path, char **targets,
+                int targets_count, block_cb cb, struct dj_options *opts)
+{
+    ctx->trap.message[0] = '\0';
+    return read_targets(ctx, dev_path, targets, targets_count, cb, NULL, opts,
+                        NULL);
+}
+
+const char *dj_ctx_error(struct dj_ctx *ctx)
+{
+    return ctx->trap.message;
 }
 
 void dj_init(char *error_prog_name)
 {
     prog_name = error_prog_name;
-    initialize_ext2_error_table();
-    clog_init();
+    pthread_once(&library_once, init_library);
 }
 
 void dj_free()
@@ -1,17 +1,309 @@
 #ifndef DJ_H
 #define DJ_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define ITERATE_OPT_DIRECT 1
+// read stripes on a separate thread while the calling thread runs callbacks
+#define ITERATE_OPT_PIPELINE 2
+// when reading a whole file system, find its files by reading the inode tables
+// in order rather than walking the directory tree
+#define ITERATE_OPT_INODE_SCAN 4
+// carry on each batch from wherever the last one left the disk head, rather
+// than from the lowest block, and batch files that lie ahead of it first
+#define ITERATE_OPT_ELEVATOR 8
+// walk the directory tree a level at a time, reading each level's directories
+// in physical order through the same read loop as file data. The walk is on
+// one thread, whatever scan_threads is, and ITERATE_OPT_INODE_SCAN wins over it
+#define ITERATE_OPT_DIR_BFS 16
+// hand each run of blocks to the callback as soon as it's read, in physical
+// order, rather than each file's in logical order; the whole read is then one
+// sweep of the disk, however many files there are, with nothing held back
+#define ITERATE_OPT_PHYSICAL_ORDER 32
 
+// how files are grouped into batches of max_inodes; see README.md
+#define DJ_BATCH_INODE 0
+#define DJ_BATCH_FIRST_BLOCK 1
+#define DJ_BATCH_BLOCK_GROUP 2
+#define DJ_BATCH_MEDIAN_EXTENT 3
+
+/*
+ * Called with each run of a file's data, in logical order. data is read-only:
+ * holes in sparse files are delivered out of a shared mapping of zeros.
+ * Returning nonzero skips the rest of the file (under all its names): it's
+ * dropped from the read, and none of it that's still to be read is read.
+ * With callback threads, a few more of its chunks may already be on their way.
+ */
 typedef int (*block_cb)(uint32_t inode, char *path, uint64_t pos,
 			            uint64_t file_len, char *data, uint64_t data_len,
 			            void **private);
 
+// what's happened to a file since the manifest of an incremental read
+#define DJ_FILE_UNCHANGED 0
+#define DJ_FILE_CHANGED 1
+#define DJ_FILE_APPENDED 2
+#define DJ_FILE_NEW 3
+#define DJ_FILE_DELETED 4
+
+/*
+ * Called once for each file in an incremental read, before any of its data,
+ * with one of the DJ_FILE_* changes. Unchanged files get no data at all, and
+ * files that have only been appended to (only ever reported with
+ * dj_options.trust_appends) only get data from pos on. Deleted files, named by
+ * their paths in the manifest, come after everything else.
+ */
+typedef void (*change_cb)(uint32_t inode, char *path, int change,
+                          uint64_t pos);
+
+// file types for dj_filter.types; directories and symlinks are never read
+#define DJ_TYPE_REG 1
+#define DJ_TYPE_CHR 2
+#define DJ_TYPE_BLK 4
+#define DJ_TYPE_FIFO 8
+#define DJ_TYPE_SOCK 16
+
+/*
+ * Which files dj_read_opts() reads, decided during the directory walk, before
+ * their blocks are so much as looked up. A file has to pass every test. Call
+ * dj_filter_init() first to get a filter that lets everything through.
+ *
+ * Name patterns are globs, matched against the whole path if they have a
+ * slash in them and against the file's name otherwise.
+ */
+struct dj_filter
+{
+    // if there are any include patterns, a file must match one of them, and
+    // it mustn't match any of the exclude patterns
+    char **include_names;
+    int include_names_count;
+    char **exclude_names;
+    int exclude_names_count;
+
+    // directories matching these are skipped, with everything under them
+    char **prune_names;
+    int prune_names_count;
+
+    // size range in bytes; a max of 0 means no maximum
+    uint64_t min_size;
+    uint64_t max_size;
+
+    // time ranges in seconds since the epoch; 0 means no limit
+    int64_t min_mtime;
+    int64_t max_mtime;
+    int64_t min_ctime;
+    int64_t max_ctime;
+
+    // owner, or -1 for any
+    int64_t uid;
+
+    // bitmask of DJ_TYPE_*, or 0 for any
+    int types;
+};
+
+/*
+ * What a read did with its stripe buffers, filled in as it finishes if
+ * dj_options.stats points at one. Buffers are reused out of a cache of idle
+ * ones: hits were found there, misses had to be allocated, and drops were
+ * freed rather than cached, since the cache already held pool_bytes of them.
+ */
+struct dj_stats
+{
+    uint64_t buffer_hits;
+    uint64_t buffer_misses;
+    uint64_t buffer_drops;
+};
+
+/*
+ * Tunables for dj_read_opts(). Call dj_options_init() first to get the
+ * defaults, then override whatever fields you care about.
+ */
+struct dj_options
+{
+    int max_inodes;
+    int max_blocks;
+    int coalesce_distance;
+
+    // number of stripe reads kept in flight at once; anything above 1 needs
+    // libdj to have been built with io_uring support
+    int queue_depth;
+
+    // cap on the idle stripe buffers cached for reuse; 0 means max_blocks'
+    // worth. Buffers in use don't count against it.
+    size_t pool_bytes;
+
+    // threads to find files and map their blocks with, each with its own
+    // handle on the file system
+    int scan_threads;
+
+    // threads to run the callback on; with more than one, different files'
+    // callbacks run at the same time, though each file's still come one at a
+    // time and in order
+    int callback_threads;
+
+    // one of the DJ_BATCH_* policies
+    int batch_policy;
+
+    // file to keep every file's block map in between runs, so that files that
+    // haven't changed since the last run needn't be mapped again; NULL for none
+    char *index_path;
+
+    // block index written by an earlier run (which may well be index_path) to
+    // only read what's changed since; NULL to read everything
+    char *manifest_path;
+    change_cb on_change;
+
+    // UNSAFE: take a file that's grown, with everything that was there before
+    // still in the same blocks, to have only been appended to, and read just
+    // the new part. A file rewritten in place and then extended looks exactly
+    // the same, and its rewritten data would never be read. Without this,
+    // such files are DJ_FILE_CHANGED and read in full.
+    int trust_appends;
+
+    // files to read out of those under the target path; NULL for all of them
+    struct dj_filter *filter;
+
+    int flags;
+    int advice_flags;
+
+    // filled in with what the read did, if not NULL
+    struct dj_stats *stats;
+};
+
+/*
+ * One run of a file's data, as handed out by dj_next_chunk() and to
+ * on_chunks; the fields are the same as block_cb's arguments, with the file's
+ * private pointer as it stands.
+ */
+struct dj_chunk
+{
+    uint32_t inode;
+    char *path;
+    uint64_t pos;
+    uint64_t file_len;
+    char *data;
+    uint64_t data_len;
+    void *private;
+};
+
+/*
+ * The v2 client interface, with each file's beginning and end spelled out and
+ * its data handed over in batches: on_chunks gets every chunk that reading
+ * one stripe completes in a single call, which may cover many files. A file's
+ * chunks still come in order, between its on_file_begin and on_file_end, and
+ * *private (NULL to start with) is the file's own, as with block_cb. Empty
+ * files get no chunks. Either hook can be NULL. A nonzero return from
+ * on_file_begin skips the file, which is ended straight away; on_chunks' is
+ * ignored.
+ */
+struct dj_consumer
+{
+    int (*on_file_begin)(uint32_t inode, char *path, uint64_t file_len,
+                         void **private);
+    int (*on_chunks)(const struct dj_chunk *chunks, size_t n);
+    int (*on_file_end)(uint32_t inode, char *path, void *private);
+};
+
+// a read that chunks are pulled out of, rather than pushed into a callback
+struct dj_iter;
+// a chunk's buffer, kept past its callback with dj_retain()
+struct dj_buffer;
+// everything one read has open; see dj_ctx_new()
+struct dj_ctx;
+
 void dj_init(char *error_prog_name);
 void dj_free();
+void dj_options_init(struct dj_options *opts);
+void dj_filter_init(struct dj_filter *filter);
+// DJ_BATCH_* policy with the given name (such as "median_extent"), or -1
+int dj_batch_policy(char *name);
 void dj_read(char *dev_path, char *dir_path, block_cb cb, int max_inodes,
 			 int max_blocks, int coalesce_distance, int flags, int advice_flags);
+void dj_read_opts(char *dev_path, char *dir_path, block_cb cb,
+                  struct dj_options *opts);
+/*
+ * Same as dj_read_opts(), for everything under any number of targets at once,
+ * in a single sweep of the disk. Each target is a path, or "inode:N" for the
+ * inode numbered N.
+ */
+void dj_read_targets(char *dev_path, char **targets, int targets_count,
+                     block_cb cb, struct dj_options *opts);
+/*
+ * Same as dj_read_targets(), for a v2 client. Everything's delivered on the
+ * calling thread, whatever callback_threads is, and the chunks handed to
+ * on_chunks can't be retained.
+ */
+void dj_read_consumer(char *dev_path, char **targets, int targets_count,
+                      struct dj_consumer *consumer, struct dj_options *opts);
+
+/*
+ * Re-entrant reads. A dj_ctx holds everything one read has open, so any number
+ * of reads can run at once on different threads (one per disk, say), each with
+ * its own context, and with no need for dj_init(). dj_ctx_read() and
+ * dj_ctx_read_consumer() are the same as dj_read_targets() and
+ * dj_read_consumer(), except that rather than exiting the process on an error,
+ * they tear the read down (closing the device and file system and freeing its
+ * buffers, though memory for files part-way through may be lost) and return
+ * -1, with dj_ctx_error() saying what went wrong; otherwise they return 0.
+ * Errors on a read's own worker threads (with scan_threads, callback_threads
+ * or ITERATE_OPT_PIPELINE) are handed back to the calling thread and reported
+ * the same way, though only once it next waits on them, so a few more chunks
+ * may be delivered in the meantime. A context can be reused once its read
+ * has returned. dj_ctx_new() returns NULL if it can't allocate one.
+ */
+struct dj_ctx *dj_ctx_new();
+void dj_ctx_free(struct dj_ctx *ctx);
+int dj_ctx_read(struct dj_ctx *ctx, char *dev_path, char **targets,
+                int targets_count, block_cb cb, struct dj_options *opts);
+int dj_ctx_read_consumer(struct dj_ctx *ctx, char *dev_path, char **targets,
+                         int targets_count, struct dj_consumer *consumer,
+                         struct dj_options *opts);
+const char *dj_ctx_error(struct dj_ctx *ctx);
+
+/*
+ * Keep the chunk of data a callback has been given past the end of the
+ * callback, without copying it. dj_retain() must be called from inside the
+ * callback, with the data it was given; the buffer stays valid until it's
+ * handed to dj_release(), which may be done from any thread. Only with
+ * ITERATE_OPT_PIPELINE does a retained buffer keep counting against
+ * max_blocks, so that the read waits for it once that's used up; one read
+ * into an io_uring registered buffer also keeps that buffer out of use.
+ * Otherwise nothing bounds how much retained data can pile up. The read
+ * doesn't return until every retained buffer has been released, so buffers
+ * mustn't be held waiting on the read itself. Returns NULL (which can be
+ * released all the same) for data that can't be retained, such as inline
+ * files'.
+ */
+struct dj_buffer *dj_retain(char *data);
+void dj_release(struct dj_buffer *buffer);
+
+/*
+ * Pull-based reads. dj_open() starts reading the targets just as
+ * dj_read_targets() would, but the data is handed out by dj_next_chunk(), in
+ * the same order the callback would have got it, and NULL once there's no
+ * more. Chunks point straight into the read buffers, so the read waits until
+ * each one has been given back with dj_release_chunk() (or by pulling the
+ * next) before going any further. dj_close() can be called at any point, and
+ * ends the read early if need be.
+ *
+ * The read runs on a thread of its own, so the targets and the filter must
+ * outlive the iterator, and on_change is called from that thread. Each chunk
+ * costs a handoff between the two threads, so small chunks are slower than
+ * they'd be through a callback. If the read fails, dj_next_chunk() returns
+ * NULL as if it had ended, and dj_iter_error() says what went wrong; it's
+ * empty otherwise. The error stays good until dj_close().
+ *
+ * A chunk's private pointer is its file's, NULL to start with, as with
+ * block_cb; dj_chunk_set_private() sets it for the file's later chunks, and
+ * only works on a chunk that hasn't been given back yet.
+ */
+struct dj_iter *dj_open(char *dev_path, char **targets, int targets_count,
+                        struct dj_options *opts);
+struct dj_chunk *dj_next_chunk(struct dj_iter *iter);
+void dj_release_chunk(struct dj_iter *iter, struct dj_chunk *chunk);
+void dj_chunk_set_private(struct dj_iter *iter, struct dj_chunk *chunk,
+                          void *private);
+const char *dj_iter_error(struct dj_iter *iter);
+void dj_close(struct dj_iter *iter);
 
 #endif
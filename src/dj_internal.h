@@ -5,16 +5,95 @@
 #include <ext2fs/ext2fs.h>
 
 #include "dj.h"
+#include "util.h"
 
+/*
+ * Despite the names, inode_list and block_list are each one element of a
+ * contiguous, growable array (inode_vec and block_vec respectively), which is
+ * far kinder to the cache than chasing pointers through millions of nodes.
+ *
+ * They're arrays of structs rather than a struct of arrays: everything that
+ * walks them (block mapping, striping, delivery) uses most of an element's
+ * fields together, so one element is one or two cache lines either way. The
+ * sorts, where a struct of arrays would pay off, already sort just the keys
+ * and an index array and move each element once at the end; see
+ * radix_sort.c.
+ */
 struct inode_list
 {
     ext2_ino_t index;
-    char *path;
+
+    // the file's directory and name in its inode_vec's path arena
+    uint32_t dir;
+    size_t name;
+
     uint64_t len;
-    struct inode_list *next;
 
-    struct block_list *blocks_start;
-    struct block_list *blocks_end;
+    // what the block index keys the inode's blocks on; see block_index.c
+    uint32_t generation;
+    uint32_t ctime;
+    uint32_t ctime_extra;
+    uint32_t mtime;
+    uint32_t mtime_extra;
+    uint64_t version;
+
+    // set once the above have been filled in, which the walk does out of the
+    // inode it reads anyway; see block_index_stamp()
+    int stamped;
+
+    // whether the data is in the inode rather than in blocks; see
+    // inline_data.c
+    int inline_data;
+
+    // set once an incremental read has dropped the whole file from the plan
+    int dropped;
+
+    // the inode's blocks, as a range of the block_vec they were scanned into
+    size_t blocks_start;
+    size_t blocks_count;
+
+    // the file's other names, if it's hard-linked, as a range of its path
+    // arena's links; see inode_vec_merge_links()
+    size_t links_start;
+    size_t links_count;
+};
+
+// see path_arena.c
+struct path_dir
+{
+    uint32_t parent;
+    size_t name;
+};
+
+// another name for a file, in a directory
+struct path_link
+{
+    uint32_t dir;
+    size_t name;
+};
+
+struct path_arena
+{
+    char *names;
+    size_t names_len;
+    size_t names_size;
+
+    struct path_dir *dirs;
+    uint32_t dirs_count;
+    uint32_t dirs_size;
+
+    struct path_link *links;
+    size_t links_count;
+    size_t links_size;
+};
+
+struct inode_vec
+{
+    struct inode_list *inodes;
+    size_t count;
+    size_t size;
+
+    struct path_arena paths;
 };
 
 struct stripe
@@ -27,6 +106,28 @@ struct stripe
 
     // total length of consecutive blocks in bytes, including gaps
     size_t consecutive_len;
+
+    // the stripe's blocks in the batch's block array and where they live on
+    // disk, so that stripes can be completed out of order
+    struct block_list *first_block;
+    size_t blocks_count;
+    blk64_t physical_block;
+
+    // registered io_uring buffer that data points into, if any; see
+    // stripe_uring.c
+    struct uring_reader *uring;
+    int uring_slot;
+
+    // how much of the data an io_uring read has brought in so far
+    size_t uring_done;
+
+    // pipeline whose memory budget the data counts against, if any; see
+    // pipeline.c
+    struct pipeline *pipeline;
+
+    // pool the data buffer goes back to, and the length it was taken with
+    struct buffer_pool *pool;
+    size_t data_len;
 };
 
 struct stripe_pointer
@@ -43,19 +144,93 @@ struct block_list
     e2_blkcnt_t logical_block;
     e2_blkcnt_t num_blocks;
     struct stripe_pointer stripe_ptr;
-    struct block_list *next;
+};
+
+struct block_vec
+{
+    struct block_list *blocks;
+    size_t count;
+    size_t size;
+};
+
+// what the client gets for each of a hard-linked file's other names
+struct link_cb_info
+{
+    char *path;
+    void *cb_private;
 };
 
 struct inode_cb_info
 {
     ext2_ino_t inode;
+
+    // NULL until inode_info_path() first builds it out of the arena
     char *path;
+    struct path_arena *paths;
+    uint32_t dir;
+    size_t name;
+
+    // the file's other names, which are delivered the same data
+    size_t links_start;
+    size_t links_count;
+    struct link_cb_info *links;
+
     uint64_t len;
     e2_blkcnt_t blocks_read;
     e2_blkcnt_t blocks_scanned;
     struct heap *block_cache;
     void *cb_private;
     int references;
+
+    // pool the inode's callbacks run on, if any, and how many of them are
+    // queued or running there; see callback_pool.c
+    struct callback_pool *callbacks;
+    int tasks;
+
+    // set to have the inode's blocks delivered as they're read rather than in
+    // logical order
+    int physical_order;
+
+    // batch the inode's data is queued up in for a v2 read, if any, and
+    // whether the client's been told the file's begun or ended; see consumer.c
+    struct chunk_batch *batch;
+    int file_begun;
+
+    // set once the client's asked for the rest of the file to be skipped; see
+    // skip_inode()
+    int skipped;
+};
+
+/*
+ * Everything one read has open, so that any number of reads can run at once,
+ * each with its own, and so that a read that fails part-way can be torn down.
+ */
+struct dj_ctx
+{
+    ext2_filsys fs;
+    int fd;
+    struct buffer_pool *pool;
+    struct pipeline *pipeline;
+    struct uring_reader *uring;
+    struct callback_pool *callbacks;
+    struct block_index *index;
+    struct block_index *manifest;
+
+    // where to report what the read did, if anywhere
+    struct dj_stats *stats;
+
+    struct inode_vec inodes;
+    struct block_vec blocks;
+
+    // whether fatal errors end up in trap rather than exiting
+    int catch_errors;
+    struct error_trap trap;
 };
 
+// see dj.c
+void ctx_init(struct dj_ctx *ctx, int catch_errors);
+int read_targets(struct dj_ctx *ctx, char *dev_path, char **targets,
+                 int targets_count, block_cb cb, struct chunk_batch *batch,
+                 struct dj_options *opts, int *stop);
+
 #endif
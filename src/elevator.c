@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_policy.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "elevator.h"
+#include "radix_sort.h"
+#include "util.h"
+
+/*
+ * Circular SCAN across batches. Left to itself, every batch's sorted blocks
+ * start again from the lowest one, sending the head back towards the start of
+ * the disk once per batch. Instead, we keep track of where the last batch left
+ * the head and
+ *   1) admit, out of the next few batches' worth of files, the ones whose data
+ *      starts soonest ahead of the head, wrapping around at the end of the
+ *      disk, and
+ *   2) read each batch starting from the head, up to the end of the disk, and
+ *      only then wrap around for the blocks behind it.
+ */
+
+// how many batches' worth of files to choose the next batch from
+#define ELEVATOR_WINDOW_BATCHES 4
+
+/*
+ * Reorder the files at the front of inodes (those that haven't been batched
+ * yet) so that the ones whose data lies soonest ahead of the head come first.
+ * Files further down than the window keep their place, so the batching policy
+ * still decides roughly where each file comes.
+ */
+void elevator_admit(ext2_filsys fs, blk64_t head, int max_inodes,
+                    struct inode_list *inodes, size_t count,
+                    struct block_vec *blocks)
+{
+    size_t window = (size_t)max_inodes * ELEVATOR_WINDOW_BATCHES;
+    if (count > window)
+        count = window;
+    if (count < 2)
+        return;
+
+    blk64_t disk_blocks = ext2fs_blocks_count(fs->super);
+    uint64_t *keys = emalloc(sizeof(uint64_t) * count);
+    for (size_t i = 0; i < count; i++)
+    {
+        struct inode_list *inode = &inodes[i];
+        blk64_t first_block = batch_key_first_block(
+            fs, inode, &blocks->blocks[inode->blocks_start]);
+
+        // files without any blocks to read cost nothing, so let them in first
+        if (first_block == 0)
+            keys[i] = 0;
+        else if (first_block >= head)
+            keys[i] = first_block - head + 1;
+        else
+            keys[i] = first_block + disk_blocks - head + 1;
+    }
+
+    sort_inodes_by_keys(inodes, count, keys);
+
+    free(keys);
+}
+
+/*
+ * Rotate a batch's sorted blocks so that reading starts at the first one at or
+ * ahead of the head, leaving any holes at the front where heapify_holes()
+ * expects them. Returns where the head will be once the batch has been read.
+ */
+blk64_t elevator_sweep(blk64_t head, struct block_list *blocks, size_t count)
+{
+    size_t holes = 0;
+    while (holes < count && blocks[holes].physical_block == 0)
+        holes++;
+    if (holes == count)
+        return head;
+
+    // the first block ahead of the head
+    size_t lo = holes, hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (blocks[mid].physical_block < head)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    size_t behind = lo - holes;
+    if (behind > 0 && lo < count)
+    {
+        LogDebug("Sweeping %lu blocks ahead of block %lu before wrapping "
+                 "around to %lu behind it", count - lo, head, behind);
+
+        struct block_list *wrapped = emalloc(sizeof(struct block_list)
+                                             * behind);
+        memcpy(wrapped, &blocks[holes], sizeof(struct block_list) * behind);
+        memmove(&blocks[holes], &blocks[lo],
+                sizeof(struct block_list) * (count - lo));
+        memcpy(&blocks[holes + count - lo], wrapped,
+               sizeof(struct block_list) * behind);
+        free(wrapped);
+    }
+
+    struct block_list *last = &blocks[count-1];
+    return last->physical_block + last->num_blocks;
+}
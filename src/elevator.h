@@ -0,0 +1,11 @@
+#ifndef DJ_ELEVATOR_H
+#define DJ_ELEVATOR_H
+
+#include "dj_internal.h"
+
+void elevator_admit(ext2_filsys fs, blk64_t head, int max_inodes,
+                    struct inode_list *inodes, size_t count,
+                    struct block_vec *blocks);
+blk64_t elevator_sweep(blk64_t head, struct block_list *blocks, size_t count);
+
+#endif
@@ -0,0 +1,117 @@
+#include <fnmatch.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dj_internal.h"
+#include "filter.h"
+
+/*
+ * Filters are applied while the directory tree is walked, to the entry's name
+ * and the inode that's been read in anyway to tell files from directories, so
+ * that files nobody wants never get their blocks mapped, let alone read.
+ */
+
+/*
+ * Patterns with a slash in them are matched against the whole path, the rest
+ * against the name alone, like .gitignore.
+ */
+int filter_match(char *pattern, char *name, char *dir_path)
+{
+    if (strchr(pattern, '/') == NULL)
+        return fnmatch(pattern, name, 0) == 0;
+
+    size_t dir_path_len = dir_path != NULL ? strlen(dir_path) : 0;
+    char path[dir_path_len + strlen(name) + 2];
+    char *sep = dir_path_len > 0 && dir_path[dir_path_len-1] == '/' ? "" : "/";
+    sprintf(path, "%s%s%s", dir_path != NULL ? dir_path : "", sep, name);
+    return fnmatch(pattern, path, FNM_PATHNAME) == 0;
+}
+
+int filter_match_any(char **patterns, int count, char *name, char *dir_path)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (filter_match(patterns[i], name, dir_path))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Whether a directory and everything under it should be skipped.
+ */
+int filter_prune_dir(struct dj_filter *filter, char *name, char *dir_path)
+{
+    return filter != NULL
+        && filter_match_any(filter->prune_names, filter->prune_names_count,
+                            name, dir_path);
+}
+
+int filter_type(struct dj_filter *filter, struct ext2_inode *inode)
+{
+    int mode = inode->i_mode;
+    int type = LINUX_S_ISREG(mode) ? DJ_TYPE_REG
+             : LINUX_S_ISCHR(mode) ? DJ_TYPE_CHR
+             : LINUX_S_ISBLK(mode) ? DJ_TYPE_BLK
+             : LINUX_S_ISFIFO(mode) ? DJ_TYPE_FIFO
+             : LINUX_S_ISSOCK(mode) ? DJ_TYPE_SOCK
+             : 0;
+    return (filter->types & type) != 0;
+}
+
+/*
+ * Whether a file's inode passes the filter, going by its metadata alone.
+ */
+int filter_inode(struct dj_filter *filter, struct ext2_inode *inode)
+{
+    if (filter == NULL)
+        return 1;
+
+    uint64_t size = EXT2_I_SIZE(inode);
+    if (size < filter->min_size
+        || (filter->max_size > 0 && size > filter->max_size))
+    {
+        return 0;
+    }
+
+    if ((filter->min_mtime > 0 && inode->i_mtime < filter->min_mtime)
+        || (filter->max_mtime > 0 && inode->i_mtime > filter->max_mtime)
+        || (filter->min_ctime > 0 && inode->i_ctime < filter->min_ctime)
+        || (filter->max_ctime > 0 && inode->i_ctime > filter->max_ctime))
+    {
+        return 0;
+    }
+
+    if (filter->uid >= 0 && inode_uid(*inode) != filter->uid)
+        return 0;
+
+    if (filter->types != 0 && !filter_type(filter, inode))
+        return 0;
+
+    return 1;
+}
+
+/*
+ * Whether a file passes the filter, going by its name alone.
+ */
+int filter_name(struct dj_filter *filter, char *name, char *dir_path)
+{
+    if (filter == NULL)
+        return 1;
+
+    if (filter->include_names_count > 0
+        && !filter_match_any(filter->include_names,
+                             filter->include_names_count, name, dir_path))
+    {
+        return 0;
+    }
+
+    return !filter_match_any(filter->exclude_names,
+                             filter->exclude_names_count, name, dir_path);
+}
+
+void dj_filter_init(struct dj_filter *filter)
+{
+    memset(filter, 0, sizeof(struct dj_filter));
+    filter->uid = -1;
+}
@@ -0,0 +1,10 @@
+#ifndef DJ_FILTER_H
+#define DJ_FILTER_H
+
+#include "dj_internal.h"
+
+int filter_prune_dir(struct dj_filter *filter, char *name, char *dir_path);
+int filter_inode(struct dj_filter *filter, struct ext2_inode *inode);
+int filter_name(struct dj_filter *filter, char *name, char *dir_path);
+
+#endif
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_index.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "incremental.h"
+#include "path_arena.h"
+#include "stripe.h"
+#include "util.h"
+
+/*
+ * Incremental reads compare every file's freshly-scanned block map with the
+ * one in the manifest (a block index written by an earlier run), and only
+ * leave the blocks that need reading in the read plan:
+ *   - unchanged files (whose block index entries are still current; see
+ *     block_index.c) have none,
+ *   - files that look like they've only been appended to (same generation,
+ *     longer, and the same blocks under everything that was there before)
+ *     have only those from the old end of the file on, if the client trusts
+ *     that, and
+ *   - anything else has all of them.
+ * Appends are only a guess: rewriting a file in place and then extending it
+ * leaves exactly the same traces, so trusting them is up to the client.
+ * The client is told which of these each file is before any data arrives, and
+ * is told about files in the manifest that no longer exist at the end.
+ */
+
+/*
+ * Physical block that logical block sits at in a sorted run of blocks, 0 if
+ * it's a hole; *end is set to the first logical block after the run it's in.
+ */
+blk64_t run_physical_block(struct block_index_run *runs, size_t count,
+                           size_t *pos, e2_blkcnt_t logical_block,
+                           e2_blkcnt_t *end)
+{
+    while (*pos < count
+           && runs[*pos].logical_block + runs[*pos].num_blocks <= logical_block)
+    {
+        (*pos)++;
+    }
+    if (*pos == count || runs[*pos].logical_block > logical_block)
+    {
+        *end = *pos < count ? runs[*pos].logical_block : logical_block + 1;
+        return 0;
+    }
+
+    struct block_index_run *run = &runs[*pos];
+    *end = run->logical_block + run->num_blocks;
+    return run->physical_block == 0
+        ? 0 : run->physical_block + (logical_block - run->logical_block);
+}
+
+blk64_t block_physical_block(struct block_list *blocks, size_t count,
+                             size_t *pos, e2_blkcnt_t logical_block,
+                             e2_blkcnt_t *end)
+{
+    while (*pos < count
+           && blocks[*pos].logical_block + blocks[*pos].num_blocks
+              <= logical_block)
+    {
+        (*pos)++;
+    }
+    if (*pos == count || blocks[*pos].logical_block > logical_block)
+    {
+        *end = *pos < count ? blocks[*pos].logical_block : logical_block + 1;
+        return 0;
+    }
+
+    struct block_list *block = &blocks[*pos];
+    *end = block->logical_block + block->num_blocks;
+    return block->physical_block == 0
+        ? 0 : block->physical_block + (logical_block - block->logical_block);
+}
+
+/*
+ * Whether the first num_blocks logical blocks of a file are where the manifest
+ * says they were.
+ */
+int blocks_match(struct block_index *manifest, struct block_index_inode *entry,
+                 struct block_list *blocks, size_t count,
+                 e2_blkcnt_t num_blocks)
+{
+    struct block_index_run *runs = &manifest->runs[entry->runs_start];
+    size_t runs_pos = 0, blocks_pos = 0;
+
+    for (e2_blkcnt_t logical_block = 0; logical_block < num_blocks;)
+    {
+        e2_blkcnt_t run_end, block_end;
+        blk64_t old_block = run_physical_block(runs, entry->runs_count,
+                                               &runs_pos, logical_block,
+                                               &run_end);
+        blk64_t new_block = block_physical_block(blocks, count, &blocks_pos,
+                                                 logical_block, &block_end);
+        if (old_block != new_block)
+            return 0;
+
+        // both runs carry on in step until the first of them ends
+        logical_block = run_end < block_end ? run_end : block_end;
+    }
+    return 1;
+}
+
+/*
+ * Drop an inode's blocks before logical block start_block from the read plan,
+ * and have delivery start there instead of at the beginning of the file.
+ */
+void trim_inode_blocks(uint64_t block_size, struct inode_list *inode_list,
+                       struct block_vec *blocks, e2_blkcnt_t start_block)
+{
+    struct block_list *inode_blocks = &blocks->blocks[inode_list->blocks_start];
+    struct inode_cb_info *info = inode_blocks[0].inode_info;
+    info->blocks_read = start_block;
+
+    size_t dropped = 0;
+    while (dropped < inode_list->blocks_count
+           && inode_blocks[dropped].logical_block
+              + inode_blocks[dropped].num_blocks <= start_block)
+    {
+        deref_inode(info);
+        dropped++;
+    }
+    inode_list->blocks_start += dropped;
+    inode_list->blocks_count -= dropped;
+
+    if (inode_list->blocks_count == 0)
+        return;
+
+    // the first block left may start before start_block
+    struct block_list *block = &blocks->blocks[inode_list->blocks_start];
+    if (block->logical_block < start_block)
+    {
+        e2_blkcnt_t skip = start_block - block->logical_block;
+        if (block->physical_block != 0)
+            block->physical_block += skip;
+        block->logical_block += skip;
+        block->num_blocks -= skip;
+
+        uint64_t remaining_len = info->len - block->logical_block * block_size;
+        uint64_t simple_len = block->num_blocks * block_size;
+        block->stripe_ptr.len = simple_len > remaining_len
+            ? remaining_len : simple_len;
+    }
+}
+
+/*
+ * Drop all of an inode's data from the read plan.
+ */
+void drop_inode_blocks(struct inode_list *inode_list, struct block_vec *blocks)
+{
+    for (size_t i = 0; i < inode_list->blocks_count; i++)
+        deref_inode(blocks->blocks[inode_list->blocks_start + i].inode_info);
+    inode_list->blocks_count = 0;
+    inode_list->inline_data = 0;
+    inode_list->dropped = 1;
+}
+
+/*
+ * Whether path is one of a file's names.
+ */
+int inode_has_path(struct path_arena *paths, struct inode_list *inode_list,
+                   char *path)
+{
+    for (size_t i = 0; i <= inode_list->links_count; i++)
+    {
+        struct path_link *link = i > 0
+            ? &paths->links[inode_list->links_start + i - 1] : NULL;
+        char *name_path = link != NULL
+            ? path_arena_path(paths, link->dir, link->name)
+            : path_arena_path(paths, inode_list->dir, inode_list->name);
+        int found = !strcmp(name_path, path);
+        free(name_path);
+        if (found)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Tell the client about every manifest entry whose path no longer names the
+ * same file. Only each file's first name goes in the index, so a file whose
+ * first name has gone but that's still linked elsewhere counts as deleted
+ * under that name. Both the manifest and inodes are in inode number order.
+ */
+void notify_deleted(struct block_index *manifest, change_cb on_change,
+                    struct inode_vec *inodes)
+{
+    size_t current = 0;
+    for (uint64_t i = 0; i < manifest->header->inodes_count; i++)
+    {
+        struct block_index_inode *entry = &manifest->inodes[i];
+        while (current < inodes->count
+               && inodes->inodes[current].index < entry->ino)
+        {
+            current++;
+        }
+
+        int found = 0;
+        for (size_t j = current; j < inodes->count
+                                 && inodes->inodes[j].index == entry->ino; j++)
+        {
+            struct inode_list *inode_list = &inodes->inodes[j];
+            if (inode_list->generation != entry->generation)
+                continue;
+
+            found = inode_has_path(&inodes->paths, inode_list,
+                                   &manifest->paths[entry->path_offset]);
+            if (found)
+                break;
+        }
+
+        if (!found && on_change != NULL)
+        {
+            on_change(entry->ino, &manifest->paths[entry->path_offset],
+                      DJ_FILE_DELETED, 0);
+        }
+    }
+}
+
+/*
+ * Cut the read plan down to what's changed since the manifest was written. The
+ * inodes must still be in inode number order. With no manifest, every file is
+ * new.
+ */
+void plan_incremental(ext2_filsys fs, struct block_index *manifest,
+                      change_cb on_change, int trust_appends,
+                      struct inode_vec *inodes, struct block_vec *blocks)
+{
+    size_t counts[DJ_FILE_DELETED] = { 0 };
+
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        struct inode_list *inode_list = &inodes->inodes[i];
+        struct block_index_inode *entry = manifest != NULL
+            ? block_index_find(manifest, inode_list->index) : NULL;
+        struct block_list *inode_blocks =
+            &blocks->blocks[inode_list->blocks_start];
+
+        int change;
+        uint64_t pos = 0;
+        if (entry == NULL || entry->generation != inode_list->generation)
+            change = DJ_FILE_NEW;
+        else if (block_index_current(entry, inode_list))
+        {
+            change = DJ_FILE_UNCHANGED;
+            drop_inode_blocks(inode_list, blocks);
+        }
+        else if (trust_appends && entry->len < inode_list->len
+                 && !inode_list->inline_data
+                 && blocks_match(manifest, entry, inode_blocks,
+                                 inode_list->blocks_count,
+                                 entry->len / fs->blocksize))
+        {
+            // the old last block may have been partial, so start there
+            change = DJ_FILE_APPENDED;
+            e2_blkcnt_t start_block = entry->len / fs->blocksize;
+            pos = start_block * fs->blocksize;
+            trim_inode_blocks(fs->blocksize, inode_list, blocks, start_block);
+        }
+        else
+            change = DJ_FILE_CHANGED;
+
+        counts[change]++;
+        if (on_change != NULL)
+        {
+            char *path = path_arena_path(&inodes->paths, inode_list->dir,
+                                         inode_list->name);
+            on_change(inode_list->index, path, change, pos);
+            free(path);
+
+            // a hard-linked file's other names are told the same
+            for (size_t j = 0; j < inode_list->links_count; j++)
+            {
+                struct path_link *link =
+                    &inodes->paths.links[inode_list->links_start + j];
+                path = path_arena_path(&inodes->paths, link->dir, link->name);
+                on_change(inode_list->index, path, change, pos);
+                free(path);
+            }
+        }
+    }
+
+    LogInfo("%lu files unchanged, %lu changed, %lu appended to, %lu new",
+            counts[DJ_FILE_UNCHANGED], counts[DJ_FILE_CHANGED],
+            counts[DJ_FILE_APPENDED], counts[DJ_FILE_NEW]);
+
+    if (manifest != NULL)
+        notify_deleted(manifest, on_change, inodes);
+}
@@ -0,0 +1,11 @@
+#ifndef DJ_INCREMENTAL_H
+#define DJ_INCREMENTAL_H
+
+#include "block_index.h"
+#include "dj_internal.h"
+
+void plan_incremental(ext2_filsys fs, struct block_index *manifest,
+                      change_cb on_change, int trust_appends,
+                      struct inode_vec *inodes, struct block_vec *blocks);
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clog.h"
+#include "dj_internal.h"
+#include "inline_data.h"
+#include "path_arena.h"
+#include "util.h"
+
+/*
+ * With ext4's inline_data feature, small files keep their data in the inode
+ * itself (in i_block, and past that in the system.data extended attribute in
+ * the rest of the inode) and have no blocks at all. The block scan flags them
+ * rather than mapping them, and they're delivered here, whole, in one call per
+ * name, straight out of the inode: none of the stripes, heaps or device reads
+ * that block-backed files go through.
+ *
+ * The inode is read again here rather than kept from the scan: the data can
+ * run on into the extended attributes, up to the whole inode, and holding
+ * that for every inline file until delivery would cost more than the one
+ * inode table read per file, which is usually still in the page cache.
+ */
+
+void deliver_inline_file(ext2_filsys fs, block_cb cb, struct path_arena *paths,
+                         struct inode_list *inode_list)
+{
+    size_t len;
+    CHECK_FATAL(ext2fs_inline_data_size(fs, inode_list->index, &len),
+            "while getting inline data size of inode %d", inode_list->index);
+    char *data = emalloc(len > 0 ? len : 1);
+    CHECK_FATAL(ext2fs_inline_data_get(fs, inode_list->index, NULL, data,
+                                       &len),
+            "while getting inline data of inode %d", inode_list->index);
+
+    for (size_t i = 0; i <= inode_list->links_count; i++)
+    {
+        struct path_link *link = i > 0
+            ? &paths->links[inode_list->links_start + i - 1] : NULL;
+        char *path = link != NULL
+            ? path_arena_path(paths, link->dir, link->name)
+            : path_arena_path(paths, inode_list->dir, inode_list->name);
+        void *cb_private = NULL;
+        cb(inode_list->index, path, 0, len, data, len, &cb_private);
+        free(path);
+    }
+
+    free(data);
+}
+
+/*
+ * Hand every inline file that's still in the read plan to the client.
+ */
+void deliver_inline_files(ext2_filsys fs, block_cb cb,
+                          struct inode_vec *inodes)
+{
+    size_t delivered = 0;
+    for (size_t i = 0; i < inodes->count; i++)
+    {
+        struct inode_list *inode_list = &inodes->inodes[i];
+        if (inode_list->inline_data)
+        {
+            deliver_inline_file(fs, cb, &inodes->paths, inode_list);
+            delivered++;
+        }
+    }
+
+    if (delivered > 0)
+        LogInfo("Delivered %lu files from their inodes", delivered);
+}
@@ -0,0 +1,9 @@
+#ifndef DJ_INLINE_DATA_H
+#define DJ_INLINE_DATA_H
+
+#include "dj_internal.h"
+
+void deliver_inline_files(ext2_filsys fs, block_cb cb,
+                          struct inode_vec *inodes);
+
+#endif
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clog.h"
+#include "dir_scan.h"
+#include "dj_internal.h"
+#include "filter.h"
+#include "inode_scan.h"
+#include "path_arena.h"
+#include "util.h"
+#include "vec.h"
+
+/*
+ * Instead of walking the directory tree and reading each entry's inode as we
+ * come across it, which is a random read of the inode table per file, read the
+ * whole inode table in order first and only then join the inodes up with the
+ * names in the directories.
+ */
+
+struct scanned_file
+{
+    ext2_ino_t ino;
+    uint64_t len;
+};
+
+struct scanned_dir
+{
+    ext2_ino_t ino;
+    ext2_ino_t parent;
+    char *name;
+    char *path;
+
+    // id in the path arena, given out along with path
+    uint32_t arena_id;
+
+    // set once the filter has been found to prune the directory
+    int pruned;
+};
+
+struct scanned_link
+{
+    ext2_ino_t dir;
+    ext2_ino_t ino;
+    char *name;
+};
+
+struct inode_scan_info
+{
+    // both sorted by inode number, since that's the order the scan finds them
+    // in
+    struct scanned_file *files;
+    size_t files_count;
+    size_t files_size;
+
+    struct scanned_dir *dirs;
+    size_t dirs_count;
+    size_t dirs_size;
+
+    // directory entries that name files
+    struct scanned_link *links;
+    size_t links_count;
+    size_t links_size;
+
+    // directory currently being iterated over
+    ext2_ino_t dir;
+
+    struct dj_filter *filter;
+    struct path_arena *paths;
+};
+
+#define GROW(array, count, size) \
+    if (count == size) \
+    { \
+        size = size > 0 ? size * 2 : 1024; \
+        array = erealloc(array, sizeof(*array) * size); \
+    }
+
+struct scanned_file *find_scanned_file(struct inode_scan_info *info,
+                                       ext2_ino_t ino)
+{
+    size_t lo = 0, hi = info->files_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (info->files[mid].ino < ino)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < info->files_count && info->files[lo].ino == ino
+        ? &info->files[lo] : NULL;
+}
+
+struct scanned_dir *find_scanned_dir(struct inode_scan_info *info,
+                                     ext2_ino_t ino)
+{
+    size_t lo = 0, hi = info->dirs_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (info->dirs[mid].ino < ino)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < info->dirs_count && info->dirs[lo].ino == ino
+        ? &info->dirs[lo] : NULL;
+}
+
+char *join_path(char *dir_path, char *name)
+{
+    size_t dir_path_len = strlen(dir_path);
+    char *path = emalloc(dir_path_len + strlen(name) + 2);
+    char *sep = dir_path_len > 0 && dir_path[dir_path_len-1] == '/' ? "" : "/";
+    sprintf(path, "%s%s%s", dir_path, sep, name);
+    return path;
+}
+
+/*
+ * Full path of a directory, or NULL if it isn't reachable from the root (for
+ * example, if it was being deleted while we scanned) or has been pruned.
+ */
+char *scanned_dir_path(struct inode_scan_info *info, struct scanned_dir *dir)
+{
+    if (dir->path == NULL && dir->name != NULL && !dir->pruned)
+    {
+        struct scanned_dir *parent = find_scanned_dir(info, dir->parent);
+        char *parent_path = parent != NULL && parent != dir
+            ? scanned_dir_path(info, parent) : NULL;
+        if (parent_path != NULL
+            && filter_prune_dir(info->filter, dir->name, parent_path))
+        {
+            LogDebug("Pruning directory %s", dir->name);
+            dir->pruned = 1;
+        }
+        else if (parent_path != NULL)
+        {
+            dir->path = join_path(parent_path, dir->name);
+            dir->arena_id = path_arena_add_dir(info->paths, parent->arena_id,
+                                               dir->name);
+        }
+    }
+    return dir->path;
+}
+
+int scan_dir_entry_cb(ext2_ino_t dir_ino, int entry,
+                      struct ext2_dir_entry *dirent, int offset, int blocksize,
+                      char *buf, void *private)
+{
+    if (entry != DIRENT_OTHER_FILE)
+        return 0;
+
+    struct inode_scan_info *info = private;
+
+    int name_len = dirent->name_len & 0xFF;
+    char *name = emalloc(name_len+1);
+    memcpy(name, dirent->name, name_len);
+    name[name_len] = '\0';
+
+    // the inode table tells us what kind of file this is without reading the
+    // inode again
+    struct scanned_dir *dir = find_scanned_dir(info, dirent->inode);
+    if (dir != NULL)
+    {
+        if (dir->name == NULL)
+        {
+            dir->parent = info->dir;
+            dir->name = name;
+        }
+        else
+            free(name);
+    }
+    else if (find_scanned_file(info, dirent->inode) != NULL)
+    {
+        GROW(info->links, info->links_count, info->links_size);
+        struct scanned_link *link = &info->links[info->links_count++];
+        link->dir = info->dir;
+        link->ino = dirent->inode;
+        link->name = name;
+    }
+    else
+        free(name);
+
+    return 0;
+}
+
+void get_inode_list_linear(ext2_filsys fs, char *target_path,
+                           struct dj_filter *filter, struct inode_vec *inodes)
+{
+    ext2_ino_t target_ino;
+    CHECK_FATAL(ext2fs_namei_follow(fs, EXT2_ROOT_INO, EXT2_ROOT_INO,
+                                    target_path, &target_ino),
+            "while looking up path %s", target_path);
+    if (target_ino != EXT2_ROOT_INO)
+    {
+        LogWarn("%s is not the root of the file system; walking its directory "
+                "tree instead of scanning the inode table", target_path);
+        get_inode_list(fs, target_path, filter, inodes);
+        return;
+    }
+
+    struct inode_scan_info info;
+    memset(&info, 0, sizeof(info));
+    info.filter = filter;
+    info.paths = &inodes->paths;
+    path_arena_init(&inodes->paths, target_path);
+
+    ext2_inode_scan scan;
+    CHECK_FATAL(ext2fs_open_inode_scan(fs, 0, &scan),
+            "while opening inode scan");
+
+    // skip block groups whose inode tables were never initialized, and the
+    // unused tail of the rest, according to bg_itable_unused
+    ext2fs_inode_scan_flags(scan, EXT2_SF_DO_LAZY, 0);
+
+    LogInfo("Scanning inode tables");
+    ext2_ino_t ino;
+    struct ext2_inode inode_contents;
+    while (1)
+    {
+        errcode_t err = ext2fs_get_next_inode(scan, &ino, &inode_contents);
+        if (err == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+            continue;
+        CHECK_FATAL(err, "while scanning inode tables");
+        if (ino == 0)
+            break;
+
+        if (inode_contents.i_links_count == 0
+            || (ino < EXT2_FIRST_INO(fs->super) && ino != EXT2_ROOT_INO))
+        {
+            continue;
+        }
+
+        if (LINUX_S_ISDIR(inode_contents.i_mode))
+        {
+            GROW(info.dirs, info.dirs_count, info.dirs_size);
+            struct scanned_dir *dir = &info.dirs[info.dirs_count++];
+            memset(dir, 0, sizeof(*dir));
+            dir->ino = ino;
+            if (ino == EXT2_ROOT_INO)
+            {
+                dir->path = emalloc(strlen(target_path)+1);
+                strcpy(dir->path, target_path);
+            }
+        }
+        else if (!LINUX_S_ISLNK(inode_contents.i_mode)
+                 && filter_inode(filter, &inode_contents))
+        {
+            // files the filter rules out are left out here, so that their
+            // directory entries are ignored
+            GROW(info.files, info.files_count, info.files_size);
+            info.files[info.files_count].ino = ino;
+            info.files[info.files_count].len = EXT2_I_SIZE(&inode_contents);
+            info.files_count++;
+        }
+    }
+    ext2fs_close_inode_scan(scan);
+
+    LogInfo("Found %lu files in %lu directories", info.files_count,
+            info.dirs_count);
+
+    // directories are visited in inode number order, which is roughly the
+    // order their inodes (if not their blocks) lie on disk
+    char block_buf[fs->blocksize*3];
+    for (size_t i = 0; i < info.dirs_count; i++)
+    {
+        info.dir = info.dirs[i].ino;
+        CHECK_FATAL(ext2fs_dir_iterate2(fs, info.dir, 0, block_buf,
+                                        scan_dir_entry_cb, &info),
+                "while iterating over directory inode %d", info.dir);
+    }
+
+    for (size_t i = 0; i < info.links_count; i++)
+    {
+        struct scanned_link *link = &info.links[i];
+        struct scanned_dir *dir = find_scanned_dir(&info, link->dir);
+        char *dir_path = dir != NULL ? scanned_dir_path(&info, dir) : NULL;
+        if (dir_path != NULL && filter_name(filter, link->name, dir_path))
+        {
+            struct inode_list *list = inode_vec_append(inodes);
+            list->index = link->ino;
+            list->len = find_scanned_file(&info, link->ino)->len;
+            list->dir = dir->arena_id;
+            list->name = path_arena_add_name(&inodes->paths, link->name);
+        }
+        free(link->name);
+    }
+
+    for (size_t i = 0; i < info.dirs_count; i++)
+    {
+        free(info.dirs[i].name);
+        free(info.dirs[i].path);
+    }
+    free(info.dirs);
+    free(info.files);
+    free(info.links);
+}
@@ -0,0 +1,9 @@
+#ifndef DJ_INODE_SCAN_H
+#define DJ_INODE_SCAN_H
+
+#include "dj_internal.h"
+
+void get_inode_list_linear(ext2_filsys fs, char *target_path,
+                           struct dj_filter *filter, struct inode_vec *inodes);
+
+#endif
@@ -0,0 +1,207 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clog.h"
+#include "dj_internal.h"
+#include "util.h"
+
+/*
+ * The pull interface runs an ordinary read on a thread of its own, with a
+ * callback that hands each chunk over to whoever's pulling and then waits for
+ * it to be released before returning. The data is never copied, and the read
+ * only gets as far ahead of the consumer as one chunk: everything behind it,
+ * from the heaps to the device, simply waits.
+ *
+ * That's a pull interface built on the push one, rather than read_batches()
+ * turned inside out: the read keeps all of its state (heaps, stripes in
+ * flight, the pipeline) on its own stack, and making it resumable from
+ * dj_next_chunk() would mean reworking every read path. The price is a thread
+ * per iterator and a handoff in each direction per chunk, which adds up with
+ * small chunks, and that everything the read calls back into (on_change, the
+ * filter) runs on that thread. Errors on it are caught and handed back
+ * through dj_iter_error() rather than exiting.
+ */
+
+#define ITER_EMPTY 0 // waiting for the next chunk
+#define ITER_READY 1 // a chunk has been handed over but not pulled
+#define ITER_TAKEN 2 // the consumer has the chunk
+#define ITER_DONE 3  // there are no more chunks
+
+struct dj_iter
+{
+    pthread_t thread;
+
+    char *dev_path;
+    char **targets;
+    int targets_count;
+    struct dj_options opts;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int state;
+    struct dj_chunk chunk;
+
+    // where the chunk's file keeps its private pointer, for
+    // dj_chunk_set_private(); good until the callback returns
+    void **private;
+
+    // set by dj_close() to have the read wind down early; it's read by the
+    // reading thread outside the lock, so only ever touched atomically
+    int stop;
+
+    // the read's context, whose trap has the error if the read failed
+    struct dj_ctx ctx;
+};
+
+// the iterator a reading thread is running the read for, since the callback
+// has no other way of finding it
+static pthread_key_t iter_key;
+static pthread_once_t iter_key_once = PTHREAD_ONCE_INIT;
+
+void create_iter_key()
+{
+    if (pthread_key_create(&iter_key, NULL))
+        exit_str("Error creating iterator key");
+}
+
+int iter_cb(uint32_t inode, char *path, uint64_t pos, uint64_t file_len,
+            char *data, uint64_t data_len, void **private)
+{
+    struct dj_iter *iter = pthread_getspecific(iter_key);
+
+    pthread_mutex_lock(&iter->lock);
+    if (!__atomic_load_n(&iter->stop, __ATOMIC_RELAXED))
+    {
+        iter->chunk.inode = inode;
+        iter->chunk.path = path;
+        iter->chunk.pos = pos;
+        iter->chunk.file_len = file_len;
+        iter->chunk.data = data;
+        iter->chunk.data_len = data_len;
+        iter->chunk.private = *private;
+        iter->private = private;
+        iter->state = ITER_READY;
+        pthread_cond_broadcast(&iter->cond);
+
+        // the data is only good until we return
+        while (iter->state != ITER_EMPTY
+               && !__atomic_load_n(&iter->stop, __ATOMIC_RELAXED))
+            pthread_cond_wait(&iter->cond, &iter->lock);
+    }
+    // once closed, skip the rest of the file rather than read it for nothing
+    int stopped = __atomic_load_n(&iter->stop, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&iter->lock);
+    return stopped;
+}
+
+void *iter_worker(void *private)
+{
+    struct dj_iter *iter = private;
+    pthread_setspecific(iter_key, iter);
+
+    read_targets(&iter->ctx, iter->dev_path, iter->targets,
+                 iter->targets_count, iter_cb, NULL, &iter->opts, &iter->stop);
+
+    pthread_mutex_lock(&iter->lock);
+    iter->state = ITER_DONE;
+    pthread_cond_broadcast(&iter->cond);
+    pthread_mutex_unlock(&iter->lock);
+    return NULL;
+}
+
+struct dj_iter *dj_open(char *dev_path, char **targets, int targets_count,
+                        struct dj_options *opts)
+{
+    pthread_once(&iter_key_once, create_iter_key);
+
+    struct dj_iter *iter = ecalloc(sizeof(struct dj_iter));
+    iter->dev_path = dev_path;
+    iter->targets = targets;
+    iter->targets_count = targets_count;
+    iter->opts = *opts;
+    // the callback finds the iterator through the reading thread
+    iter->opts.callback_threads = 1;
+    iter->state = ITER_EMPTY;
+    ctx_init(&iter->ctx, 1);
+    pthread_mutex_init(&iter->lock, NULL);
+    pthread_cond_init(&iter->cond, NULL);
+
+    if (pthread_create(&iter->thread, NULL, iter_worker, iter))
+        exit_str("Error creating iterator thread");
+    return iter;
+}
+
+struct dj_chunk *dj_next_chunk(struct dj_iter *iter)
+{
+    pthread_mutex_lock(&iter->lock);
+
+    // pulling the next chunk gives the last one back
+    if (iter->state == ITER_TAKEN)
+    {
+        iter->state = ITER_EMPTY;
+        pthread_cond_broadcast(&iter->cond);
+    }
+
+    while (iter->state == ITER_EMPTY)
+        pthread_cond_wait(&iter->cond, &iter->lock);
+
+    struct dj_chunk *chunk = NULL;
+    if (iter->state == ITER_READY)
+    {
+        iter->state = ITER_TAKEN;
+        chunk = &iter->chunk;
+    }
+    pthread_mutex_unlock(&iter->lock);
+    return chunk;
+}
+
+void dj_release_chunk(struct dj_iter *iter, struct dj_chunk *chunk)
+{
+    pthread_mutex_lock(&iter->lock);
+    if (iter->state == ITER_TAKEN && chunk == &iter->chunk)
+    {
+        iter->state = ITER_EMPTY;
+        pthread_cond_broadcast(&iter->cond);
+    }
+    pthread_mutex_unlock(&iter->lock);
+}
+
+void dj_chunk_set_private(struct dj_iter *iter, struct dj_chunk *chunk,
+                          void *private)
+{
+    pthread_mutex_lock(&iter->lock);
+    // the callback's still waiting on the chunk, so its pointer is good
+    if (iter->state == ITER_TAKEN && chunk == &iter->chunk)
+    {
+        *iter->private = private;
+        chunk->private = private;
+    }
+    pthread_mutex_unlock(&iter->lock);
+}
+
+const char *dj_iter_error(struct dj_iter *iter)
+{
+    pthread_mutex_lock(&iter->lock);
+    // the reading thread has finished with the trap once the read's done
+    const char *error = iter->state == ITER_DONE ? iter->ctx.trap.message : "";
+    pthread_mutex_unlock(&iter->lock);
+    return error;
+}
+
+void dj_close(struct dj_iter *iter)
+{
+    pthread_mutex_lock(&iter->lock);
+    if (iter->state != ITER_DONE)
+        LogInfo("Closing iterator before the end of the read");
+    __atomic_store_n(&iter->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&iter->cond);
+    pthread_mutex_unlock(&iter->lock);
+
+    pthread_join(iter->thread, NULL);
+
+    pthread_mutex_destroy(&iter->lock);
+    pthread_cond_destroy(&iter->cond);
+    free(iter);
+}
@@ -5,6 +5,7 @@
 #include <limits.h>
 #include <libio.h>
 #include <errno.h>
+#include <pthread.h>
 #include "clog.h"
 #include "color.h"
 #include "hashmap.h"
@@ -13,11 +14,24 @@
 
 static map_t loggers;
 
+/*
+ * Held while the logger map is looked up or added to, and from the start of
+ * each message that's at or above its logger's level to its end, so that
+ * messages from different threads neither corrupt the map nor interleave.
+ * Messages below the level don't take it at all. Recursive, since looking up
+ * a logger can add one.
+ */
+static pthread_mutex_t clog_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// the logger this thread is writing a message to, and holding the lock for
+static __thread logger_ctx_t *clog_writing;
+
 static int clog_default_log_level = 0;
 
 struct timespec start_time;
 
-static char event_context[256];
+// each thread has its own, so that concurrent jobs can be told apart
+static __thread char event_context[256];
 
 void clog_init()
 {
@@ -160,17 +174,22 @@ void logger_ctx_free(logger_ctx_t *l)
 
 int clog_add_logger(logger_ctx_t *l_new)
 {
-	return hashmap_put(loggers, (char *)l_new->name, l_new) != MAP_OK;
+	pthread_mutex_lock(&clog_lock);
+	int ret = hashmap_put(loggers, (char *)l_new->name, l_new) != MAP_OK;
+	pthread_mutex_unlock(&clog_lock);
+	return ret;
 }
 
 logger_ctx_t *clog_get_logger(const char *name)
 {
 	logger_ctx_t *l;
+	pthread_mutex_lock(&clog_lock);
 	if (hashmap_get(loggers, (char *)name, (any_t *)&l) == MAP_MISSING) {
 		l = logger_ctx_new_file(name, clog_default_log_level, stdout);
 		if (clog_add_logger(l))
-			return NULL;
+			l = NULL;
 	}
+	pthread_mutex_unlock(&clog_lock);
 	return l;
 }
 
@@ -192,6 +211,9 @@ void clog_start_log(logger_ctx_t *l, const char *file, int line, const char *fun
 		l = clog_get_logger_for_file(file);
 	
 	if (level >= l->min_level) {
+		// released by clog_end_log(), which always follows
+		pthread_mutex_lock(&clog_lock);
+		clog_writing = l;
 		l->log_partial = 1;
 		
 		if (l->start_msg != NULL)
@@ -199,8 +221,9 @@ void clog_start_log(logger_ctx_t *l, const char *file, int line, const char *fun
 	}
 }
 
+// log_partial is only this thread's to look at while it's writing to l
 #define PARTIAL_LOG_IMPL(l, last_arg, fmt) \
-	if (l->log_partial) { \
+	if (clog_writing == l && l->log_partial) { \
 		fflush(l->fp); /* make sure writes are not concatenated out of order */ \
 		\
 		va_list args; \
@@ -222,21 +245,26 @@ void clog_end_log(logger_ctx_t *l, const char *file)
 	if (l == NULL)
 		l = clog_get_logger_for_file(file);
 	
+	// nothing was written, and the lock wasn't taken
+	if (clog_writing != l)
+		return;
+	
 	/*
-	 * Flush whether or not log_partial is true, to ensure that data buffered
-	 * on the file descriptor is not flushed at the wrong time (which would be
-	 * when log_partial becomes true again).
+	 * Flush before clearing log_partial, to ensure that data buffered on the
+	 * file descriptor is not flushed at the wrong time (which would be when
+	 * log_partial becomes true again).
 	 */
 	fflush(l->fp);
 	
-	if (l->log_partial) {
-		if (l->end_msg != NULL)
-			l->end_msg(l);
-		
-		// fflush() calls write(), which checks log_partial, so make
-		// sure to clear the flag only after that's done
-		l->log_partial = 0;
-	}
+	if (l->end_msg != NULL)
+		l->end_msg(l);
+	
+	// fflush() calls write(), which checks log_partial, so make sure to
+	// clear the flag only after that's done
+	l->log_partial = 0;
+	
+	clog_writing = NULL;
+	pthread_mutex_unlock(&clog_lock);
 }
 
 void clog_start_log_as(const char *name, const char *file, int line, const char *func, int level)
@@ -30,9 +30,12 @@ int file_md5(uint32_t inode, char *path, uint64_t pos, uint64_t file_len,
     {
         unsigned char md_buf[MD5_DIGEST_LENGTH];
         MD5_Final(md_buf, ctx);
+
+        // one printf per file, so that lines from callback threads don't mix
+        char hex[MD5_DIGEST_LENGTH*2+1];
         for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
-            printf("%02x", md_buf[i]);
-        printf("  %s\n", path);
+            sprintf(&hex[i*2], "%02x", md_buf[i]);
+        printf("%s  %s\n", hex, path);
         free(ctx);
     }
     return 0;
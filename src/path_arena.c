@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "util.h"
+
+/*
+ * Rather than a full path per file, which repeats every directory's path once
+ * for each file under it, each file is only its directory's id and its own
+ * name. Directories are likewise their parent's id and their own name, and all
+ * the names are packed end to end in one buffer. Directory 0 is the root of
+ * the walk, named by the whole path to it; when there's more than one root,
+ * the rest are directories that are their own parents. Full paths are only put
+ * together when somebody asks for one.
+ */
+
+#define PATH_ARENA_INITIAL_NAMES (64*1024)
+#define PATH_ARENA_INITIAL_DIRS 1024
+
+void path_arena_init(struct path_arena *arena, char *root)
+{
+    memset(arena, 0, sizeof(struct path_arena));
+    path_arena_add_dir(arena, 0, root);
+}
+
+void path_arena_free(struct path_arena *arena)
+{
+    free(arena->names);
+    free(arena->dirs);
+    free(arena->links);
+    memset(arena, 0, sizeof(struct path_arena));
+}
+
+/*
+ * Add another root to walk from, named by the whole path to it.
+ */
+uint32_t path_arena_add_root(struct path_arena *arena, char *root)
+{
+    uint32_t id = path_arena_add_dir(arena, 0, root);
+    arena->dirs[id].parent = id;
+    return id;
+}
+
+/*
+ * Copy a name into the arena, and return where it ended up.
+ */
+size_t path_arena_add_name(struct path_arena *arena, char *name)
+{
+    size_t len = strlen(name) + 1;
+    if (arena->names_len + len > arena->names_size)
+    {
+        size_t size = arena->names_size > 0
+            ? arena->names_size : PATH_ARENA_INITIAL_NAMES;
+        while (arena->names_len + len > size)
+            size *= 2;
+        arena->names = erealloc(arena->names, size);
+        arena->names_size = size;
+    }
+
+    size_t offset = arena->names_len;
+    memcpy(&arena->names[offset], name, len);
+    arena->names_len += len;
+    return offset;
+}
+
+uint32_t path_arena_add_dir(struct path_arena *arena, uint32_t parent,
+                            char *name)
+{
+    if (arena->dirs_count == arena->dirs_size)
+    {
+        arena->dirs_size = arena->dirs_size > 0
+            ? arena->dirs_size * 2 : PATH_ARENA_INITIAL_DIRS;
+        arena->dirs = erealloc(arena->dirs,
+                               sizeof(struct path_dir) * arena->dirs_size);
+    }
+
+    struct path_dir *dir = &arena->dirs[arena->dirs_count];
+    dir->parent = parent;
+    dir->name = path_arena_add_name(arena, name);
+    return arena->dirs_count++;
+}
+
+/*
+ * Record another name for a file, and return its index among the links.
+ */
+size_t path_arena_add_link(struct path_arena *arena, uint32_t dir, size_t name)
+{
+    if (arena->links_count == arena->links_size)
+    {
+        arena->links_size = arena->links_size > 0
+            ? arena->links_size * 2 : PATH_ARENA_INITIAL_DIRS;
+        arena->links = erealloc(arena->links,
+                                sizeof(struct path_link) * arena->links_size);
+    }
+
+    arena->links[arena->links_count].dir = dir;
+    arena->links[arena->links_count].name = name;
+    return arena->links_count++;
+}
+
+/*
+ * Put together the full path of a name in a directory in path, if it isn't
+ * NULL, and return its length either way (not counting the terminator).
+ */
+size_t build_path(struct path_arena *arena, uint32_t dir, size_t name,
+                  char *path)
+{
+    int depth = 1;
+    for (uint32_t id = dir; arena->dirs[id].parent != id;
+         id = arena->dirs[id].parent)
+    {
+        depth++;
+    }
+
+    // the components from the root down, then the name
+    char *components[depth+1];
+    uint32_t id = dir;
+    for (int i = depth-1; i >= 0; i--)
+    {
+        components[i] = &arena->names[arena->dirs[id].name];
+        id = arena->dirs[id].parent;
+    }
+    components[depth] = &arena->names[name];
+
+    size_t pos = 0;
+    char last = '\0';
+    for (int i = 0; i <= depth; i++)
+    {
+        // same rule as everywhere else: don't double up the root's slash,
+        // and a file with no directory at all (an empty root) is just its name
+        if (i > 0 && pos > 0 && last != '/')
+        {
+            if (path != NULL)
+                path[pos] = '/';
+            pos++;
+        }
+
+        size_t component_len = strlen(components[i]);
+        if (path != NULL)
+            memcpy(&path[pos], components[i], component_len);
+        pos += component_len;
+        if (component_len > 0)
+            last = components[i][component_len-1];
+    }
+    if (path != NULL)
+        path[pos] = '\0';
+    return pos;
+}
+
+size_t path_arena_path_len(struct path_arena *arena, uint32_t dir,
+                           size_t name)
+{
+    return build_path(arena, dir, name, NULL);
+}
+
+/*
+ * Build the full path of a name in a directory. The caller frees it.
+ */
+char *path_arena_path(struct path_arena *arena, uint32_t dir, size_t name)
+{
+    char *path = emalloc(build_path(arena, dir, name, NULL) + 1);
+    build_path(arena, dir, name, path);
+    return path;
+}
+
+/*
+ * Move other's directories and names onto the end of arena, and point count
+ * of other's inodes at where they've moved to. Other's root isn't copied over:
+ * its inodes and directories are put under root, a directory already in arena
+ * for the same path. Links are only added once discovery's done, so there
+ * aren't any yet.
+ */
+void path_arena_concat(struct path_arena *arena, struct path_arena *other,
+                       uint32_t root, struct inode_list *inodes, size_t count)
+{
+    size_t names_base = arena->names_len;
+    uint32_t dirs_base = arena->dirs_count - 1;
+
+    if (other->names_len > 0)
+    {
+        size_t size = arena->names_size > 0
+            ? arena->names_size : PATH_ARENA_INITIAL_NAMES;
+        while (arena->names_len + other->names_len > size)
+            size *= 2;
+        if (size != arena->names_size)
+        {
+            arena->names = erealloc(arena->names, size);
+            arena->names_size = size;
+        }
+        memcpy(&arena->names[arena->names_len], other->names,
+               other->names_len);
+        arena->names_len += other->names_len;
+    }
+
+    for (uint32_t i = 1; i < other->dirs_count; i++)
+    {
+        struct path_dir *dir = &other->dirs[i];
+        uint32_t parent = dir->parent == 0 ? root : dir->parent + dirs_base;
+        if (arena->dirs_count == arena->dirs_size)
+        {
+            arena->dirs_size = arena->dirs_size > 0
+                ? arena->dirs_size * 2 : PATH_ARENA_INITIAL_DIRS;
+            arena->dirs = erealloc(arena->dirs,
+                                   sizeof(struct path_dir) * arena->dirs_size);
+        }
+        arena->dirs[arena->dirs_count].parent = parent;
+        arena->dirs[arena->dirs_count].name = dir->name + names_base;
+        arena->dirs_count++;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        inodes[i].dir = inodes[i].dir == 0 ? root : inodes[i].dir + dirs_base;
+        inodes[i].name += names_base;
+    }
+
+    path_arena_free(other);
+}
+
+/*
+ * An inode's path, built the first time it's asked for and kept until the
+ * inode is done with.
+ */
+char *inode_info_path(struct inode_cb_info *info)
+{
+    if (info->path == NULL)
+        info->path = path_arena_path(info->paths, info->dir, info->name);
+    return info->path;
+}
+
+/*
+ * Path of an inode's ith other name, built the same way.
+ */
+char *inode_info_link_path(struct inode_cb_info *info, size_t i)
+{
+    struct link_cb_info *link = &info->links[i];
+    if (link->path == NULL)
+    {
+        struct path_link *path_link = &info->paths->links[info->links_start + i];
+        link->path = path_arena_path(info->paths, path_link->dir,
+                                     path_link->name);
+    }
+    return link->path;
+}
@@ -0,0 +1,22 @@
+#ifndef DJ_PATH_ARENA_H
+#define DJ_PATH_ARENA_H
+
+#include "dj_internal.h"
+
+void path_arena_init(struct path_arena *arena, char *root);
+void path_arena_free(struct path_arena *arena);
+uint32_t path_arena_add_root(struct path_arena *arena, char *root);
+size_t path_arena_add_name(struct path_arena *arena, char *name);
+uint32_t path_arena_add_dir(struct path_arena *arena, uint32_t parent,
+                            char *name);
+size_t path_arena_add_link(struct path_arena *arena, uint32_t dir, size_t name);
+size_t path_arena_path_len(struct path_arena *arena, uint32_t dir,
+                           size_t name);
+char *path_arena_path(struct path_arena *arena, uint32_t dir, size_t name);
+void path_arena_concat(struct path_arena *arena, struct path_arena *other,
+                       uint32_t root, struct inode_list *inodes, size_t count);
+
+char *inode_info_path(struct inode_cb_info *info);
+char *inode_info_link_path(struct inode_cb_info *info, size_t i);
+
+#endif
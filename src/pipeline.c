@@ -0,0 +1,264 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clog.h"
+#include "dj_internal.h"
+#include "pipeline.h"
+#include "stripe.h"
+#include "util.h"
+
+// upper bound on the number of read stripes waiting for delivery, on top of
+// the byte budget, so that runs of tiny stripes don't pile up unbounded
+#define PIPELINE_QUEUE_LEN 256
+
+/*
+ * A reader thread plans and reads stripes ahead of the calling thread, which
+ * heapifies them and runs the client callbacks. The two hand stripes over
+ * through a bounded queue; a NULL entry marks the end of a batch. If the
+ * reader thread fails, the calling thread raises its error the next time it
+ * waits on the queue, and if the calling thread fails, the reader gives up
+ * whatever it was waiting for once the pipeline's shut down.
+ */
+struct pipeline
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    ext2_filsys fs;
+    struct buffer_pool *pool;
+    int fd;
+    int direct;
+    int coalesce_distance;
+
+    // batch handed to the reader thread, the limit it was planned with and
+    // the read's stop flag
+    struct block_list *pending;
+    size_t pending_count;
+    int max_inode_blocks;
+    int *stop;
+    int shutdown;
+
+    // where the reader thread's errors go
+    int failed;
+    struct error_trap trap;
+
+    struct stripe *queue[PIPELINE_QUEUE_LEN];
+    int queue_head;
+    int queue_count;
+
+    // bytes of stripe data allocated and not yet freed, whether still queued
+    // or sitting in inode heaps
+    size_t budget;
+    size_t outstanding;
+};
+
+void pipeline_push(struct pipeline *pipeline, struct stripe *stripe)
+{
+    int tail = (pipeline->queue_head + pipeline->queue_count) % PIPELINE_QUEUE_LEN;
+    pipeline->queue[tail] = stripe;
+    pipeline->queue_count++;
+    pthread_cond_broadcast(&pipeline->cond);
+}
+
+void pipeline_reader_run(struct pipeline *pipeline)
+{
+    uint64_t block_size = pipeline->fs->blocksize;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (1)
+    {
+        while (pipeline->pending == NULL && !pipeline->shutdown)
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        if (pipeline->shutdown)
+            break;
+
+        struct block_list *blocks = pipeline->pending;
+        size_t count = pipeline->pending_count;
+        int max_inode_blocks = pipeline->max_inode_blocks;
+        int *stop = pipeline->stop;
+        pipeline->pending = NULL;
+
+        size_t pos = 0;
+        int stopped = 0;
+        while (pos < count)
+        {
+            // Wait for room, then plan a stripe that fits in it. If nothing
+            // is queued, the stripes in memory are all waiting in heaps for
+            // blocks we haven't read yet, so read ahead anyway rather than
+            // deadlock, though only one run of blocks at a time.
+            while (!pipeline->shutdown
+                   && (pipeline->queue_count == PIPELINE_QUEUE_LEN
+                       || (pipeline->queue_count > 0
+                           && pipeline->outstanding >= pipeline->budget)))
+            {
+                pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            }
+            if (pipeline->shutdown)
+                break;
+            size_t room = pipeline->outstanding < pipeline->budget
+                ? pipeline->budget - pipeline->outstanding : 0;
+
+            pthread_mutex_unlock(&pipeline->lock);
+
+            if (!stopped)
+                stopped = skip_if_stopped(stop, &blocks[pos], count - pos);
+
+            struct stripe *stripe = next_stripe(block_size,
+                                                pipeline->coalesce_distance,
+                                                max_inode_blocks, room,
+                                                &blocks[pos], count - pos);
+            LogDebug("Found stripe of %lu blocks", stripe->consecutive_blocks);
+            pos += stripe->blocks_count;
+
+            pthread_mutex_lock(&pipeline->lock);
+
+            // a single run longer than the room left still has to wait for
+            // the queue to drain
+            while (!pipeline->shutdown
+                   && (pipeline->queue_count == PIPELINE_QUEUE_LEN
+                       || (pipeline->queue_count > 0
+                           && pipeline->outstanding + stripe->consecutive_len
+                              > pipeline->budget)))
+            {
+                pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            }
+            if (pipeline->shutdown)
+            {
+                free(stripe);
+                break;
+            }
+            pipeline->outstanding += stripe->consecutive_len;
+
+            pthread_mutex_unlock(&pipeline->lock);
+            // a stripe of nothing but skipped files' blocks is passed on
+            // unread, for them to be dropped
+            if (stripe->consecutive_blocks > 0)
+            {
+                read_stripe_data(pipeline->pool, block_size,
+                                 stripe->physical_block, pipeline->direct,
+                                 pipeline->fd, stripe);
+                stripe->pipeline = pipeline;
+            }
+            pthread_mutex_lock(&pipeline->lock);
+
+            pipeline_push(pipeline, stripe);
+        }
+
+        while (pipeline->queue_count == PIPELINE_QUEUE_LEN
+               && !pipeline->shutdown)
+        {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        }
+        if (!pipeline->shutdown)
+            pipeline_push(pipeline, NULL);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+void *pipeline_reader(void *private)
+{
+    struct pipeline *pipeline = private;
+    if (setjmp(pipeline->trap.jump))
+    {
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->failed = 1;
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+        return NULL;
+    }
+
+    error_trap_set(&pipeline->trap);
+    pipeline_reader_run(pipeline);
+    error_trap_clear();
+    return NULL;
+}
+
+struct pipeline *pipeline_create(ext2_filsys fs, struct buffer_pool *pool,
+                                 int fd, int direct, int coalesce_distance,
+                                 size_t budget)
+{
+    struct pipeline *pipeline = ecalloc(sizeof(struct pipeline));
+    pipeline->fs = fs;
+    pipeline->pool = pool;
+    pipeline->fd = fd;
+    pipeline->direct = direct;
+    pipeline->coalesce_distance = coalesce_distance;
+    pipeline->budget = budget;
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    if (pthread_create(&pipeline->thread, NULL, pipeline_reader, pipeline))
+        exit_str("Error creating reader thread");
+
+    return pipeline;
+}
+
+void pipeline_destroy(struct pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->shutdown = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pthread_join(pipeline->thread, NULL);
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline);
+}
+
+/*
+ * Called as a stripe's data is freed, to make room for the reader thread.
+ */
+void pipeline_release(struct pipeline *pipeline, size_t len)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->outstanding -= len;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/*
+ * Equivalent of the read loop in dj_read(), except that the reading happens on
+ * the reader thread and this thread only heapifies and delivers.
+ */
+void pipeline_read_blocks(struct pipeline *pipeline, block_cb cb,
+                          int max_inode_blocks, struct block_list *blocks,
+                          size_t count, int *open_inodes_count, int *stop)
+{
+    if (count == 0)
+        return;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->pending = blocks;
+    pipeline->pending_count = count;
+    pipeline->max_inode_blocks = max_inode_blocks;
+    pipeline->stop = stop;
+    pthread_cond_broadcast(&pipeline->cond);
+
+    while (1)
+    {
+        while (pipeline->queue_count == 0 && !pipeline->failed)
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        if (pipeline->queue_count == 0)
+        {
+            pthread_mutex_unlock(&pipeline->lock);
+            error_trap_raise(&pipeline->trap);
+        }
+
+        struct stripe *stripe = pipeline->queue[pipeline->queue_head];
+        pipeline->queue_head = (pipeline->queue_head + 1) % PIPELINE_QUEUE_LEN;
+        pipeline->queue_count--;
+        pthread_cond_broadcast(&pipeline->cond);
+
+        if (stripe == NULL)
+            break;
+
+        pthread_mutex_unlock(&pipeline->lock);
+        heapify_stripe(pipeline->fs, cb, stripe, max_inode_blocks,
+                       open_inodes_count);
+        pthread_mutex_lock(&pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+}
@@ -0,0 +1,16 @@
+#ifndef DJ_PIPELINE_H
+#define DJ_PIPELINE_H
+
+#include "dj_internal.h"
+
+struct pipeline *pipeline_create(ext2_filsys fs, struct buffer_pool *pool,
+                                 int fd, int direct, int coalesce_distance,
+                                 size_t budget);
+void pipeline_destroy(struct pipeline *pipeline);
+void pipeline_release(struct pipeline *pipeline, size_t len);
+
+void pipeline_read_blocks(struct pipeline *pipeline, block_cb cb,
+                          int max_inode_blocks, struct block_list *blocks,
+                          size_t count, int *open_inodes_count, int *stop);
+
+#endif
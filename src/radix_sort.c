@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dj_internal.h"
+#include "radix_sort.h"
+#include "util.h"
+
+/*
+ * LSD radix sort of count keys, a byte at a time. order starts out as the
+ * index of each key's record and comes out as the indexes of the records in
+ * sorted order; keys comes out sorted. Only the keys and indexes move during
+ * the sort, so the records themselves only need moving once, afterwards.
+ *
+ * Bytes that are the same in every key (like the high bytes of block numbers
+ * on anything smaller than a few petabytes) are skipped.
+ */
+void radix_sort(uint64_t *keys, size_t *order, size_t count)
+{
+    if (count < 2)
+        return;
+
+    size_t (*counts)[256] = ecalloc(sizeof(size_t) * 8 * 256);
+    for (size_t i = 0; i < count; i++)
+    {
+        for (int digit = 0; digit < 8; digit++)
+            counts[digit][(keys[i] >> (digit * 8)) & 0xFF]++;
+    }
+
+    uint64_t *keys_tmp = emalloc(sizeof(uint64_t) * count);
+    size_t *order_tmp = emalloc(sizeof(size_t) * count);
+    uint64_t *keys_src = keys, *keys_dst = keys_tmp;
+    size_t *order_src = order, *order_dst = order_tmp;
+
+    for (int digit = 0; digit < 8; digit++)
+    {
+        int shift = digit * 8;
+        if (counts[digit][(keys_src[0] >> shift) & 0xFF] == count)
+            continue;
+
+        size_t offsets[256];
+        size_t offset = 0;
+        for (int byte = 0; byte < 256; byte++)
+        {
+            offsets[byte] = offset;
+            offset += counts[digit][byte];
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t dst = offsets[(keys_src[i] >> shift) & 0xFF]++;
+            keys_dst[dst] = keys_src[i];
+            order_dst[dst] = order_src[i];
+        }
+
+        uint64_t *keys_swap = keys_src;
+        keys_src = keys_dst;
+        keys_dst = keys_swap;
+        size_t *order_swap = order_src;
+        order_src = order_dst;
+        order_dst = order_swap;
+    }
+
+    if (keys_src != keys)
+    {
+        memcpy(keys, keys_src, sizeof(uint64_t) * count);
+        memcpy(order, order_src, sizeof(size_t) * count);
+    }
+
+    free(keys_tmp);
+    free(order_tmp);
+    free(counts);
+}
+
+/*
+ * Sort count inodes on one key each, keeping inodes with equal keys in the
+ * order they were in. The keys are sorted along with them.
+ */
+void sort_inodes_by_keys(struct inode_list *inodes, size_t count,
+                         uint64_t *keys)
+{
+    if (count < 2)
+        return;
+
+    size_t *order = emalloc(sizeof(size_t) * count);
+    for (size_t i = 0; i < count; i++)
+        order[i] = i;
+
+    radix_sort(keys, order, count);
+
+    struct inode_list *sorted = emalloc(sizeof(struct inode_list) * count);
+    for (size_t i = 0; i < count; i++)
+        sorted[i] = inodes[order[i]];
+    memcpy(inodes, sorted, sizeof(struct inode_list) * count);
+
+    free(sorted);
+    free(order);
+}
+
+/*
+ * Sort inodes on their inode numbers. See README.md for why.
+ */
+void sort_inodes(struct inode_vec *inodes)
+{
+    size_t count = inodes->count;
+    if (count < 2)
+        return;
+
+    uint64_t *keys = emalloc(sizeof(uint64_t) * count);
+    for (size_t i = 0; i < count; i++)
+        keys[i] = inodes->inodes[i].index;
+
+    sort_inodes_by_keys(inodes->inodes, count, keys);
+
+    free(keys);
+}
+
+/*
+ * Sort blocks into the order in which they're laid out on disk.
+ */
+void sort_blocks(struct block_list *blocks, size_t count)
+{
+    if (count < 2)
+        return;
+
+    uint64_t *keys = emalloc(sizeof(uint64_t) * count);
+    size_t *order = emalloc(sizeof(size_t) * count);
+    for (size_t i = 0; i < count; i++)
+    {
+        keys[i] = blocks[i].physical_block;
+        order[i] = i;
+    }
+
+    radix_sort(keys, order, count);
+
+    struct block_list *sorted = emalloc(sizeof(struct block_list) * count);
+    for (size_t i = 0; i < count; i++)
+        sorted[i] = blocks[order[i]];
+    memcpy(blocks, sorted, sizeof(struct block_list) * count);
+
+    free(sorted);
+    free(keys);
+    free(order);
+}
@@ -0,0 +1,12 @@
+#ifndef DJ_RADIX_SORT_H
+#define DJ_RADIX_SORT_H
+
+#include "dj_internal.h"
+
+void radix_sort(uint64_t *keys, size_t *order, size_t count);
+void sort_inodes_by_keys(struct inode_list *inodes, size_t count,
+                         uint64_t *keys);
+void sort_inodes(struct inode_vec *inodes);
+void sort_blocks(struct block_list *blocks, size_t count);
+
+#endif
@@ -0,0 +1,88 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "buffer_pool.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "retain.h"
+#include "stripe.h"
+#include "util.h"
+
+/*
+ * A chunk handed to a callback points into its stripe's buffer, which goes back
+ * to the pool as soon as the last of the stripe's blocks has been delivered.
+ * A client that wants to hold on to the data for longer, say until a
+ * compressor or uploader has finished with it, can retain the chunk from
+ * inside the callback instead of copying it: that takes another reference on
+ * the stripe, which keeps the buffer (and, with a pipeline, its share of the
+ * memory budget) until the client releases it, from whatever thread.
+ *
+ * The handle is the stripe itself. Holes are delivered out of the zero page,
+ * which lives as long as the process, so they get a handle that does nothing.
+ */
+
+struct dj_buffer
+{
+    int unused;
+};
+
+static struct dj_buffer hole_buffer;
+
+// the stripe whose data a thread is delivering, or hole_buffer while it's
+// delivering a hole; only set for the length of a callback
+static pthread_key_t delivery_key;
+static pthread_once_t delivery_key_once = PTHREAD_ONCE_INIT;
+
+void create_delivery_key()
+{
+    if (pthread_key_create(&delivery_key, NULL))
+        exit_str("Error creating delivery key");
+}
+
+void begin_delivery(struct stripe *stripe)
+{
+    pthread_once(&delivery_key_once, create_delivery_key);
+    pthread_setspecific(delivery_key,
+                        stripe != NULL ? (void *)stripe : &hole_buffer);
+}
+
+void end_delivery()
+{
+    pthread_setspecific(delivery_key, NULL);
+}
+
+struct dj_buffer *dj_retain(char *data)
+{
+    pthread_once(&delivery_key_once, create_delivery_key);
+    void *delivering = pthread_getspecific(delivery_key);
+    if (delivering == NULL)
+    {
+        // inline files and anything retained after its callback
+        LogDebug("Chunk at %p can't be retained", data);
+        return NULL;
+    }
+    if (delivering == &hole_buffer)
+        return &hole_buffer;
+
+    struct stripe *stripe = delivering;
+    if (data < stripe->data || data >= stripe->data + stripe->data_len)
+    {
+        LogWarn("Chunk at %p isn't the one being delivered", data);
+        return NULL;
+    }
+
+    ref_stripe(stripe);
+    buffer_pool_retain(stripe->pool);
+    return (struct dj_buffer *)stripe;
+}
+
+void dj_release(struct dj_buffer *buffer)
+{
+    if (buffer == NULL || buffer == &hole_buffer)
+        return;
+
+    // the stripe may be freed by the deref
+    struct buffer_pool *pool = ((struct stripe *)buffer)->pool;
+    deref_stripe((struct stripe *)buffer);
+    buffer_pool_unretain(pool);
+}
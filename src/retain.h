@@ -0,0 +1,9 @@
+#ifndef DJ_RETAIN_H
+#define DJ_RETAIN_H
+
+#include "dj_internal.h"
+
+void begin_delivery(struct stripe *stripe);
+void end_delivery();
+
+#endif
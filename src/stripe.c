@@ -1,30 +1,254 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "buffer_pool.h"
+#include "callback_pool.h"
 #include "clog.h"
+#include "consumer.h"
 #include "dj_internal.h"
 #include "heap.h"
+#include "path_arena.h"
+#include "pipeline.h"
+#include "retain.h"
+#include "stripe_uring.h"
 #include "util.h"
 
+// holes are delivered out of a read-only mapping of the zero page, at most this
+// many bytes per callback, so they take no memory however large they are
+#define ZERO_DATA_LEN (1024*1024)
+
+static char *zero_data;
+static pthread_once_t zero_data_once = PTHREAD_ONCE_INIT;
+
+void map_zero_data()
+{
+    zero_data = mmap(NULL, ZERO_DATA_LEN, PROT_READ,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (zero_data == MAP_FAILED)
+        exit_str("Error mapping zero page");
+}
+
+/*
+ * Stripe references can be dropped from any thread once the client's been
+ * able to retain them (see retain.c), so they're counted atomically. Only
+ * next_stripe() counts them plainly, before anyone else can see the stripe.
+ */
+void ref_stripe(struct stripe *stripe)
+{
+    __atomic_add_fetch(&stripe->references, 1, __ATOMIC_RELAXED);
+}
+
 int deref_stripe(struct stripe *stripe)
 {
-    if (--stripe->references == 0)
+    if (__atomic_sub_fetch(&stripe->references, 1, __ATOMIC_ACQ_REL) == 0)
     {
-        free(stripe->data);
+#ifdef DJ_HAVE_URING
+        if (stripe->uring != NULL)
+            uring_release_slot(stripe->uring, stripe->uring_slot);
+        else
+#endif
+        if (stripe->pool != NULL)
+            buffer_pool_put(stripe->pool, stripe->data, stripe->data_len);
+        else
+            free(stripe->data);
+        if (stripe->pipeline != NULL)
+            pipeline_release(stripe->pipeline, stripe->consecutive_len);
         free(stripe);
         return 1;
     }
     return 0;
 }
 
+void free_inode_info(struct inode_cb_info *inode_info)
+{
+    if (inode_info->block_cache != NULL)
+        heap_destroy(inode_info->block_cache);
+    for (size_t i = 0; i < inode_info->links_count; i++)
+        free(inode_info->links[i].path);
+    free(inode_info->links);
+    free(inode_info->path);
+    free(inode_info);
+}
+
+/*
+ * Drop one of an inode's block references, returning 1 if that was the last,
+ * in which case the inode's been read in full. Callbacks still queued up for
+ * it in a callback pool free it once they're done.
+ */
 int deref_inode(struct inode_cb_info *inode_info)
 {
     if (--inode_info->references == 0)
     {
-        if (inode_info->block_cache != NULL)
-            heap_destroy(inode_info->block_cache);
-        free(inode_info->path);
-        free(inode_info);
+        if (inode_info->tasks == 0)
+            free_inode_info(inode_info);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Have the rest of an inode's data dropped rather than delivered, once a
+ * callback has said it doesn't want it. That can happen on a callback pool's
+ * threads at any time, so the flag's set and read atomically; it's only ever
+ * set, so anything that sees it can act on it.
+ */
+void skip_inode(struct inode_cb_info *inode_info)
+{
+    __atomic_store_n(&inode_info->skipped, 1, __ATOMIC_RELAXED);
+}
+
+int inode_skipped(struct inode_cb_info *inode_info)
+{
+    return __atomic_load_n(&inode_info->skipped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Once the read's been asked to stop, skip every inode with blocks among the
+ * given ones, none of which have been planned into stripes yet, so that the
+ * rest of the batch is dropped rather than read. Returns 1 if it has.
+ */
+int skip_if_stopped(int *stop, struct block_list *blocks, size_t count)
+{
+    if (stop == NULL || !__atomic_load_n(stop, __ATOMIC_RELAXED))
+        return 0;
+
+    LogInfo("Dropping the rest of the batch, as the read's been stopped");
+    for (size_t i = 0; i < count; i++)
+        skip_inode(blocks[i].inode_info);
+    return 1;
+}
+
+/*
+ * Hand a run of an inode's data to the client, once under each of its names,
+ * and skip the rest of the file if the callback asks to under any of them.
+ */
+void deliver_data(block_cb cb, struct inode_cb_info *inode_info, uint64_t pos,
+                  char *data, uint64_t data_len, struct stripe *stripe)
+{
+    begin_delivery(stripe);
+    int skip = cb(inode_info->inode, inode_info_path(inode_info), pos,
+                  inode_info->len, data, data_len, &inode_info->cb_private);
+    for (size_t i = 0; i < inode_info->links_count; i++)
+    {
+        skip |= cb(inode_info->inode, inode_info_link_path(inode_info, i), pos,
+                   inode_info->len, data, data_len,
+                   &inode_info->links[i].cb_private);
+    }
+    end_delivery();
+
+    if (skip)
+    {
+        LogDebug("Skipping the rest of inode %d", inode_info->inode);
+        skip_inode(inode_info);
+    }
+}
+
+/*
+ * Deliver a run of an inode's data now, or queue it up on a callback thread or
+ * in a v2 read's batch.
+ */
+void hand_over_data(block_cb cb, struct inode_cb_info *inode_info,
+                    uint64_t pos, char *data, uint64_t data_len,
+                    struct stripe *stripe)
+{
+    if (inode_info->batch != NULL)
+    {
+        chunk_batch_add(inode_info->batch, inode_info, pos, data, data_len,
+                        stripe);
+    }
+    else if (inode_info->callbacks != NULL)
+    {
+        callback_pool_submit(inode_info->callbacks, cb, inode_info, pos, data,
+                             data_len, stripe);
+    }
+    else
+        deliver_data(cb, inode_info, pos, data, data_len, stripe);
+}
+
+/*
+ * Let go of a block without delivering it. Returns 1 if that was the last of
+ * the inode's blocks.
+ */
+int drop_block(struct block_list *block, int *open_inodes_count)
+{
+    if (block->stripe_ptr.stripe != NULL)
+        deref_stripe(block->stripe_ptr.stripe);
+
+    if (deref_inode(block->inode_info))
+    {
+        (*open_inodes_count)--;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Let go of every block waiting in a skipped inode's heap.
+ */
+void drop_inode_heap(struct inode_cb_info *inode_info, int *open_inodes_count)
+{
+    while (inode_info->block_cache != NULL
+           && heap_size(inode_info->block_cache) > 0)
+    {
+        struct block_list *block = heap_min(inode_info->block_cache);
+        heap_delmin(inode_info->block_cache);
+        // the last block frees the inode, heap and all
+        if (drop_block(block, open_inodes_count))
+            break;
+    }
+}
+
+/*
+ * Send one run of blocks to the client, out of its stripe or the zero page,
+ * and drop the references it held. Returns 1 if that was the last of the
+ * inode's blocks.
+ */
+int deliver_block(uint64_t block_size, struct block_list *block, block_cb cb,
+                  int *open_inodes_count)
+{
+    struct inode_cb_info *inode_info = block->inode_info;
+    if (inode_info->references <= 0)
+    {
+        exit_str("inode %d has %d references\n", inode_info->inode,
+                 inode_info->references);
+    }
+
+    uint64_t logical_pos = block->logical_block * block_size;
+    struct stripe *stripe = block->stripe_ptr.stripe;
+    if (stripe != NULL)
+    {
+        char *block_data = stripe->data + block->stripe_ptr.pos;
+        hand_over_data(cb, inode_info, logical_pos, block_data,
+                       block->stripe_ptr.len, stripe);
+    }
+    else
+    {
+        // a hole
+        pthread_once(&zero_data_once, map_zero_data);
+        for (uint64_t hole_pos = 0; hole_pos < block->stripe_ptr.len
+                                    && !inode_skipped(inode_info);
+             hole_pos += ZERO_DATA_LEN)
+        {
+            uint64_t remaining_len = block->stripe_ptr.len - hole_pos;
+            hand_over_data(cb, inode_info, logical_pos + hole_pos,
+                           zero_data,
+                           remaining_len < ZERO_DATA_LEN
+                           ? remaining_len : ZERO_DATA_LEN, NULL);
+        }
+    }
+
+    inode_info->blocks_read += block->num_blocks;
+
+    if (stripe != NULL)
+        deref_stripe(stripe);
+
+    if (deref_inode(inode_info))
+    {
+        (*open_inodes_count)--;
         return 1;
     }
     return 0;
@@ -46,57 +270,57 @@ void flush_inode_blocks(uint64_t block_size, struct inode_cb_info *inode_info,
         else
             break;
 
-        if (inode_info->references <= 0)
-        {
-            exit_str("inode %d has %d references\n", inode_info->path,
-                     inode_info->references);
-        }
-
-        uint64_t logical_pos = next_block->logical_block * block_size;
-        char *block_data =
-            next_block->stripe_ptr.stripe->data + next_block->stripe_ptr.pos;
-        cb(inode_info->inode, inode_info->path, logical_pos, inode_info->len,
-           block_data, next_block->stripe_ptr.len, &inode_info->cb_private);
-
-        inode_info->blocks_read += next_block->num_blocks;
-
-        deref_stripe(next_block->stripe_ptr.stripe);
-
-        free(next_block);
+        if (deliver_block(block_size, next_block, cb, open_inodes_count))
+            break;
 
-        if (deref_inode(inode_info))
+        if (inode_skipped(inode_info))
         {
-            (*open_inodes_count)--;
+            drop_inode_heap(inode_info, open_inodes_count);
             break;
         }
     }
 }
 
 /*
- * Read ahead of the current block (block_list) to determine the longest stripe
- * we can read all in one go that satisfies the following conditions:
+ * Read ahead of the current block (the first of the count in blocks) to
+ * determine the longest stripe we can read all in one go that satisfies the
+ * following conditions:
  *   1) The number of cached blocks in the heap of the inode of any block in the
  *      stripe is not greater than max_inode_blocks.
  *   2) The physical distance between any two blocks in the stripe that we care
  *      about (i.e., the ones that will be passed to the callback) is not
  *      greater than coalesce_distance.
+ *   3) The stripe is no longer than max_len bytes, unless its first run of
+ *      blocks is longer than that on its own.
+ * Blocks of skipped inodes are left out of the read (though not out of the
+ * stripe's blocks, so that heapify_stripe() drops them), and if that leaves
+ * nothing, consecutive_blocks is 0 and the stripe needn't be read at all.
  */
 struct stripe *next_stripe(uint64_t block_size, int coalesce_distance,
-                           int max_inode_blocks, struct block_list *block_list)
+                           int max_inode_blocks, size_t max_len,
+                           struct block_list *blocks, size_t count)
 {
     struct stripe *stripe = ecalloc(sizeof(struct stripe));
+    struct block_list *block_list = blocks;
 
-    // we use this pointer to read ahead of the current block without losing our
-    // place in the overall iteration
-    struct block_list *fwd_block_list = block_list;
-
-    // and this awfully-named number tracks the previous value of
-    // fwd_block_list, in order to track how far we're jumping over blocks we
-    // don't care about, so as not to exceed coalesce_distance
+    // this awfully-named pointer tracks the previous block, in order to track
+    // how far we're jumping over blocks we don't care about, so as not to
+    // exceed coalesce_distance
     struct block_list *prev_fwd_block = NULL;
 
-    while (fwd_block_list != NULL)
+    stripe->first_block = block_list;
+
+    for (size_t i = 0; i < count; i++)
     {
+        struct block_list *fwd_block_list = &blocks[i];
+
+        if (inode_skipped(fwd_block_list->inode_info))
+        {
+            fwd_block_list->stripe_ptr.stripe = NULL;
+            stripe->blocks_count++;
+            continue;
+        }
+
         // check condition (1)
         /*e2_blkcnt_t max_logical_block =
             fwd_block_list->inode_info->blocks_read + max_inode_blocks - 1;
@@ -110,80 +334,159 @@ struct stripe *next_stripe(uint64_t block_size, int coalesce_distance,
         if (physical_block_diff > coalesce_distance)
             break;
 
+        // a sweep that has wrapped back around to the start of the disk
+        if (physical_block_diff < 0)
+            break;
+
+        // check condition (3)
+        if (prev_fwd_block != NULL
+            && stripe->consecutive_len + (physical_block_diff
+                + fwd_block_list->num_blocks) * block_size > max_len)
+        {
+            break;
+        }
+
+        // the stripe starts at the first block that's wanted
+        if (prev_fwd_block == NULL)
+            stripe->physical_block = fwd_block_list->physical_block;
+
         stripe->consecutive_blocks += fwd_block_list->num_blocks;
+        stripe->blocks_count++;
 
         fwd_block_list->stripe_ptr.stripe = stripe;
         stripe->references++;
 
         // set the block's start point relative to the stripe
         blk64_t physical_block_offset =
-            fwd_block_list->physical_block - block_list->physical_block;
+            fwd_block_list->physical_block - stripe->physical_block;
         fwd_block_list->stripe_ptr.pos = physical_block_offset * block_size;
 
         stripe->consecutive_len += fwd_block_list->num_blocks * block_size; // actual block length
         stripe->consecutive_len += physical_block_diff * block_size; // gap between blocks
 
         prev_fwd_block = fwd_block_list;
-        fwd_block_list = fwd_block_list->next;
     }
 
     return stripe;
 }
 
 /*
- * Read data from device into stripe.
+ * Read data from device into stripe. Stripes never contain holes, so there's
+ * always something to read. Short and interrupted reads are carried on with,
+ * and errors are fatal, as anything delivered after one would be garbage.
  */
-void read_stripe_data(off_t block_size, blk64_t physical_block, int direct,
-                      int fd, struct stripe *stripe)
+void read_stripe_data(struct buffer_pool *pool, off_t block_size,
+                      blk64_t physical_block, int direct, int fd,
+                      struct stripe *stripe)
 {
-    if (physical_block != 0)
-    {
-        // If opened with O_DIRECT, the device needs to be read in multiples of
-        // 512 bytes into a buffer that is 512-byte aligned. Only the latter is
-        // documented; the former is documented as being undocumented.
-        size_t physical_read_len = direct
-            ? ((stripe->consecutive_len+511)/512)*512
-            : stripe->consecutive_len;
+    // If opened with O_DIRECT, the device needs to be read in multiples of
+    // 512 bytes into a buffer that is 512-byte aligned. Only the latter is
+    // documented; the former is documented as being undocumented.
+    size_t physical_read_len = direct
+        ? ((stripe->consecutive_len+511)/512)*512
+        : stripe->consecutive_len;
 
-        if (posix_memalign((void **)&stripe->data, 512, physical_read_len))
-            perror("Error allocating aligned memory");
+    stripe->pool = pool;
+    stripe->data_len = physical_read_len;
+    stripe->data = buffer_pool_get(pool, physical_read_len);
+
+    size_t done = 0;
+    while (done < stripe->consecutive_len)
+    {
+        ssize_t read_len = pread(fd, stripe->data + done,
+                                 physical_read_len - done,
+                                 physical_block * block_size + done);
+        if (read_len < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (read_len < 0)
+            exit_str("Error reading from block device: %s", strerror(errno));
+        if (read_len == 0)
+            exit_str("Unexpected end of block device at block %llu",
+                     (unsigned long long)physical_block);
 
-        ssize_t read_len = pread(fd, stripe->data, physical_read_len,
-                                 physical_block * block_size);
-        if (read_len < stripe->consecutive_len)
-            perror("Error reading from block device");
+        done += read_len;
+        if (done < stripe->consecutive_len)
+        {
+            LogDebug("Short read from block device; reading the remaining %lu "
+                     "bytes", stripe->consecutive_len - done);
+        }
     }
-    else
-        stripe->data = ecalloc(stripe->consecutive_len);
 }
 
 /*
- * For each block in the stripe, insert the block into its inode's heap. Then
- * flush that heap out to the client, if possible.
+ * Insert a block into its inode's heap, then flush that heap out to the
+ * client, if possible. Inodes read in physical order skip the heap and have
+ * each block sent as soon as it's read, and skipped inodes have their blocks
+ * dropped, along with any in the heap.
  */
-struct block_list *heapify_stripe(ext2_filsys fs, block_cb cb,
-                                  struct block_list *block_list,
-                                  struct stripe *stripe, int max_inode_blocks,
-                                  int *open_inodes_count)
+void heapify_block(ext2_filsys fs, block_cb cb, struct block_list *block,
+                   int *open_inodes_count)
 {
-    e2_blkcnt_t consecutive_blocks = stripe->consecutive_blocks; // stripe can be freed during iteration, so save the number of blocks here
-    for (e2_blkcnt_t read_blocks = 0; read_blocks < consecutive_blocks;)
+    struct inode_cb_info *inode_info = block->inode_info;
+    if (inode_skipped(inode_info))
     {
-        struct inode_cb_info *inode_info = block_list->inode_info;
-        if (inode_info->block_cache == NULL)
-            inode_info->block_cache = heap_create(inode_info->len/fs->blocksize+1 /*max_inode_blocks*/); // +1 so that it's never 0
+        if (!drop_block(block, open_inodes_count))
+            drop_inode_heap(inode_info, open_inodes_count);
+        return;
+    }
 
-        LogTrace("Heapifying physical block %lu, logical block %lu (num blocks %lu) of inode %d", block_list->physical_block, block_list->logical_block, block_list->num_blocks, inode_info->inode);
-        heap_insert(inode_info->block_cache, block_list->logical_block,
-                    block_list);
+    if (inode_info->physical_order)
+    {
+        deliver_block(fs->blocksize, block, cb, open_inodes_count);
+        return;
+    }
+
+    if (inode_info->block_cache == NULL)
+        inode_info->block_cache = heap_create(inode_info->len/fs->blocksize+1 /*max_inode_blocks*/); // +1 so that it's never 0
+
+    LogTrace("Heapifying physical block %lu, logical block %lu (num blocks %lu) of inode %d", block->physical_block, block->logical_block, block->num_blocks, inode_info->inode);
+    heap_insert(inode_info->block_cache, block->logical_block, block);
+
+    flush_inode_blocks(fs->blocksize, inode_info, cb, open_inodes_count);
+}
+
+/*
+ * For each block in the stripe, insert the block into its inode's heap and
+ * flush what we can. Blocks that next_stripe() left out, since their inodes
+ * were skipped, are dropped by heapify_block() along with whatever's left in
+ * their inodes' heaps, and a stripe with nothing to read is freed here.
+ */
+void heapify_stripe(ext2_filsys fs, block_cb cb, struct stripe *stripe,
+                    int max_inode_blocks, int *open_inodes_count)
+{
+    // the stripe can be freed during iteration, so save its blocks here, and
+    // the batch that whatever it completes goes out in, if any
+    struct block_list *blocks = stripe->first_block;
+    size_t count = stripe->blocks_count;
+    struct chunk_batch *batch = blocks[0].inode_info->batch;
+    int empty = stripe->consecutive_blocks == 0;
+    for (size_t i = 0; i < count; i++)
+        heapify_block(fs, cb, &blocks[i], open_inodes_count);
+    if (empty)
+        free(stripe);
 
-        read_blocks += block_list->num_blocks;
+    if (batch != NULL)
+        chunk_batch_flush(batch);
+}
 
-        // block_list could be freed if it's the heap minimum, so iterate to the
-        // next block before flushing cached blocks
-        block_list = block_list->next;
-        flush_inode_blocks(fs->blocksize, inode_info, cb, open_inodes_count);
+/*
+ * Holes sort to the front of a batch's block array, since their physical block
+ * is 0. Hand them all to their inodes' heaps without a stripe, and return how
+ * many there were, which is the index of the first block that actually needs
+ * reading.
+ */
+size_t heapify_holes(ext2_filsys fs, block_cb cb, struct block_list *blocks,
+                     size_t count, int *open_inodes_count)
+{
+    struct chunk_batch *batch = count > 0 ? blocks[0].inode_info->batch : NULL;
+    size_t i;
+    for (i = 0; i < count && blocks[i].physical_block == 0; i++)
+    {
+        blocks[i].stripe_ptr.stripe = NULL;
+        heapify_block(fs, cb, &blocks[i], open_inodes_count);
     }
 
-    return block_list;
+    if (batch != NULL)
+        chunk_batch_flush(batch);
+    return i;
 }
\ No newline at end of file
@@ -3,15 +3,30 @@
 
 #include "dj_internal.h"
 
+void ref_stripe(struct stripe *stripe);
+int deref_stripe(struct stripe *stripe);
+void free_inode_info(struct inode_cb_info *inode_info);
+int deref_inode(struct inode_cb_info *inode_info);
+
+void skip_inode(struct inode_cb_info *inode_info);
+int inode_skipped(struct inode_cb_info *inode_info);
+int skip_if_stopped(int *stop, struct block_list *blocks, size_t count);
+
+void deliver_data(block_cb cb, struct inode_cb_info *inode_info, uint64_t pos,
+                  char *data, uint64_t data_len, struct stripe *stripe);
+
 struct stripe *next_stripe(uint64_t block_size, int coalesce_distance,
-                           int max_inode_blocks, struct block_list *block_list);
+                           int max_inode_blocks, size_t max_len,
+                           struct block_list *blocks, size_t count);
+
+void read_stripe_data(struct buffer_pool *pool, off_t block_size,
+                      blk64_t physical_block, int direct, int fd,
+                      struct stripe *stripe);
 
-void read_stripe_data(off_t block_size, blk64_t physical_block, int direct,
-                      int fd, struct stripe *stripe);
+void heapify_stripe(ext2_filsys fs, block_cb cb, struct stripe *stripe,
+                    int max_inode_blocks, int *open_inodes_count);
 
-struct block_list *heapify_stripe(ext2_filsys fs, block_cb cb,
-                                  struct block_list *block_list,
-                                  struct stripe *stripe, int max_inode_blocks,
-                                  int *open_inodes_count);
+size_t heapify_holes(ext2_filsys fs, block_cb cb, struct block_list *blocks,
+                     size_t count, int *open_inodes_count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "buffer_pool.h"
+#include "clog.h"
+#include "dj_internal.h"
+#include "stripe.h"
+#include "stripe_uring.h"
+#include "util.h"
+
+// size of each registered buffer; stripes longer than this are read into
+// ordinary buffers instead
+#define URING_SLOT_LEN (1024*1024)
+
+struct uring_reader
+{
+    struct io_uring ring;
+    int queue_depth;
+    int direct;
+    off_t block_size;
+    struct buffer_pool *pool;
+
+    // the block device, or its index in the registered file table
+    int fd;
+    int fixed_file;
+
+    // registered buffers; a slot stays taken until the stripe reading into
+    // it has been fully delivered, not just until the read completes
+    int fixed_buffers;
+    int slots_count;
+    char *slot_data;
+    int *free_slots;
+    int free_slots_count;
+    pthread_mutex_t slots_lock;
+};
+
+/*
+ * Set up a ring of queue_depth entries. Registered buffers are pinned for as
+ * long as the reader lives, so no more of them are registered than fit in
+ * budget bytes, which may be none.
+ */
+struct uring_reader *uring_reader_create(struct buffer_pool *pool, int fd,
+                                         int queue_depth, int direct,
+                                         off_t block_size, size_t budget)
+{
+    struct uring_reader *reader = ecalloc(sizeof(struct uring_reader));
+    reader->pool = pool;
+    reader->queue_depth = queue_depth;
+    reader->direct = direct;
+    reader->block_size = block_size;
+    reader->fd = fd;
+    pthread_mutex_init(&reader->slots_lock, NULL);
+
+    int ret = io_uring_queue_init(queue_depth, &reader->ring, 0);
+    if (ret < 0)
+    {
+        LogWarn("Unable to set up io_uring (%s); falling back to pread",
+                strerror(-ret));
+        pthread_mutex_destroy(&reader->slots_lock);
+        free(reader);
+        return NULL;
+    }
+
+    if ((ret = io_uring_register_files(&reader->ring, &fd, 1)) == 0)
+    {
+        reader->fd = 0;
+        reader->fixed_file = 1;
+    }
+    else
+        LogWarn("Unable to register block device with io_uring: %s", strerror(-ret));
+
+    int slots_count = budget / URING_SLOT_LEN < (size_t)queue_depth
+        ? budget / URING_SLOT_LEN : queue_depth;
+    reader->free_slots = emalloc(sizeof(int) * queue_depth);
+    if (slots_count > 0)
+    {
+        if (posix_memalign((void **)&reader->slot_data, 4096,
+                           (size_t)slots_count * URING_SLOT_LEN))
+            exit_str("Error allocating %d io_uring buffers", slots_count);
+
+        struct iovec iovecs[slots_count];
+        for (int i = 0; i < slots_count; i++)
+        {
+            iovecs[i].iov_base = reader->slot_data + (size_t)i * URING_SLOT_LEN;
+            iovecs[i].iov_len = URING_SLOT_LEN;
+            reader->free_slots[i] = i;
+        }
+
+        // registering pins the memory, which RLIMIT_MEMLOCK may not allow
+        if ((ret = io_uring_register_buffers(&reader->ring, iovecs,
+                                             slots_count)) == 0)
+        {
+            reader->fixed_buffers = 1;
+            reader->slots_count = slots_count;
+            reader->free_slots_count = slots_count;
+        }
+        else
+        {
+            LogWarn("Unable to register io_uring buffers: %s", strerror(-ret));
+            free(reader->slot_data);
+            reader->slot_data = NULL;
+        }
+    }
+
+    LogInfo("Reading with io_uring at queue depth %d (fixed file %d, %d fixed "
+            "buffers)", queue_depth, reader->fixed_file, reader->slots_count);
+
+    return reader;
+}
+
+void uring_reader_destroy(struct uring_reader *reader)
+{
+    io_uring_queue_exit(&reader->ring);
+    free(reader->slot_data);
+    free(reader->free_slots);
+    pthread_mutex_destroy(&reader->slots_lock);
+    free(reader);
+}
+
+void uring_release_slot(struct uring_reader *reader, int slot)
+{
+    pthread_mutex_lock(&reader->slots_lock);
+    reader->free_slots[reader->free_slots_count++] = slot;
+    pthread_mutex_unlock(&reader->slots_lock);
+}
+
+// see read_stripe_data() for why O_DIRECT reads are rounded up
+size_t uring_read_len(struct uring_reader *reader, struct stripe *stripe)
+{
+    return reader->direct
+        ? ((stripe->consecutive_len+511)/512)*512
+        : stripe->consecutive_len;
+}
+
+/*
+ * Queue a read of whatever of the stripe's data hasn't been read yet.
+ */
+void uring_queue_read(struct uring_reader *reader, struct stripe *stripe)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&reader->ring);
+    if (sqe == NULL)
+        exit_str("io_uring submission queue is full");
+
+    size_t done = stripe->uring_done;
+    size_t len = uring_read_len(reader, stripe) - done;
+    off_t offset = stripe->physical_block * reader->block_size + done;
+
+    if (stripe->uring != NULL)
+    {
+        io_uring_prep_read_fixed(sqe, reader->fd, stripe->data + done, len,
+                                 offset, stripe->uring_slot);
+    }
+    else
+        io_uring_prep_read(sqe, reader->fd, stripe->data + done, len, offset);
+
+    if (reader->fixed_file)
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    io_uring_sqe_set_data(sqe, stripe);
+}
+
+/*
+ * Queue a read of the stripe's data, into a registered buffer if one is free
+ * and big enough.
+ */
+void uring_submit_stripe(struct uring_reader *reader, struct stripe *stripe)
+{
+    size_t physical_read_len = uring_read_len(reader, stripe);
+
+    // slots can be given back from whichever thread releases a retained
+    // stripe last
+    stripe->pool = reader->pool;
+    stripe->data_len = physical_read_len;
+    stripe->uring_done = 0;
+    pthread_mutex_lock(&reader->slots_lock);
+    int slot = reader->free_slots_count > 0
+               && physical_read_len <= URING_SLOT_LEN
+        ? reader->free_slots[--reader->free_slots_count] : -1;
+    pthread_mutex_unlock(&reader->slots_lock);
+
+    if (slot >= 0)
+    {
+        stripe->uring = reader;
+        stripe->uring_slot = slot;
+        stripe->data = reader->slot_data + (size_t)slot * URING_SLOT_LEN;
+    }
+    else
+        stripe->data = buffer_pool_get(reader->pool, physical_read_len);
+
+    uring_queue_read(reader, stripe);
+}
+
+/*
+ * Account for a completed read of the stripe. Returns 1 once all of it has
+ * been read, or 0 if the rest of it has been queued up again after a short
+ * or interrupted read. Errors are fatal, as anything delivered after one
+ * would be garbage.
+ */
+int uring_complete_read(struct uring_reader *reader, struct stripe *stripe,
+                        int res)
+{
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        uring_queue_read(reader, stripe);
+        return 0;
+    }
+    if (res < 0)
+        exit_str("Error reading from block device: %s", strerror(-res));
+    if (res == 0 && stripe->uring_done < stripe->consecutive_len)
+        exit_str("Unexpected end of block device at block %llu",
+                 (unsigned long long)stripe->physical_block);
+
+    stripe->uring_done += res;
+    if (stripe->uring_done < stripe->consecutive_len)
+    {
+        LogDebug("Short read from block device; reading the remaining %lu "
+                 "bytes", stripe->consecutive_len - stripe->uring_done);
+        uring_queue_read(reader, stripe);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Equivalent of the read loop in dj_read(), except that up to queue_depth
+ * stripes are read at once. Stripes are heapified in the order their reads
+ * complete, which is fine since each inode's heap puts its blocks back into
+ * logical order anyway.
+ */
+void uring_read_blocks(struct uring_reader *reader, ext2_filsys fs,
+                       block_cb cb, int coalesce_distance, int max_inode_blocks,
+                       struct block_list *blocks, size_t count,
+                       int *open_inodes_count, int *stop)
+{
+    int in_flight = 0;
+    size_t pos = 0;
+    int stopped = 0;
+
+    while (pos < count || in_flight > 0)
+    {
+        // top up the queue
+        while (pos < count && in_flight < reader->queue_depth)
+        {
+            if (!stopped)
+                stopped = skip_if_stopped(stop, &blocks[pos], count - pos);
+
+            struct stripe *stripe = next_stripe(fs->blocksize,
+                                                coalesce_distance,
+                                                max_inode_blocks, SIZE_MAX,
+                                                &blocks[pos], count - pos);
+
+            LogDebug("Found stripe of %lu blocks", stripe->consecutive_blocks);
+            pos += stripe->blocks_count;
+
+            // nothing to read if every block in it has been skipped
+            if (stripe->consecutive_blocks == 0)
+            {
+                heapify_stripe(fs, cb, stripe, max_inode_blocks,
+                               open_inodes_count);
+                continue;
+            }
+
+            uring_submit_stripe(reader, stripe);
+            in_flight++;
+        }
+
+        if (in_flight == 0)
+            continue;
+
+        int ret = io_uring_submit(&reader->ring);
+        if (ret < 0)
+            exit_str("Error submitting io_uring reads: %s", strerror(-ret));
+
+        struct io_uring_cqe *cqe;
+        if ((ret = io_uring_wait_cqe(&reader->ring, &cqe)) < 0)
+            exit_str("Error waiting for io_uring reads: %s", strerror(-ret));
+
+        // reap everything that's finished, not just the first
+        do
+        {
+            struct stripe *stripe = io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&reader->ring, cqe);
+
+            // a resubmitted remainder stays in flight
+            if (!uring_complete_read(reader, stripe, res))
+                continue;
+            in_flight--;
+
+            heapify_stripe(fs, cb, stripe, max_inode_blocks,
+                           open_inodes_count);
+        } while (io_uring_peek_cqe(&reader->ring, &cqe) == 0);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef DJ_STRIPE_URING_H
+#define DJ_STRIPE_URING_H
+
+#include "dj_internal.h"
+
+#ifdef DJ_HAVE_URING
+
+struct uring_reader *uring_reader_create(struct buffer_pool *pool, int fd,
+                                         int queue_depth, int direct,
+                                         off_t block_size, size_t budget);
+void uring_reader_destroy(struct uring_reader *reader);
+void uring_release_slot(struct uring_reader *reader, int slot);
+
+void uring_read_blocks(struct uring_reader *reader, ext2_filsys fs,
+                       block_cb cb, int coalesce_distance, int max_inode_blocks,
+                       struct block_list *blocks, size_t count,
+                       int *open_inodes_count, int *stop);
+
+#endif
+
+#endif
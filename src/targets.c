@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_read.h"
+#include "block_index.h"
+#include "clog.h"
+#include "dir_bfs.h"
+#include "dir_scan.h"
+#include "dj_internal.h"
+#include "inode_scan.h"
+#include "path_arena.h"
+#include "targets.h"
+#include "util.h"
+#include "vec.h"
+
+/*
+ * A read can start from any number of targets, each a path or "inode:N" for
+ * the inode numbered N. Each one is discovered on its own, just as a lone
+ * target would be, and the lists are joined up with a root in the path arena
+ * per target, so that all of their files go into one plan and the disk is
+ * only swept once. A file found under more than one target is read once, and
+ * delivered once per distinct path; see inode_vec_merge_links().
+ */
+
+#define INODE_TARGET_PREFIX "inode:"
+
+void get_path_inode_list(struct batch_reader *reader, char *dev_path,
+                         char *target_path, struct dj_options *opts,
+                         struct inode_vec *inodes)
+{
+    ext2_filsys fs = reader->fs;
+    if (opts->flags & ITERATE_OPT_INODE_SCAN)
+    {
+        if (opts->flags & ITERATE_OPT_DIR_BFS)
+            LogWarn("Finding files with an inode scan rather than a BFS walk");
+        get_inode_list_linear(fs, target_path, opts->filter, inodes);
+    }
+    else if (opts->flags & ITERATE_OPT_DIR_BFS)
+    {
+        // the walk reads through the batch reader, which is one thread's
+        if (opts->scan_threads > 1)
+            LogInfo("Walking directories on one thread; scan_threads only "
+                    "maps blocks");
+        get_inode_list_bfs(reader, target_path, opts->filter, inodes);
+    }
+    else if (opts->scan_threads > 1)
+    {
+        get_inode_list_parallel(dev_path, fs, target_path, opts->scan_threads,
+                                opts->filter, inodes);
+    }
+    else
+        get_inode_list(fs, target_path, opts->filter, inodes);
+}
+
+/*
+ * Directories given by number are walked from their paths, which libext2fs
+ * can work out from their .. entries. Files have no way back to a name, so
+ * they're named after the target; like any file asked for directly, the filter
+ * doesn't get a say.
+ */
+void get_ino_inode_list(struct batch_reader *reader, char *dev_path,
+                        char *target, struct dj_options *opts,
+                        struct inode_vec *inodes)
+{
+    ext2_filsys fs = reader->fs;
+
+    char *end;
+    unsigned long ino = strtoul(&target[strlen(INODE_TARGET_PREFIX)], &end, 10);
+    if (*end != '\0' || ino < EXT2_ROOT_INO
+        || ino > fs->super->s_inodes_count)
+    {
+        exit_str("Bad inode number in target %s", target);
+    }
+
+    struct ext2_inode_large inode_contents;
+    block_index_read_inode(fs, ino, &inode_contents);
+
+    if (LINUX_S_ISDIR(inode_contents.i_mode))
+    {
+        char *path;
+        CHECK_FATAL(ext2fs_get_pathname(fs, ino, 0, &path),
+                "while looking up path of inode %lu", ino);
+        LogInfo("Inode %lu is directory %s", ino, path);
+        get_path_inode_list(reader, dev_path, path, opts, inodes);
+        ext2fs_free_mem(&path);
+    }
+    else if (!LINUX_S_ISLNK(inode_contents.i_mode))
+    {
+        // an empty root, so that the path is the target alone
+        path_arena_init(&inodes->paths, "");
+        struct inode_list *list = inode_vec_append(inodes);
+        list->index = ino;
+        list->len = EXT2_I_SIZE(&inode_contents);
+        block_index_stamp(fs, &inode_contents, list);
+        list->name = path_arena_add_name(&inodes->paths, target);
+
+        LogDebug("Added start file %s", target);
+    }
+    else
+        exit_str("Unexpected file mode %x", inode_contents.i_mode);
+}
+
+void get_inode_list_targets(struct batch_reader *reader, char *dev_path,
+                            char **targets, int targets_count,
+                            struct dj_options *opts, struct inode_vec *inodes)
+{
+    for (int i = 0; i < targets_count; i++)
+    {
+        struct inode_vec target_inodes;
+        memset(&target_inodes, 0, sizeof(target_inodes));
+
+        if (!strncmp(targets[i], INODE_TARGET_PREFIX,
+                     strlen(INODE_TARGET_PREFIX)))
+        {
+            get_ino_inode_list(reader, dev_path, targets[i], opts,
+                               &target_inodes);
+        }
+        else
+        {
+            get_path_inode_list(reader, dev_path, targets[i], opts,
+                                &target_inodes);
+        }
+
+        if (i == 0)
+        {
+            *inodes = target_inodes;
+            continue;
+        }
+
+        struct path_arena *paths = &target_inodes.paths;
+        uint32_t root = path_arena_add_root(&inodes->paths,
+                                            &paths->names[paths->dirs[0].name]);
+        inode_vec_concat(inodes, &target_inodes, root);
+    }
+
+    if (targets_count > 1)
+    {
+        LogInfo("Found %lu files under %d targets", inodes->count,
+                targets_count);
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef DJ_TARGETS_H
+#define DJ_TARGETS_H
+
+#include "batch_read.h"
+#include "dj_internal.h"
+
+void get_inode_list_targets(struct batch_reader *reader, char *dev_path,
+                            char **targets, int targets_count,
+                            struct dj_options *opts, struct inode_vec *inodes);
+
+#endif
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -5,21 +6,95 @@
 
 char *prog_name;
 
+// the error trap of each thread that has one
+static pthread_key_t trap_key;
+static pthread_once_t trap_key_once = PTHREAD_ONCE_INIT;
+
+void create_trap_key()
+{
+    // can't fail through exit_str(), which needs the key
+    if (pthread_key_create(&trap_key, NULL))
+    {
+        fprintf(stderr, "Error creating error trap key\n");
+        exit(1);
+    }
+}
+
+void error_trap_set(struct error_trap *trap)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    pthread_setspecific(trap_key, trap);
+}
+
+void error_trap_clear()
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    pthread_setspecific(trap_key, NULL);
+}
+
+/*
+ * Fail again with an error a worker thread's trap caught, so that it ends up
+ * wherever the calling thread's errors go: its own trap, or stderr and exit.
+ */
+void error_trap_raise(struct error_trap *trap)
+{
+    exit_str("%s", trap->message);
+}
+
+/*
+ * Report a fatal error, with the error code's message if it isn't 0, into the
+ * thread's error trap if it has one, or else on stderr before exiting.
+ */
+void fail_va(errcode_t err, char *message, va_list args)
+{
+    pthread_once(&trap_key_once, create_trap_key);
+    struct error_trap *trap = pthread_getspecific(trap_key);
+    if (trap != NULL)
+    {
+        int len = vsnprintf(trap->message, sizeof(trap->message), message,
+                            args);
+        if (err != 0 && len >= 0 && len < sizeof(trap->message))
+        {
+            snprintf(&trap->message[len], sizeof(trap->message) - len, ": %s",
+                     error_message(err));
+        }
+
+        // anything that goes wrong while the read's torn down just exits
+        pthread_setspecific(trap_key, NULL);
+        longjmp(trap->jump, 1);
+    }
+
+    if (err != 0)
+        com_err_va(prog_name, err, message, args);
+    else
+    {
+        vfprintf(stderr, message, args);
+        fprintf(stderr, "\n");
+    }
+    exit(1);
+}
+
+void fail_err(errcode_t err, char *message, ...)
+{
+    va_list args;
+    va_start(args, message);
+    fail_va(err, message, args);
+    va_end(args);
+}
+
 void exit_str(char *message, ...)
 {
     va_list args;
-    va_start(args,  message);
-    fprintf(stderr, message, args);
-    fprintf(stderr, "\n");
+    va_start(args, message);
+    fail_va(0, message, args);
     va_end(args);
-    exit(1);
 }
 
 void *emalloc(size_t size)
 {
     void *ptr = malloc(size);
     if (ptr == NULL)
-        exit_str("Error allocating %d bytes of memory", size);
+        exit_str("Error allocating %lu bytes of memory", size);
     return ptr;
 }
 
@@ -27,6 +102,14 @@ void *ecalloc(size_t size)
 {
     void *ptr = calloc(1, size);
     if (ptr == NULL)
-        exit_str("Error allocating %d bytes of memory", size);
+        exit_str("Error allocating %lu bytes of memory", size);
     return ptr;
-}
\ No newline at end of file
+}
+
+void *erealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL)
+        exit_str("Error allocating %lu bytes of memory", size);
+    return ptr;
+}
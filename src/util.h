@@ -2,6 +2,8 @@
 #define DJ_UTIL_H
 
 #include <et/com_err.h>
+#include <setjmp.h>
+#include <stdarg.h>
 
 #define CHECK_WARN(FUNC, MSG, ...) \
 { \
@@ -24,16 +26,29 @@
 { \
     errcode_t err = FUNC; \
     if (err != 0) \
-    { \
-        com_err(prog_name, err, MSG, ##__VA_ARGS__); \
-        exit(1); \
-    } \
+        fail_err(err, MSG, ##__VA_ARGS__); \
 }
 
+/*
+ * Where fatal errors on a thread go instead of exiting the process, if it's
+ * been given one with error_trap_set(): the message is left in the trap, and
+ * the thread jumps back to wherever setjmp() was called on it.
+ */
+struct error_trap
+{
+    jmp_buf jump;
+    char message[256];
+};
+
 extern char *prog_name;
 
+void error_trap_set(struct error_trap *trap);
+void error_trap_clear();
+void error_trap_raise(struct error_trap *trap);
+void fail_err(errcode_t err, char *message, ...);
 void exit_str(char *message, ...);
 void *emalloc(size_t size);
 void *ecalloc(size_t size);
+void *erealloc(void *ptr, size_t size);
 
 #endif
\ No newline at end of file
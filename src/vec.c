@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clog.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "util.h"
+#include "vec.h"
+
+#define VEC_INITIAL_SIZE 1024
+
+/*
+ * Add a zeroed element to the end of the vector and return it. The pointer is
+ * only good until the next append, which may move the whole array.
+ */
+struct inode_list *inode_vec_append(struct inode_vec *vec)
+{
+    if (vec->count == vec->size)
+    {
+        vec->size = vec->size > 0 ? vec->size * 2 : VEC_INITIAL_SIZE;
+        vec->inodes = erealloc(vec->inodes, sizeof(struct inode_list) * vec->size);
+    }
+
+    struct inode_list *inode = &vec->inodes[vec->count++];
+    memset(inode, 0, sizeof(struct inode_list));
+    return inode;
+}
+
+/*
+ * Move other's elements, and the paths they name, onto the end of vec, and
+ * free other's arrays. Other's root must be the same path as root in vec's
+ * path arena.
+ */
+void inode_vec_concat(struct inode_vec *vec, struct inode_vec *other,
+                      uint32_t root)
+{
+    path_arena_concat(&vec->paths, &other->paths, root, other->inodes,
+                      other->count);
+
+    if (vec->count + other->count > vec->size)
+    {
+        vec->size = vec->count + other->count;
+        vec->inodes = erealloc(vec->inodes, sizeof(struct inode_list) * vec->size);
+    }
+    if (other->count > 0)
+    {
+        memcpy(&vec->inodes[vec->count], other->inodes,
+               sizeof(struct inode_list) * other->count);
+    }
+    vec->count += other->count;
+
+    free(other->inodes);
+    other->inodes = NULL;
+    other->count = 0;
+    other->size = 0;
+}
+
+// whether first is already delivered under path
+static int inode_vec_has_path(struct inode_vec *vec, struct inode_list *first,
+                              char *path)
+{
+    char *first_path = path_arena_path(&vec->paths, first->dir, first->name);
+    int found = !strcmp(first_path, path);
+    free(first_path);
+
+    for (size_t i = 0; i < first->links_count && !found; i++)
+    {
+        struct path_link *link = &vec->paths.links[first->links_start + i];
+        char *link_path = path_arena_path(&vec->paths, link->dir, link->name);
+        found = !strcmp(link_path, path);
+        free(link_path);
+    }
+
+    return found;
+}
+
+/*
+ * Fold every hard link to a file into the first of its elements, so that its
+ * blocks are only mapped and read once, and put the others' names in the path
+ * arena's links for the data to be handed out to. The vector must be sorted
+ * by inode number, and every link must have made it past the filter by name.
+ *
+ * Targets that overlap, or are given twice, find the same file under the same
+ * path more than once, from different roots in the arena. Those aren't links,
+ * so they're dropped by comparing the paths in full, which only happens for
+ * files with more than one element.
+ */
+void inode_vec_merge_links(struct inode_vec *vec)
+{
+    size_t kept = 0;
+    size_t duplicates = 0;
+    for (size_t i = 0; i < vec->count; i++)
+    {
+        struct inode_list *inode = &vec->inodes[i];
+        if (kept > 0 && vec->inodes[kept-1].index == inode->index)
+        {
+            struct inode_list *first = &vec->inodes[kept-1];
+            char *path = path_arena_path(&vec->paths, inode->dir, inode->name);
+            int duplicate = inode_vec_has_path(vec, first, path);
+            free(path);
+            if (duplicate)
+            {
+                duplicates++;
+                continue;
+            }
+
+            // the links of one file are all added in a row
+            size_t link = path_arena_add_link(&vec->paths, inode->dir,
+                                              inode->name);
+            if (first->links_count++ == 0)
+                first->links_start = link;
+        }
+        else
+            vec->inodes[kept++] = *inode;
+    }
+
+    if (duplicates > 0)
+        LogInfo("Dropped %lu files found under more than one target", duplicates);
+    if (kept + duplicates < vec->count)
+    {
+        LogInfo("Merged %lu hard links into the files they link to",
+                vec->count - kept - duplicates);
+    }
+    vec->count = kept;
+}
+
+struct block_list *block_vec_append(struct block_vec *vec)
+{
+    if (vec->count == vec->size)
+    {
+        vec->size = vec->size > 0 ? vec->size * 2 : VEC_INITIAL_SIZE;
+        vec->blocks = erealloc(vec->blocks, sizeof(struct block_list) * vec->size);
+    }
+
+    struct block_list *block = &vec->blocks[vec->count++];
+    memset(block, 0, sizeof(struct block_list));
+    return block;
+}
+
+/*
+ * Same as inode_vec_concat(), returning the index other's first element ended
+ * up at.
+ */
+size_t block_vec_concat(struct block_vec *vec, struct block_vec *other)
+{
+    size_t offset = vec->count;
+
+    if (vec->count + other->count > vec->size)
+    {
+        vec->size = vec->count + other->count;
+        vec->blocks = erealloc(vec->blocks, sizeof(struct block_list) * vec->size);
+    }
+    if (other->count > 0)
+    {
+        memcpy(&vec->blocks[vec->count], other->blocks,
+               sizeof(struct block_list) * other->count);
+    }
+    vec->count += other->count;
+
+    free(other->blocks);
+    memset(other, 0, sizeof(struct block_vec));
+
+    return offset;
+}
@@ -0,0 +1,14 @@
+#ifndef DJ_VEC_H
+#define DJ_VEC_H
+
+#include "dj_internal.h"
+
+struct inode_list *inode_vec_append(struct inode_vec *vec);
+void inode_vec_concat(struct inode_vec *vec, struct inode_vec *other,
+                      uint32_t root);
+void inode_vec_merge_links(struct inode_vec *vec);
+
+struct block_list *block_vec_append(struct block_vec *vec);
+size_t block_vec_concat(struct block_vec *vec, struct block_vec *other);
+
+#endif
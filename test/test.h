@@ -0,0 +1,20 @@
+#ifndef DJ_TEST_H
+#define DJ_TEST_H
+
+#include <check.h>
+
+Suite *batch_read_suite(void);
+Suite *block_index_suite(void);
+Suite *block_scan_suite(void);
+Suite *buffer_pool_suite(void);
+Suite *callback_pool_suite(void);
+Suite *consumer_suite(void);
+Suite *filter_suite(void);
+Suite *incremental_suite(void);
+Suite *path_arena_suite(void);
+Suite *pipeline_suite(void);
+Suite *radix_sort_suite(void);
+Suite *stripe_suite(void);
+Suite *vec_suite(void);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch_read.h"
+#include "buffer_pool.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "pipeline.h"
+#include "test.h"
+#include "util.h"
+
+#define TEST_BLOCK_SIZE 1024
+#define TEST_BLOCKS 64
+#define TEST_FILES 8
+#define TEST_FILE_BLOCKS 4
+
+static struct struct_ext2_filsys fs;
+static char dev_path[] = "/tmp/dj_test_devXXXXXX";
+static int dev_fd;
+
+static struct inode_vec inodes;
+static struct block_vec blocks;
+static struct buffer_pool *pool;
+static struct batch_reader reader;
+
+static int stop;
+static int chunks_count;
+
+static void batch_read_setup(void)
+{
+    memset(&fs, 0, sizeof(fs));
+    fs.blocksize = TEST_BLOCK_SIZE;
+
+    strcpy(dev_path, "/tmp/dj_test_devXXXXXX");
+    dev_fd = mkstemp(dev_path);
+    ck_assert_int_ne(dev_fd, -1);
+    char block[TEST_BLOCK_SIZE];
+    for (int i = 0; i < TEST_BLOCKS; i++)
+    {
+        memset(block, i, sizeof(block));
+        ck_assert_int_eq(write(dev_fd, block, sizeof(block)), sizeof(block));
+    }
+
+    // files whose blocks are one apart on disk, so that each block's a stripe
+    // of its own
+    memset(&inodes, 0, sizeof(inodes));
+    memset(&blocks, 0, sizeof(blocks));
+    path_arena_init(&inodes.paths, "/");
+    inodes.inodes = ecalloc(sizeof(struct inode_list) * TEST_FILES);
+    inodes.count = inodes.size = TEST_FILES;
+    blocks.blocks = ecalloc(sizeof(struct block_list)
+                            * TEST_FILES * TEST_FILE_BLOCKS);
+    blocks.count = blocks.size = TEST_FILES * TEST_FILE_BLOCKS;
+    for (int i = 0; i < TEST_FILES; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "file%d", i);
+
+        struct inode_cb_info *inode_info =
+            ecalloc(sizeof(struct inode_cb_info));
+        inode_info->inode = 12 + i;
+        inode_info->paths = &inodes.paths;
+        inode_info->name = path_arena_add_name(&inodes.paths, name);
+        inode_info->len = TEST_FILE_BLOCKS * TEST_BLOCK_SIZE;
+        inode_info->references = TEST_FILE_BLOCKS;
+
+        struct inode_list *inode_list = &inodes.inodes[i];
+        inode_list->index = inode_info->inode;
+        inode_list->len = inode_info->len;
+        inode_list->blocks_start = i * TEST_FILE_BLOCKS;
+        inode_list->blocks_count = TEST_FILE_BLOCKS;
+
+        for (int j = 0; j < TEST_FILE_BLOCKS; j++)
+        {
+            struct block_list *block =
+                &blocks.blocks[i * TEST_FILE_BLOCKS + j];
+            block->inode_info = inode_info;
+            block->physical_block = 1 + 2 * (i * TEST_FILE_BLOCKS + j);
+            block->logical_block = j;
+            block->num_blocks = 1;
+        }
+    }
+
+    pool = buffer_pool_create(1 << 20);
+    memset(&reader, 0, sizeof(reader));
+    reader.fs = &fs;
+    reader.fd = dev_fd;
+    reader.flags = ITERATE_OPT_PHYSICAL_ORDER;
+    reader.max_blocks = TEST_BLOCKS;
+    reader.pool = pool;
+    reader.stop = &stop;
+
+    stop = 0;
+    chunks_count = 0;
+}
+
+static void batch_read_teardown(void)
+{
+    buffer_pool_destroy(pool);
+    free(blocks.blocks);
+    free(inodes.inodes);
+    path_arena_free(&inodes.paths);
+    close(dev_fd);
+    unlink(dev_path);
+}
+
+// stops the read at the first chunk, as dj_close() would, and skips the rest
+// of whichever file's chunk it's handed after that, as iter_cb() does
+static int stop_cb(uint32_t inode, char *path, uint64_t pos,
+                   uint64_t file_len, char *data, uint64_t data_len,
+                   void **private)
+{
+    chunks_count++;
+    stop = 1;
+    return 1;
+}
+
+START_TEST(test_stop_mid_batch)
+{
+    // all of the files go in one batch when they're read in physical order,
+    // and none of the rest of it is read once the read's been stopped
+    read_batches(&reader, stop_cb, NULL, NULL, &inodes, &blocks);
+    ck_assert_int_eq(chunks_count, 1);
+}
+END_TEST
+
+START_TEST(test_stop_mid_batch_pipeline)
+{
+    // the reader thread may have read a little ahead of the stop, but no more
+    // than a chunk of each file it's got to gets delivered
+    reader.pipeline = pipeline_create(&fs, pool, dev_fd, 0, 0,
+                                      2 * TEST_BLOCK_SIZE);
+    read_batches(&reader, stop_cb, NULL, NULL, &inodes, &blocks);
+    pipeline_destroy(reader.pipeline);
+
+    ck_assert(chunks_count >= 1 && chunks_count < TEST_FILES);
+}
+END_TEST
+
+Suite *batch_read_suite(void)
+{
+    Suite *suite = suite_create("batch_read");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, batch_read_setup, batch_read_teardown);
+    tcase_add_test(tcase, test_stop_mid_batch);
+    tcase_add_test(tcase, test_stop_mid_batch_pipeline);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
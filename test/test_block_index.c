@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_index.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "test.h"
+#include "vec.h"
+
+static struct ext2_super_block super;
+static struct struct_ext2_filsys fs;
+static char index_path[] = "/tmp/dj_test_indexXXXXXX";
+
+static void index_setup(void)
+{
+    memset(&super, 0, sizeof(super));
+    memcpy(super.s_uuid, "0123456789abcdef", sizeof(super.s_uuid));
+    super.s_inode_size = 256;
+    memset(&fs, 0, sizeof(fs));
+    fs.blocksize = 4096;
+    fs.super = &super;
+
+    strcpy(index_path, "/tmp/dj_test_indexXXXXXX");
+    int fd = mkstemp(index_path);
+    ck_assert_int_ne(fd, -1);
+    close(fd);
+}
+
+static void index_teardown(void)
+{
+    unlink(index_path);
+}
+
+static struct inode_list *add_file(struct inode_vec *inodes,
+                                   struct block_vec *blocks, ext2_ino_t ino,
+                                   char *name, uint64_t len,
+                                   blk64_t physical_block)
+{
+    struct inode_list *inode = inode_vec_append(inodes);
+    inode->index = ino;
+    inode->name = path_arena_add_name(&inodes->paths, name);
+    inode->len = len;
+    inode->generation = ino * 10;
+    inode->ctime = 1000;
+    inode->ctime_extra = 2000;
+    inode->mtime = 3000;
+    inode->mtime_extra = 4000;
+    inode->version = 5000;
+
+    inode->blocks_start = blocks->count;
+    for (e2_blkcnt_t i = 0; i * 4096 < len; i += 2)
+    {
+        struct block_list *block = block_vec_append(blocks);
+        block->physical_block = physical_block + i * 3;
+        block->logical_block = i;
+        block->num_blocks = 2;
+        inode->blocks_count++;
+    }
+    return inode;
+}
+
+/*
+ * Write an index of two files, one of them empty, and leave them in inodes.
+ */
+static void write_index(struct inode_vec *inodes)
+{
+    struct block_vec blocks = { NULL, 0, 0 };
+    memset(inodes, 0, sizeof(struct inode_vec));
+    path_arena_init(&inodes->paths, "/data");
+
+    add_file(inodes, &blocks, 12, "a", 5 * 4096, 100);
+    add_file(inodes, &blocks, 15, "empty", 0, 0);
+
+    block_index_write(&fs, index_path, inodes, &blocks);
+    free(blocks.blocks);
+}
+
+static void free_inodes(struct inode_vec *inodes)
+{
+    free(inodes->inodes);
+    path_arena_free(&inodes->paths);
+}
+
+/*
+ * Overwrite part of the index file, at an offset into it.
+ */
+static void patch_index(off_t offset, void *data, size_t len)
+{
+    FILE *file = fopen(index_path, "r+");
+    ck_assert_ptr_ne(file, NULL);
+    fseeko(file, offset, SEEK_SET);
+    fwrite(data, len, 1, file);
+    fclose(file);
+}
+
+START_TEST(test_block_index_round_trip)
+{
+    struct inode_vec inodes;
+    write_index(&inodes);
+
+    struct block_index *index = block_index_open(&fs, index_path);
+    ck_assert_ptr_ne(index, NULL);
+    ck_assert_uint_eq(index->header->inodes_count, 2);
+    ck_assert_uint_eq(index->header->runs_count, 3);
+
+    struct block_index_inode *entry = block_index_find(index, 12);
+    ck_assert_ptr_ne(entry, NULL);
+    ck_assert_str_eq(&index->paths[entry->path_offset], "/data/a");
+    ck_assert_uint_eq(entry->runs_count, 3);
+    ck_assert_uint_eq(index->runs[entry->runs_start + 1].physical_block, 106);
+    ck_assert_uint_eq(index->runs[entry->runs_start + 1].logical_block, 2);
+
+    entry = block_index_find(index, 15);
+    ck_assert_ptr_ne(entry, NULL);
+    ck_assert_str_eq(&index->paths[entry->path_offset], "/data/empty");
+    ck_assert_uint_eq(entry->runs_count, 0);
+
+    ck_assert_ptr_eq(block_index_find(index, 13), NULL);
+    ck_assert_ptr_eq(block_index_find(index, 16), NULL);
+
+    block_index_close(index);
+    free_inodes(&inodes);
+}
+END_TEST
+
+START_TEST(test_block_index_lookup)
+{
+    struct inode_vec inodes;
+    write_index(&inodes);
+    struct block_index *index = block_index_open(&fs, index_path);
+    ck_assert_ptr_ne(index, NULL);
+
+    struct inode_list inode = inodes.inodes[0];
+    ck_assert_ptr_ne(block_index_lookup(index, &inode), NULL);
+
+    // a rewrite within the same second only shows in the nanoseconds
+    inode.ctime_extra++;
+    ck_assert_ptr_eq(block_index_lookup(index, &inode), NULL);
+    inode = inodes.inodes[0];
+    inode.mtime_extra++;
+    ck_assert_ptr_eq(block_index_lookup(index, &inode), NULL);
+    inode = inodes.inodes[0];
+    inode.version++;
+    ck_assert_ptr_eq(block_index_lookup(index, &inode), NULL);
+    inode = inodes.inodes[0];
+    inode.generation++;
+    ck_assert_ptr_eq(block_index_lookup(index, &inode), NULL);
+    inode = inodes.inodes[0];
+    inode.len++;
+    ck_assert_ptr_eq(block_index_lookup(index, &inode), NULL);
+
+    block_index_close(index);
+    free_inodes(&inodes);
+}
+END_TEST
+
+START_TEST(test_block_index_other_fs)
+{
+    struct inode_vec inodes;
+    write_index(&inodes);
+
+    super.s_uuid[0]++;
+    ck_assert_ptr_eq(block_index_open(&fs, index_path), NULL);
+    super.s_uuid[0]--;
+    fs.blocksize = 1024;
+    ck_assert_ptr_eq(block_index_open(&fs, index_path), NULL);
+
+    free_inodes(&inodes);
+}
+END_TEST
+
+START_TEST(test_block_index_corrupt)
+{
+    struct inode_vec inodes;
+    off_t first_entry = sizeof(struct block_index_header);
+
+    // runs past the end of the runs
+    write_index(&inodes);
+    uint64_t runs_count = 4;
+    patch_index(first_entry + offsetof(struct block_index_inode, runs_count),
+                &runs_count, sizeof(runs_count));
+    ck_assert_ptr_eq(block_index_open(&fs, index_path), NULL);
+    free_inodes(&inodes);
+
+    // a start so big that start plus count wraps around
+    write_index(&inodes);
+    uint64_t runs_start = UINT64_MAX - 1;
+    patch_index(first_entry + offsetof(struct block_index_inode, runs_start),
+                &runs_start, sizeof(runs_start));
+    ck_assert_ptr_eq(block_index_open(&fs, index_path), NULL);
+    free_inodes(&inodes);
+
+    // a path past the end of the paths
+    write_index(&inodes);
+    uint64_t path_offset = 1000;
+    patch_index(first_entry + offsetof(struct block_index_inode, path_offset),
+                &path_offset, sizeof(path_offset));
+    ck_assert_ptr_eq(block_index_open(&fs, index_path), NULL);
+    free_inodes(&inodes);
+
+    // a last path with no terminator
+    write_index(&inodes);
+    struct block_index *index = block_index_open(&fs, index_path);
+    ck_assert_ptr_ne(index, NULL);
+    off_t last = index->len - 1;
+    block_index_close(index);
+    patch_index(last, "x", 1);
+    ck_assert_ptr_eq(block_index_open(&fs, index_path), NULL);
+    free_inodes(&inodes);
+
+    // counts big enough to wrap the expected length around
+    write_index(&inodes);
+    uint64_t inodes_count = UINT64_MAX / sizeof(struct block_index_inode) + 2;
+    patch_index(offsetof(struct block_index_header, inodes_count),
+                &inodes_count, sizeof(inodes_count));
+    ck_assert_ptr_eq(block_index_open(&fs, index_path), NULL);
+    free_inodes(&inodes);
+}
+END_TEST
+
+START_TEST(test_block_index_stamp)
+{
+    struct ext2_inode_large inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.i_generation = 7;
+    inode.i_ctime = 100;
+    inode.i_mtime = 200;
+    inode.osd1.linux1.l_i_version = 3;
+    inode.i_ctime_extra = 101;
+    inode.i_mtime_extra = 201;
+    inode.i_version_hi = 1;
+    inode.i_extra_isize = 32;
+
+    struct inode_list inode_list;
+    memset(&inode_list, 0, sizeof(inode_list));
+    block_index_stamp(&fs, &inode, &inode_list);
+    ck_assert_uint_eq(inode_list.generation, 7);
+    ck_assert_uint_eq(inode_list.ctime, 100);
+    ck_assert_uint_eq(inode_list.ctime_extra, 101);
+    ck_assert_uint_eq(inode_list.mtime, 200);
+    ck_assert_uint_eq(inode_list.mtime_extra, 201);
+    ck_assert_uint_eq(inode_list.version, ((uint64_t)1 << 32) | 3);
+    ck_assert_int_eq(inode_list.stamped, 1);
+    ck_assert_int_eq(inode_list.inline_data, 0);
+
+    // whether the data's inline goes with the stamp, since a file the index
+    // has isn't read again to find out
+    inode.i_flags = EXT4_INLINE_DATA_FL;
+    block_index_stamp(&fs, &inode, &inode_list);
+    ck_assert_int_eq(inode_list.inline_data, 1);
+    inode.i_flags = 0;
+
+    // only the checksum and ctime's nanoseconds in use
+    inode.i_extra_isize = 8;
+    block_index_stamp(&fs, &inode, &inode_list);
+    ck_assert_uint_eq(inode_list.ctime_extra, 101);
+    ck_assert_uint_eq(inode_list.mtime_extra, 0);
+    ck_assert_uint_eq(inode_list.version, 3);
+
+    // 128-byte inodes have nothing past the original fields at all
+    super.s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+    inode.i_extra_isize = 32;
+    block_index_stamp(&fs, &inode, &inode_list);
+    ck_assert_uint_eq(inode_list.ctime_extra, 0);
+    ck_assert_uint_eq(inode_list.mtime_extra, 0);
+    ck_assert_uint_eq(inode_list.version, 3);
+}
+END_TEST
+
+Suite *block_index_suite(void)
+{
+    Suite *suite = suite_create("block_index");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, index_setup, index_teardown);
+    tcase_add_test(tcase, test_block_index_round_trip);
+    tcase_add_test(tcase, test_block_index_lookup);
+    tcase_add_test(tcase, test_block_index_other_fs);
+    tcase_add_test(tcase, test_block_index_corrupt);
+    tcase_add_test(tcase, test_block_index_stamp);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_scan.h"
+#include "dj_internal.h"
+#include "test.h"
+#include "util.h"
+
+#define TEST_BLOCK_SIZE 1024
+
+static struct inode_cb_info inode_info;
+static struct inode_list inode_list;
+static struct block_vec blocks;
+static struct scan_blocks_info scan_info;
+
+static void block_scan_setup(void)
+{
+    memset(&inode_info, 0, sizeof(inode_info));
+    memset(&inode_list, 0, sizeof(inode_list));
+    memset(&blocks, 0, sizeof(blocks));
+
+    // ten and a half blocks long
+    inode_info.inode = 12;
+    inode_info.len = 10 * TEST_BLOCK_SIZE + TEST_BLOCK_SIZE / 2;
+
+    scan_info.cb = NULL;
+    scan_info.inode_info = &inode_info;
+    scan_info.inode_list = &inode_list;
+    scan_info.blocks = &blocks;
+}
+
+static void block_scan_teardown(void)
+{
+    free(blocks.blocks);
+}
+
+static void check_run(size_t i, blk64_t physical_block,
+                      e2_blkcnt_t logical_block, e2_blkcnt_t num_blocks,
+                      uint64_t len)
+{
+    ck_assert(i < inode_list.blocks_count);
+    struct block_list *block = &blocks.blocks[inode_list.blocks_start + i];
+    ck_assert_ptr_eq(block->inode_info, &inode_info);
+    ck_assert_uint_eq(block->physical_block, physical_block);
+    ck_assert_int_eq(block->logical_block, logical_block);
+    ck_assert_int_eq(block->num_blocks, num_blocks);
+    ck_assert_uint_eq(block->stripe_ptr.len, len);
+}
+
+START_TEST(test_holes)
+{
+    // a hole at the start, one in the middle and one at the end, each of
+    // which is a single run however many blocks it covers
+    scan_extent(TEST_BLOCK_SIZE, 100, 2, 3, &scan_info);
+    scan_extent(TEST_BLOCK_SIZE, 200, 7, 1, &scan_info);
+    scan_trailing_hole(TEST_BLOCK_SIZE, &scan_info);
+
+    ck_assert_uint_eq(inode_list.blocks_count, 5);
+    check_run(0, 0, 0, 2, 2 * TEST_BLOCK_SIZE);
+    check_run(1, 100, 2, 3, 3 * TEST_BLOCK_SIZE);
+    check_run(2, 0, 5, 2, 2 * TEST_BLOCK_SIZE);
+    check_run(3, 200, 7, 1, TEST_BLOCK_SIZE);
+    // the last run stops at the end of the file, half way through a block
+    check_run(4, 0, 8, 3, 2 * TEST_BLOCK_SIZE + TEST_BLOCK_SIZE / 2);
+
+    ck_assert_int_eq(inode_info.blocks_scanned, 11);
+    ck_assert_int_eq(inode_info.references, 5);
+}
+END_TEST
+
+START_TEST(test_runs_merge)
+{
+    // blocks that carry on where the last run left off on disk join it,
+    // whether they come a block or an extent at a time
+    scan_extent(TEST_BLOCK_SIZE, 100, 0, 1, &scan_info);
+    scan_extent(TEST_BLOCK_SIZE, 101, 1, 4, &scan_info);
+    scan_extent(TEST_BLOCK_SIZE, 105, 5, 1, &scan_info);
+    // but not ones that don't
+    scan_extent(TEST_BLOCK_SIZE, 300, 6, 5, &scan_info);
+
+    ck_assert_uint_eq(inode_list.blocks_count, 2);
+    check_run(0, 100, 0, 6, 6 * TEST_BLOCK_SIZE);
+    check_run(1, 300, 6, 5, 4 * TEST_BLOCK_SIZE + TEST_BLOCK_SIZE / 2);
+
+    // no hole's left at the end
+    scan_trailing_hole(TEST_BLOCK_SIZE, &scan_info);
+    ck_assert_uint_eq(inode_list.blocks_count, 2);
+}
+END_TEST
+
+START_TEST(test_past_end)
+{
+    // blocks allocated past the end of the file are left out
+    scan_extent(TEST_BLOCK_SIZE, 100, 0, 16, &scan_info);
+    scan_extent(TEST_BLOCK_SIZE, 500, 16, 4, &scan_info);
+
+    ck_assert_uint_eq(inode_list.blocks_count, 1);
+    check_run(0, 100, 0, 11, inode_info.len);
+    ck_assert_int_eq(inode_info.blocks_scanned, 11);
+}
+END_TEST
+
+START_TEST(test_sparse_file)
+{
+    // a file with no blocks at all is one hole
+    scan_trailing_hole(TEST_BLOCK_SIZE, &scan_info);
+
+    ck_assert_uint_eq(inode_list.blocks_count, 1);
+    check_run(0, 0, 0, 11, inode_info.len);
+}
+END_TEST
+
+START_TEST(test_unwritten_extents)
+{
+    // unwritten extents are holes, and join the holes on either side of them
+    struct ext2fs_extent extents[] = {
+        { .e_pblk = 100, .e_lblk = 0, .e_len = 2,
+          .e_flags = EXT2_EXTENT_FLAGS_LEAF },
+        { .e_pblk = 102, .e_lblk = 2, .e_len = 2,
+          .e_flags = EXT2_EXTENT_FLAGS_LEAF | EXT2_EXTENT_FLAGS_UNINIT },
+        { .e_pblk = 110, .e_lblk = 6, .e_len = 2,
+          .e_flags = EXT2_EXTENT_FLAGS_LEAF | EXT2_EXTENT_FLAGS_UNINIT },
+        { .e_pblk = 112, .e_lblk = 8, .e_len = 3,
+          .e_flags = EXT2_EXTENT_FLAGS_LEAF },
+    };
+    for (int i = 0; i < 4; i++)
+        scan_leaf_extent(TEST_BLOCK_SIZE, &extents[i], &scan_info);
+    scan_trailing_hole(TEST_BLOCK_SIZE, &scan_info);
+
+    // leaving the written extents on either side as runs of their own
+    ck_assert_uint_eq(inode_list.blocks_count, 3);
+    check_run(0, 100, 0, 2, 2 * TEST_BLOCK_SIZE);
+    check_run(1, 0, 2, 6, 6 * TEST_BLOCK_SIZE);
+    check_run(2, 112, 8, 3, 2 * TEST_BLOCK_SIZE + TEST_BLOCK_SIZE / 2);
+}
+END_TEST
+
+Suite *block_scan_suite(void)
+{
+    Suite *suite = suite_create("block_scan");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, block_scan_setup, block_scan_teardown);
+    tcase_add_test(tcase, test_holes);
+    tcase_add_test(tcase, test_runs_merge);
+    tcase_add_test(tcase, test_past_end);
+    tcase_add_test(tcase, test_sparse_file);
+    tcase_add_test(tcase, test_unwritten_extents);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+#include "test.h"
+
+#define MAX_CLASS_LEN ((size_t)1 << (BUFFER_POOL_MIN_SHIFT \
+                                     + BUFFER_POOL_CLASSES - 1))
+
+START_TEST(test_size_classes)
+{
+    struct buffer_pool *pool = buffer_pool_create(1 << 20);
+
+    // buffers come back for anything in the same power-of-two class, and
+    // are aligned for O_DIRECT whatever the length
+    char *buf = buffer_pool_get(pool, 100);
+    ck_assert_uint_eq((uintptr_t)buf % 4096, 0);
+    buffer_pool_put(pool, buf, 100);
+    ck_assert_uint_eq(pool->free_bytes, 4096);
+    ck_assert_ptr_eq(buffer_pool_get(pool, 4096), buf);
+    ck_assert_uint_eq(pool->hits, 1);
+    buffer_pool_put(pool, buf, 4096);
+
+    // but not for the next class up
+    char *bigger = buffer_pool_get(pool, 4097);
+    ck_assert_ptr_ne(bigger, buf);
+    ck_assert_uint_eq(pool->misses, 2);
+    buffer_pool_put(pool, bigger, 4097);
+    ck_assert_uint_eq(pool->free_bytes, 4096 + 8192);
+    ck_assert_ptr_eq(buffer_pool_get(pool, 8192), bigger);
+    ck_assert_ptr_eq(buffer_pool_get(pool, 1), buf);
+    ck_assert_uint_eq(pool->free_bytes, 0);
+
+    free(buf);
+    free(bigger);
+    buffer_pool_destroy(pool);
+}
+END_TEST
+
+START_TEST(test_oversized)
+{
+    // buffers bigger than the biggest class bypass the pool
+    struct buffer_pool *pool = buffer_pool_create(SIZE_MAX);
+
+    char *buf = buffer_pool_get(pool, MAX_CLASS_LEN + 1);
+    ck_assert_uint_eq((uintptr_t)buf % 4096, 0);
+    buffer_pool_put(pool, buf, MAX_CLASS_LEN + 1);
+    ck_assert_uint_eq(pool->free_bytes, 0);
+    ck_assert_uint_eq(pool->drops, 0);
+
+    // the biggest class itself is pooled
+    buf = buffer_pool_get(pool, MAX_CLASS_LEN);
+    buffer_pool_put(pool, buf, MAX_CLASS_LEN);
+    ck_assert_uint_eq(pool->free_bytes, MAX_CLASS_LEN);
+
+    buffer_pool_destroy(pool);
+}
+END_TEST
+
+START_TEST(test_idle_cap)
+{
+    // idle buffers are kept up to max_bytes, and freed past it
+    struct buffer_pool *pool = buffer_pool_create(3 * 4096);
+
+    void *bufs[4];
+    for (int i = 0; i < 4; i++)
+        bufs[i] = buffer_pool_get(pool, 4096);
+    for (int i = 0; i < 4; i++)
+        buffer_pool_put(pool, bufs[i], 4096);
+    ck_assert_uint_eq(pool->free_bytes, 3 * 4096);
+    ck_assert_uint_eq(pool->drops, 1);
+
+    // a buffer of a bigger class doesn't fit in what's left either
+    void *bigger = buffer_pool_get(pool, 8192);
+    buffer_pool_put(pool, bigger, 8192);
+    ck_assert_uint_eq(pool->drops, 2);
+
+    // but once some have been taken out again, there's room
+    void *buf = buffer_pool_get(pool, 4096);
+    ck_assert_uint_eq(pool->free_bytes, 2 * 4096);
+    buffer_pool_put(pool, buf, 4096);
+    ck_assert_uint_eq(pool->free_bytes, 3 * 4096);
+    ck_assert_uint_eq(pool->drops, 2);
+
+    buffer_pool_destroy(pool);
+}
+END_TEST
+
+Suite *buffer_pool_suite(void)
+{
+    Suite *suite = suite_create("buffer_pool");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_test(tcase, test_size_classes);
+    tcase_add_test(tcase, test_oversized);
+    tcase_add_test(tcase, test_idle_cap);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
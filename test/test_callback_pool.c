@@ -0,0 +1,151 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "callback_pool.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "stripe.h"
+#include "test.h"
+#include "util.h"
+
+#define TEST_THREADS 4
+#define TEST_FILES 8
+#define TEST_CHUNKS 200
+#define TEST_CHUNK_LEN 16
+
+static struct path_arena paths;
+static struct inode_cb_info *inode_infos[TEST_FILES];
+static char data[TEST_CHUNK_LEN];
+
+// what each file's callbacks have seen, written only by the file's own thread
+// while it's running, and read once the pool's been waited on
+static uint64_t next_pos[TEST_FILES];
+static int chunks_count[TEST_FILES];
+static pthread_t file_thread[TEST_FILES];
+static int out_of_order[TEST_FILES];
+static int moved_thread[TEST_FILES];
+static int overlapped[TEST_FILES];
+static int running[TEST_FILES];
+
+static int skip_first;
+
+static void callback_pool_setup(void)
+{
+    path_arena_init(&paths, "/");
+    for (int i = 0; i < TEST_FILES; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "file%d", i);
+
+        struct inode_cb_info *inode_info =
+            ecalloc(sizeof(struct inode_cb_info));
+        inode_info->inode = 12 + i;
+        inode_info->paths = &paths;
+        inode_info->name = path_arena_add_name(&paths, name);
+        inode_info->len = TEST_CHUNKS * TEST_CHUNK_LEN;
+        // held on to by the test until it's done
+        inode_info->references = 1;
+        inode_infos[i] = inode_info;
+
+        next_pos[i] = 0;
+        chunks_count[i] = 0;
+        out_of_order[i] = moved_thread[i] = overlapped[i] = running[i] = 0;
+    }
+    skip_first = 0;
+}
+
+static void callback_pool_teardown(void)
+{
+    for (int i = 0; i < TEST_FILES; i++)
+        deref_inode(inode_infos[i]);
+    path_arena_free(&paths);
+}
+
+static int order_cb(uint32_t inode, char *path, uint64_t pos,
+                    uint64_t file_len, char *data, uint64_t data_len,
+                    void **private)
+{
+    int file = inode - 12;
+    if (__atomic_add_fetch(&running[file], 1, __ATOMIC_SEQ_CST) > 1)
+        overlapped[file] = 1;
+
+    if (chunks_count[file] == 0)
+        file_thread[file] = pthread_self();
+    else if (!pthread_equal(file_thread[file], pthread_self()))
+        moved_thread[file] = 1;
+    if (pos != next_pos[file])
+        out_of_order[file] = 1;
+    next_pos[file] = pos + data_len;
+    chunks_count[file]++;
+
+    __atomic_sub_fetch(&running[file], 1, __ATOMIC_SEQ_CST);
+    return skip_first;
+}
+
+/*
+ * Hand every file's chunks to the pool in logical order, interleaved between
+ * the files, as a read of many small files would.
+ */
+static void submit_all(struct callback_pool *pool)
+{
+    for (int chunk = 0; chunk < TEST_CHUNKS; chunk++)
+    {
+        for (int i = 0; i < TEST_FILES; i++)
+        {
+            callback_pool_submit(pool, order_cb, inode_infos[i],
+                                 chunk * TEST_CHUNK_LEN, data, TEST_CHUNK_LEN,
+                                 NULL);
+        }
+    }
+    callback_pool_wait(pool, 0);
+}
+
+START_TEST(test_file_order)
+{
+    // each file's chunks arrive one at a time, in order, on one thread
+    struct callback_pool *pool = callback_pool_create(TEST_THREADS);
+    submit_all(pool);
+    callback_pool_destroy(pool);
+
+    for (int i = 0; i < TEST_FILES; i++)
+    {
+        ck_assert_int_eq(chunks_count[i], TEST_CHUNKS);
+        ck_assert_int_eq(out_of_order[i], 0);
+        ck_assert_int_eq(moved_thread[i], 0);
+        ck_assert_int_eq(overlapped[i], 0);
+    }
+}
+END_TEST
+
+START_TEST(test_skip_queued)
+{
+    // chunks already queued when their file is skipped are dropped
+    skip_first = 1;
+    struct callback_pool *pool = callback_pool_create(TEST_THREADS);
+    submit_all(pool);
+    callback_pool_destroy(pool);
+
+    for (int i = 0; i < TEST_FILES; i++)
+    {
+        ck_assert_int_eq(chunks_count[i], 1);
+        ck_assert_int_eq(inode_skipped(inode_infos[i]), 1);
+    }
+}
+END_TEST
+
+Suite *callback_pool_suite(void)
+{
+    Suite *suite = suite_create("callback_pool");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, callback_pool_setup,
+                              callback_pool_teardown);
+    tcase_add_test(tcase, test_file_order);
+    tcase_add_test(tcase, test_skip_queued);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
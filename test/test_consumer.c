@@ -0,0 +1,159 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "consumer.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "stripe.h"
+#include "test.h"
+#include "util.h"
+
+static struct path_arena paths;
+static char data[64];
+
+// everything the consumer's been told, in order
+static char events[1024];
+
+static void add_event(const char *format, ...)
+{
+    size_t len = strlen(events);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(events + len, sizeof(events) - len, format, args);
+    va_end(args);
+}
+
+static int on_file_begin(uint32_t inode, char *path, uint64_t file_len,
+                         void **private)
+{
+    add_event("begin %s %llu;", path, (unsigned long long)file_len);
+    *private = path;
+    return strcmp(path, "/skipped") == 0;
+}
+
+static int on_chunks(const struct dj_chunk *chunks, size_t n)
+{
+    add_event("chunks");
+    for (size_t i = 0; i < n; i++)
+    {
+        ck_assert_str_eq(chunks[i].private, chunks[i].path);
+        add_event(" %s@%llu+%llu", chunks[i].path,
+                  (unsigned long long)chunks[i].pos,
+                  (unsigned long long)chunks[i].data_len);
+    }
+    add_event(";");
+    return 0;
+}
+
+static int on_file_end(uint32_t inode, char *path, void *private)
+{
+    ck_assert_ptr_eq(private, path);
+    add_event("end %s;", path);
+    return 0;
+}
+
+static struct dj_consumer consumer = { on_file_begin, on_chunks,
+                                       on_file_end };
+
+static void consumer_setup(void)
+{
+    path_arena_init(&paths, "/");
+    events[0] = '\0';
+}
+
+static void consumer_teardown(void)
+{
+    path_arena_free(&paths);
+}
+
+static struct inode_cb_info *add_inode(ext2_ino_t inode, char *name,
+                                       int blocks)
+{
+    struct inode_cb_info *inode_info = ecalloc(sizeof(struct inode_cb_info));
+    inode_info->inode = inode;
+    inode_info->paths = &paths;
+    inode_info->name = path_arena_add_name(&paths, name);
+    inode_info->len = blocks * 16;
+    inode_info->references = blocks;
+    return inode_info;
+}
+
+/*
+ * Queue up one of an inode's blocks as the read loop would, dropping the
+ * block's reference once it's handed over.
+ */
+static void add_block(struct chunk_batch *batch,
+                      struct inode_cb_info *inode_info, int block)
+{
+    chunk_batch_add(batch, inode_info, block * 16, data, 16, NULL);
+    deref_inode(inode_info);
+}
+
+START_TEST(test_begin_chunks_end)
+{
+    // a file's begun before its first chunks, and ended once the batch its
+    // last one went out in has been flushed, whatever the batches hold
+    struct chunk_batch *batch = chunk_batch_create(&consumer);
+    struct inode_cb_info *a = add_inode(12, "a", 2);
+    struct inode_cb_info *b = add_inode(13, "b", 1);
+
+    add_block(batch, a, 0);
+    add_block(batch, b, 0);
+    chunk_batch_flush(batch);
+    ck_assert_str_eq(events, "begin /a 32;begin /b 16;"
+                             "chunks /a@0+16 /b@0+16;end /b;");
+
+    events[0] = '\0';
+    add_block(batch, a, 1);
+    chunk_batch_flush(batch);
+    ck_assert_str_eq(events, "chunks /a@16+16;end /a;");
+
+    // nothing's left to flush
+    events[0] = '\0';
+    chunk_batch_flush(batch);
+    ck_assert_str_eq(events, "");
+
+    chunk_batch_destroy(batch);
+}
+END_TEST
+
+START_TEST(test_skip_on_begin)
+{
+    // a file skipped by on_file_begin is ended there and then, gets no
+    // chunks, and has the rest of it dropped
+    struct chunk_batch *batch = chunk_batch_create(&consumer);
+    struct inode_cb_info *skipped = add_inode(12, "skipped", 2);
+    struct inode_cb_info *kept = add_inode(13, "kept", 1);
+
+    add_block(batch, skipped, 0);
+    add_block(batch, kept, 0);
+    chunk_batch_flush(batch);
+    ck_assert_str_eq(events, "begin /skipped 32;end /skipped;begin /kept 16;"
+                             "chunks /kept@0+16;end /kept;");
+    ck_assert_int_eq(inode_skipped(skipped), 1);
+
+    // as the read loop would drop its last block, unread
+    events[0] = '\0';
+    deref_inode(skipped);
+    chunk_batch_flush(batch);
+    ck_assert_str_eq(events, "");
+
+    chunk_batch_destroy(batch);
+}
+END_TEST
+
+Suite *consumer_suite(void)
+{
+    Suite *suite = suite_create("consumer");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, consumer_setup, consumer_teardown);
+    tcase_add_test(tcase, test_begin_chunks_end);
+    tcase_add_test(tcase, test_skip_on_begin);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
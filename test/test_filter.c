@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "dj_internal.h"
+#include "filter.h"
+#include "test.h"
+
+static struct dj_filter filter;
+static struct ext2_inode inode;
+
+static void filter_setup(void)
+{
+    dj_filter_init(&filter);
+
+    // a 4KiB regular file belonging to uid 1000, last changed at 2000
+    memset(&inode, 0, sizeof(inode));
+    inode.i_mode = LINUX_S_IFREG | 0644;
+    inode.i_size = 4096;
+    inode.i_uid = 1000;
+    inode.i_mtime = 2000;
+    inode.i_ctime = 2000;
+}
+
+START_TEST(test_filter_null)
+{
+    // no filter, or a fresh one, lets everything through
+    ck_assert_int_eq(filter_name(NULL, "a.c", "/src"), 1);
+    ck_assert_int_eq(filter_inode(NULL, &inode), 1);
+    ck_assert_int_eq(filter_prune_dir(NULL, ".git", "/"), 0);
+
+    ck_assert_int_eq(filter_name(&filter, "a.c", "/src"), 1);
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+    ck_assert_int_eq(filter_prune_dir(&filter, ".git", "/"), 0);
+}
+END_TEST
+
+START_TEST(test_filter_names)
+{
+    // patterns without a slash match the name alone, wherever the file is
+    char *include[] = { "*.c", "*.h" };
+    char *exclude[] = { "test_*" };
+    filter.include_names = include;
+    filter.include_names_count = 2;
+    filter.exclude_names = exclude;
+    filter.exclude_names_count = 1;
+
+    ck_assert_int_eq(filter_name(&filter, "a.c", "/src"), 1);
+    ck_assert_int_eq(filter_name(&filter, "a.h", "/src/deep/er"), 1);
+    ck_assert_int_eq(filter_name(&filter, "a.o", "/src"), 0);
+    ck_assert_int_eq(filter_name(&filter, "test_a.c", "/src"), 0);
+}
+END_TEST
+
+START_TEST(test_filter_paths)
+{
+    // patterns with a slash match the whole path, and * doesn't cross
+    // directories
+    char *include[] = { "/src/*.c" };
+    filter.include_names = include;
+    filter.include_names_count = 1;
+
+    ck_assert_int_eq(filter_name(&filter, "a.c", "/src"), 1);
+    ck_assert_int_eq(filter_name(&filter, "a.c", "/src/"), 1);
+    ck_assert_int_eq(filter_name(&filter, "a.c", "/src/sub"), 0);
+    ck_assert_int_eq(filter_name(&filter, "a.c", "/lib"), 0);
+
+    // files in the root have no directory path to speak of
+    char *root[] = { "/*.c" };
+    filter.include_names = root;
+    ck_assert_int_eq(filter_name(&filter, "a.c", "/"), 1);
+    ck_assert_int_eq(filter_name(&filter, "a.c", NULL), 1);
+}
+END_TEST
+
+START_TEST(test_filter_prune)
+{
+    char *prune[] = { ".git", "/build/*" };
+    filter.prune_names = prune;
+    filter.prune_names_count = 2;
+
+    ck_assert_int_eq(filter_prune_dir(&filter, ".git", "/src"), 1);
+    ck_assert_int_eq(filter_prune_dir(&filter, "git", "/src"), 0);
+    ck_assert_int_eq(filter_prune_dir(&filter, "debug", "/build"), 1);
+    ck_assert_int_eq(filter_prune_dir(&filter, "debug", "/src/build"), 0);
+
+    // pruning's only for directories, and doesn't affect file names
+    ck_assert_int_eq(filter_name(&filter, ".git", "/src"), 1);
+}
+END_TEST
+
+START_TEST(test_filter_size)
+{
+    // the bounds are inclusive, and a max of 0 is no max
+    filter.min_size = 4096;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+    filter.min_size = 4097;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+
+    filter.min_size = 0;
+    filter.max_size = 4096;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+    filter.max_size = 4095;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+
+    // sizes past 4GiB count their high half
+    filter.max_size = 0;
+    filter.min_size = 1ULL << 32;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+    inode.i_size_high = 1;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+}
+END_TEST
+
+START_TEST(test_filter_times)
+{
+    filter.min_mtime = 2000;
+    filter.max_mtime = 2000;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+    filter.min_mtime = 2001;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+    filter.min_mtime = 0;
+    filter.max_mtime = 1999;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+
+    filter.max_mtime = 0;
+    filter.min_ctime = 2001;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+    filter.min_ctime = 0;
+    filter.max_ctime = 1999;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+    filter.max_ctime = 2000;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+}
+END_TEST
+
+START_TEST(test_filter_uid)
+{
+    filter.uid = 1000;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+    filter.uid = 0;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+}
+END_TEST
+
+START_TEST(test_filter_types)
+{
+    filter.types = DJ_TYPE_REG | DJ_TYPE_FIFO;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+
+    inode.i_mode = LINUX_S_IFIFO | 0644;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 1);
+
+    inode.i_mode = LINUX_S_IFCHR | 0644;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+
+    // symlinks are never one of the types
+    inode.i_mode = LINUX_S_IFLNK | 0777;
+    ck_assert_int_eq(filter_inode(&filter, &inode), 0);
+}
+END_TEST
+
+Suite *filter_suite(void)
+{
+    Suite *suite = suite_create("filter");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, filter_setup, NULL);
+    tcase_add_test(tcase, test_filter_null);
+    tcase_add_test(tcase, test_filter_names);
+    tcase_add_test(tcase, test_filter_paths);
+    tcase_add_test(tcase, test_filter_prune);
+    tcase_add_test(tcase, test_filter_size);
+    tcase_add_test(tcase, test_filter_times);
+    tcase_add_test(tcase, test_filter_uid);
+    tcase_add_test(tcase, test_filter_types);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
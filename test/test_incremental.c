@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_index.h"
+#include "block_scan.h"
+#include "dj_internal.h"
+#include "incremental.h"
+#include "path_arena.h"
+#include "test.h"
+#include "util.h"
+#include "vec.h"
+
+#define BLOCK_SIZE 4096
+
+static struct ext2_super_block super;
+static struct struct_ext2_filsys fs;
+static char manifest_path[] = "/tmp/dj_test_manifestXXXXXX";
+
+// what on_change (as a bit per DJ_FILE_* change) and the empty-file calls
+// were told, by inode number
+static int changes[64];
+static uint64_t change_pos[64];
+static int empty_calls[64];
+
+static void incremental_setup(void)
+{
+    memset(&super, 0, sizeof(super));
+    super.s_inode_size = 256;
+    memset(&fs, 0, sizeof(fs));
+    fs.blocksize = BLOCK_SIZE;
+    fs.super = &super;
+
+    for (int i = 0; i < 64; i++)
+    {
+        changes[i] = 0;
+        change_pos[i] = 0;
+        empty_calls[i] = 0;
+    }
+
+    strcpy(manifest_path, "/tmp/dj_test_manifestXXXXXX");
+    int fd = mkstemp(manifest_path);
+    ck_assert_int_ne(fd, -1);
+    close(fd);
+}
+
+static void incremental_teardown(void)
+{
+    unlink(manifest_path);
+}
+
+static void record_change(uint32_t inode, char *path, int change, uint64_t pos)
+{
+    changes[inode] |= 1 << change;
+    change_pos[inode] = pos;
+}
+
+static int record_empty(uint32_t inode, char *path, uint64_t pos,
+                        uint64_t file_len, char *data, uint64_t data_len,
+                        void **private)
+{
+    empty_calls[inode]++;
+    return 0;
+}
+
+/*
+ * Add a file whose data is one run of blocks from physical_block on, with an
+ * inode_info referenced by each of its blocks, as the block scan leaves it.
+ */
+static struct inode_list *add_file(struct inode_vec *inodes,
+                                   struct block_vec *blocks, ext2_ino_t ino,
+                                   uint32_t generation, uint32_t ctime_extra,
+                                   uint64_t len, blk64_t physical_block)
+{
+    struct inode_list *inode = inode_vec_append(inodes);
+    inode->index = ino;
+    inode->name = path_arena_add_name(&inodes->paths, "f");
+    inode->len = len;
+    inode->generation = generation;
+    inode->ctime = 1000;
+    inode->ctime_extra = ctime_extra;
+    inode->mtime = 1000;
+
+    e2_blkcnt_t num_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (num_blocks == 0)
+        return inode;
+
+    struct inode_cb_info *info = ecalloc(sizeof(struct inode_cb_info));
+    info->inode = ino;
+    info->len = len;
+    info->references = 1;
+
+    inode->blocks_start = blocks->count;
+    inode->blocks_count = 1;
+    struct block_list *block = block_vec_append(blocks);
+    block->inode_info = info;
+    block->physical_block = physical_block;
+    block->logical_block = 0;
+    block->num_blocks = num_blocks;
+    block->stripe_ptr.len = len;
+    return inode;
+}
+
+static void free_vecs(struct inode_vec *inodes, struct block_vec *blocks)
+{
+    free(inodes->inodes);
+    path_arena_free(&inodes->paths);
+    free(blocks->blocks);
+}
+
+/*
+ * Write a manifest, then plan a read against it of files that have since
+ * changed in different ways.
+ */
+static void plan(int trust_appends, struct inode_vec *inodes,
+                 struct block_vec *blocks)
+{
+    struct inode_vec old_inodes = { 0 };
+    struct block_vec old_blocks = { NULL, 0, 0 };
+    path_arena_init(&old_inodes.paths, "/");
+    add_file(&old_inodes, &old_blocks, 20, 1, 0, 3 * BLOCK_SIZE, 100);
+    add_file(&old_inodes, &old_blocks, 21, 1, 0, 3 * BLOCK_SIZE, 200);
+    add_file(&old_inodes, &old_blocks, 22, 1, 0, 2 * BLOCK_SIZE + 10, 300);
+    add_file(&old_inodes, &old_blocks, 24, 1, 0, BLOCK_SIZE, 400);
+    add_file(&old_inodes, &old_blocks, 25, 1, 0, BLOCK_SIZE, 500);
+    add_file(&old_inodes, &old_blocks, 26, 1, 0, 0, 0);
+    block_index_write(&fs, manifest_path, &old_inodes, &old_blocks);
+    for (size_t i = 0; i < old_blocks.count; i++)
+        free(old_blocks.blocks[i].inode_info);
+    free_vecs(&old_inodes, &old_blocks);
+
+    memset(inodes, 0, sizeof(struct inode_vec));
+    memset(blocks, 0, sizeof(struct block_vec));
+    path_arena_init(&inodes->paths, "/");
+    // unchanged
+    add_file(inodes, blocks, 20, 1, 0, 3 * BLOCK_SIZE, 100);
+    // rewritten in place within the same second
+    add_file(inodes, blocks, 21, 1, 5, 3 * BLOCK_SIZE, 200);
+    // grown, with the old blocks where they were
+    add_file(inodes, blocks, 22, 1, 5, 4 * BLOCK_SIZE, 300);
+    // new
+    add_file(inodes, blocks, 23, 1, 0, BLOCK_SIZE, 600);
+    // 24 deleted; 25's inode number reused
+    add_file(inodes, blocks, 25, 2, 0, BLOCK_SIZE, 700);
+    // empty and unchanged, and empty and new
+    add_file(inodes, blocks, 26, 1, 0, 0, 0);
+    add_file(inodes, blocks, 27, 1, 0, 0, 0);
+
+    struct block_index *manifest = block_index_open(&fs, manifest_path);
+    ck_assert_ptr_ne(manifest, NULL);
+    plan_incremental(&fs, manifest, record_change, trust_appends, inodes,
+                     blocks);
+    block_index_close(manifest);
+}
+
+START_TEST(test_incremental_changes)
+{
+    struct inode_vec inodes;
+    struct block_vec blocks;
+    plan(0, &inodes, &blocks);
+
+    ck_assert_int_eq(changes[20], 1 << DJ_FILE_UNCHANGED);
+    ck_assert_int_eq(changes[21], 1 << DJ_FILE_CHANGED);
+    ck_assert_int_eq(changes[22], 1 << DJ_FILE_CHANGED);
+    ck_assert_int_eq(changes[23], 1 << DJ_FILE_NEW);
+    ck_assert_int_eq(changes[24], 1 << DJ_FILE_DELETED);
+    // the old file under 25 has gone, and the new one's new
+    ck_assert_int_eq(changes[25],
+                     (1 << DJ_FILE_NEW) | (1 << DJ_FILE_DELETED));
+    ck_assert_int_eq(changes[26], 1 << DJ_FILE_UNCHANGED);
+    ck_assert_int_eq(changes[27], 1 << DJ_FILE_NEW);
+
+    // only the unchanged file's blocks are dropped, and the changed ones are
+    // read from the start
+    ck_assert_uint_eq(inodes.inodes[0].blocks_count, 0);
+    ck_assert(inodes.inodes[0].dropped);
+    ck_assert_uint_eq(inodes.inodes[1].blocks_count, 1);
+    ck_assert_uint_eq(inodes.inodes[2].blocks_count, 1);
+    ck_assert_uint_eq(blocks.blocks[inodes.inodes[2].blocks_start]
+                      .logical_block, 0);
+    ck_assert_uint_eq(change_pos[22], 0);
+
+    free_vecs(&inodes, &blocks);
+}
+END_TEST
+
+START_TEST(test_incremental_trusted_append)
+{
+    struct inode_vec inodes;
+    struct block_vec blocks;
+    plan(1, &inodes, &blocks);
+
+    // delivery starts at the old last block, which may have been partial
+    ck_assert_int_eq(changes[22], 1 << DJ_FILE_APPENDED);
+    ck_assert_uint_eq(change_pos[22], 2 * BLOCK_SIZE);
+    struct block_list *block = &blocks.blocks[inodes.inodes[2].blocks_start];
+    ck_assert_uint_eq(block->logical_block, 2);
+    ck_assert_uint_eq(block->physical_block, 302);
+    ck_assert_uint_eq(block->num_blocks, 2);
+
+    // a same-size rewrite is never taken for an append
+    ck_assert_int_eq(changes[21], 1 << DJ_FILE_CHANGED);
+
+    free_vecs(&inodes, &blocks);
+}
+END_TEST
+
+START_TEST(test_incremental_empty_files)
+{
+    struct inode_vec inodes;
+    struct block_vec blocks;
+    plan(0, &inodes, &blocks);
+
+    notify_empty_files(record_empty, &inodes);
+
+    // the unchanged empty file gets nothing, the new one its one call
+    ck_assert_int_eq(empty_calls[26], 0);
+    ck_assert_int_eq(empty_calls[27], 1);
+    ck_assert_int_eq(empty_calls[20], 0);
+    ck_assert_int_eq(empty_calls[23], 0);
+
+    free_vecs(&inodes, &blocks);
+}
+END_TEST
+
+Suite *incremental_suite(void)
+{
+    Suite *suite = suite_create("incremental");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, incremental_setup, incremental_teardown);
+    tcase_add_test(tcase, test_incremental_changes);
+    tcase_add_test(tcase, test_incremental_trusted_append);
+    tcase_add_test(tcase, test_incremental_empty_files);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "test.h"
+
+static void check_path(struct path_arena *arena, uint32_t dir, size_t name,
+                       char *expected)
+{
+    char *path = path_arena_path(arena, dir, name);
+    ck_assert_str_eq(path, expected);
+    ck_assert_uint_eq(path_arena_path_len(arena, dir, name), strlen(expected));
+    free(path);
+}
+
+START_TEST(test_path_arena_paths)
+{
+    struct path_arena arena;
+    path_arena_init(&arena, "/mnt/data");
+
+    uint32_t a = path_arena_add_dir(&arena, 0, "a");
+    uint32_t b = path_arena_add_dir(&arena, a, "b");
+    size_t file = path_arena_add_name(&arena, "file");
+
+    check_path(&arena, 0, file, "/mnt/data/file");
+    check_path(&arena, a, file, "/mnt/data/a/file");
+    check_path(&arena, b, file, "/mnt/data/a/b/file");
+
+    path_arena_free(&arena);
+}
+END_TEST
+
+START_TEST(test_path_arena_roots)
+{
+    // the root's trailing slash isn't doubled up, and an empty root leaves
+    // names relative
+    struct path_arena arena;
+    path_arena_init(&arena, "/");
+
+    uint32_t etc = path_arena_add_dir(&arena, 0, "etc");
+    uint32_t relative = path_arena_add_root(&arena, "");
+    uint32_t sub = path_arena_add_dir(&arena, relative, "sub");
+    size_t name = path_arena_add_name(&arena, "passwd");
+
+    check_path(&arena, 0, name, "/passwd");
+    check_path(&arena, etc, name, "/etc/passwd");
+    check_path(&arena, relative, name, "passwd");
+    check_path(&arena, sub, name, "sub/passwd");
+
+    path_arena_free(&arena);
+}
+END_TEST
+
+START_TEST(test_path_arena_growth)
+{
+    // enough names and directories to make every array grow a few times
+    struct path_arena arena;
+    path_arena_init(&arena, "/r");
+
+    char name[32];
+    uint32_t dir = 0;
+    for (int i = 0; i < 5000; i++)
+    {
+        snprintf(name, sizeof(name), "d%d", i);
+        dir = path_arena_add_dir(&arena, i % 2 == 0 ? 0 : dir, name);
+    }
+    size_t last = path_arena_add_name(&arena, "last");
+
+    check_path(&arena, dir, last, "/r/d4998/d4999/last");
+
+    path_arena_free(&arena);
+}
+END_TEST
+
+START_TEST(test_path_arena_concat)
+{
+    struct path_arena arena, other;
+    path_arena_init(&arena, "/mnt");
+    uint32_t x = path_arena_add_dir(&arena, 0, "x");
+    size_t name = path_arena_add_name(&arena, "one");
+
+    // a worker's arena for the walk under x
+    path_arena_init(&other, "/mnt/x");
+    uint32_t y = path_arena_add_dir(&other, 0, "y");
+    struct inode_list inodes[2] = {
+        { .dir = 0, .name = path_arena_add_name(&other, "two") },
+        { .dir = y, .name = path_arena_add_name(&other, "three") },
+    };
+
+    path_arena_concat(&arena, &other, x, inodes, 2);
+
+    check_path(&arena, 0, name, "/mnt/one");
+    check_path(&arena, inodes[0].dir, inodes[0].name, "/mnt/x/two");
+    check_path(&arena, inodes[1].dir, inodes[1].name, "/mnt/x/y/three");
+    ck_assert_ptr_eq(other.names, NULL);
+
+    path_arena_free(&arena);
+}
+END_TEST
+
+Suite *path_arena_suite(void)
+{
+    Suite *suite = suite_create("path_arena");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_test(tcase, test_path_arena_paths);
+    tcase_add_test(tcase, test_path_arena_roots);
+    tcase_add_test(tcase, test_path_arena_growth);
+    tcase_add_test(tcase, test_path_arena_concat);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
@@ -0,0 +1,185 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "pipeline.h"
+#include "stripe.h"
+#include "test.h"
+#include "util.h"
+
+#define TEST_BLOCK_SIZE 1024
+#define TEST_BLOCKS 64
+
+static struct struct_ext2_filsys fs;
+static char dev_path[] = "/tmp/dj_test_devXXXXXX";
+static int dev_fd;
+
+static struct path_arena paths;
+static struct block_list blocks[32];
+static size_t blocks_count;
+
+// what's been delivered of each file, by inode
+static uint64_t next_pos[2];
+static int wrong_data;
+
+static void pipeline_setup(void)
+{
+    memset(&fs, 0, sizeof(fs));
+    fs.blocksize = TEST_BLOCK_SIZE;
+
+    // each block of the device is filled with its own number
+    strcpy(dev_path, "/tmp/dj_test_devXXXXXX");
+    dev_fd = mkstemp(dev_path);
+    ck_assert_int_ne(dev_fd, -1);
+    char block[TEST_BLOCK_SIZE];
+    for (int i = 0; i < TEST_BLOCKS; i++)
+    {
+        memset(block, i, sizeof(block));
+        ck_assert_int_eq(write(dev_fd, block, sizeof(block)), sizeof(block));
+    }
+
+    path_arena_init(&paths, "/");
+    memset(blocks, 0, sizeof(blocks));
+    blocks_count = 0;
+    next_pos[0] = next_pos[1] = 0;
+    wrong_data = 0;
+}
+
+static void pipeline_teardown(void)
+{
+    path_arena_free(&paths);
+    close(dev_fd);
+    unlink(dev_path);
+}
+
+static struct inode_cb_info *add_inode(ext2_ino_t inode, char *name,
+                                       int len_blocks)
+{
+    struct inode_cb_info *inode_info = ecalloc(sizeof(struct inode_cb_info));
+    inode_info->inode = inode;
+    inode_info->paths = &paths;
+    inode_info->name = path_arena_add_name(&paths, name);
+    inode_info->len = len_blocks * TEST_BLOCK_SIZE;
+    return inode_info;
+}
+
+static void add_run(struct inode_cb_info *inode_info, blk64_t physical_block,
+                    e2_blkcnt_t logical_block, e2_blkcnt_t num_blocks)
+{
+    struct block_list *block = &blocks[blocks_count++];
+    block->inode_info = inode_info;
+    block->physical_block = physical_block;
+    block->logical_block = logical_block;
+    block->num_blocks = num_blocks;
+    block->stripe_ptr.len = num_blocks * TEST_BLOCK_SIZE;
+    inode_info->references++;
+}
+
+static int check_cb(uint32_t inode, char *path, uint64_t pos,
+                    uint64_t file_len, char *data, uint64_t data_len,
+                    void **private)
+{
+    // file 12 is on disk from block 1, file 13 from block 20
+    int file = inode - 12;
+    blk64_t physical_block = (file == 0 ? 1 : 20) + pos / TEST_BLOCK_SIZE;
+    if (pos != next_pos[file])
+        wrong_data = 1;
+    for (uint64_t i = 0; i < data_len; i += TEST_BLOCK_SIZE)
+    {
+        if (data[i] != (char)(physical_block + i / TEST_BLOCK_SIZE))
+            wrong_data = 1;
+    }
+    next_pos[file] = pos + data_len;
+    return 0;
+}
+
+START_TEST(test_split_at_budget)
+{
+    // runs that would coalesce into one stripe are split where the stripe
+    // would outgrow the room left
+    struct inode_cb_info *inode_info = add_inode(12, "a", 16);
+    for (int i = 0; i < 16; i++)
+        add_run(inode_info, 1 + i, i, 1);
+
+    struct stripe *stripe = next_stripe(TEST_BLOCK_SIZE, 0, 0,
+                                        4 * TEST_BLOCK_SIZE, blocks,
+                                        blocks_count);
+    ck_assert_uint_eq(stripe->blocks_count, 4);
+    ck_assert_uint_eq(stripe->consecutive_len, 4 * TEST_BLOCK_SIZE);
+    free(stripe);
+
+    // gaps count towards it too
+    blocks[1].physical_block = 3;
+    stripe = next_stripe(TEST_BLOCK_SIZE, 2, 0, 4 * TEST_BLOCK_SIZE, blocks,
+                         blocks_count);
+    ck_assert_uint_eq(stripe->blocks_count, 2);
+    ck_assert_uint_eq(stripe->consecutive_len, 3 * TEST_BLOCK_SIZE);
+    free(stripe);
+
+    free_inode_info(inode_info);
+}
+END_TEST
+
+START_TEST(test_long_run_whole)
+{
+    // a run longer than the room left isn't split, and is read on its own
+    struct inode_cb_info *inode_info = add_inode(12, "a", 9);
+    add_run(inode_info, 1, 0, 8);
+    add_run(inode_info, 9, 8, 1);
+
+    struct stripe *stripe = next_stripe(TEST_BLOCK_SIZE, 0, 0,
+                                        4 * TEST_BLOCK_SIZE, blocks,
+                                        blocks_count);
+    ck_assert_uint_eq(stripe->blocks_count, 1);
+    ck_assert_uint_eq(stripe->consecutive_len, 8 * TEST_BLOCK_SIZE);
+    free(stripe);
+
+    free_inode_info(inode_info);
+}
+END_TEST
+
+START_TEST(test_pipeline_budget)
+{
+    // with a budget a fraction of the files' size, everything still gets
+    // through, in order, including a run bigger than the whole budget
+    struct inode_cb_info *a = add_inode(12, "a", 16);
+    for (int i = 0; i < 16; i++)
+        add_run(a, 1 + i, i, 1);
+    struct inode_cb_info *b = add_inode(13, "b", 12);
+    add_run(b, 20, 0, 8);
+    add_run(b, 28, 8, 4);
+
+    struct buffer_pool *pool = buffer_pool_create(1 << 20);
+    struct pipeline *pipeline = pipeline_create(&fs, pool, dev_fd, 0, 0,
+                                                4 * TEST_BLOCK_SIZE);
+    int open_inodes_count = 2;
+    pipeline_read_blocks(pipeline, check_cb, TEST_BLOCKS, blocks,
+                         blocks_count, &open_inodes_count, NULL);
+    pipeline_destroy(pipeline);
+    buffer_pool_destroy(pool);
+
+    ck_assert_int_eq(wrong_data, 0);
+    ck_assert_uint_eq(next_pos[0], 16 * TEST_BLOCK_SIZE);
+    ck_assert_uint_eq(next_pos[1], 12 * TEST_BLOCK_SIZE);
+    ck_assert_int_eq(open_inodes_count, 0);
+}
+END_TEST
+
+Suite *pipeline_suite(void)
+{
+    Suite *suite = suite_create("pipeline");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, pipeline_setup, pipeline_teardown);
+    tcase_add_test(tcase, test_split_at_budget);
+    tcase_add_test(tcase, test_long_run_whole);
+    tcase_add_test(tcase, test_pipeline_budget);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
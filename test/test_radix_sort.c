@@ -0,0 +1,105 @@
+#include <stdlib.h>
+
+#include "dj_internal.h"
+#include "radix_sort.h"
+#include "test.h"
+
+START_TEST(test_radix_sort_keys)
+{
+    uint64_t keys[] = { 0x100000000ULL, 7, 0xFF00, 7, 0, 0xFFFFFFFFFFFFFFFFULL };
+    size_t count = sizeof(keys) / sizeof(keys[0]);
+    size_t order[] = { 0, 1, 2, 3, 4, 5 };
+
+    radix_sort(keys, order, count);
+
+    uint64_t sorted[] = { 0, 7, 7, 0xFF00, 0x100000000ULL,
+                          0xFFFFFFFFFFFFFFFFULL };
+    size_t sorted_order[] = { 4, 1, 3, 2, 0, 5 };
+    for (size_t i = 0; i < count; i++)
+    {
+        ck_assert_uint_eq(keys[i], sorted[i]);
+        ck_assert_uint_eq(order[i], sorted_order[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_radix_sort_same_keys)
+{
+    // every byte is the same in every key, so no pass moves anything
+    uint64_t keys[] = { 42, 42, 42 };
+    size_t order[] = { 0, 1, 2 };
+
+    radix_sort(keys, order, 3);
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        ck_assert_uint_eq(keys[i], 42);
+        ck_assert_uint_eq(order[i], i);
+    }
+}
+END_TEST
+
+START_TEST(test_sort_blocks)
+{
+    struct block_list blocks[1000];
+    for (size_t i = 0; i < 1000; i++)
+    {
+        blocks[i] = (struct block_list) {
+            .physical_block = (i * 7919) % 1000 + ((i & 1) << 32),
+            .logical_block = i,
+        };
+    }
+
+    sort_blocks(blocks, 1000);
+
+    for (size_t i = 1; i < 1000; i++)
+        ck_assert_uint_lt(blocks[i - 1].physical_block,
+                          blocks[i].physical_block);
+    for (size_t i = 0; i < 1000; i++)
+        ck_assert_uint_eq(blocks[i].physical_block,
+                          (blocks[i].logical_block * 7919) % 1000
+                          + ((blocks[i].logical_block & 1) << 32));
+}
+END_TEST
+
+START_TEST(test_sort_inodes)
+{
+    struct inode_vec inodes = { 0 };
+    ext2_ino_t indexes[] = { 12, 70000, 3, 12, 500 };
+    size_t count = sizeof(indexes) / sizeof(indexes[0]);
+
+    inodes.inodes = calloc(count, sizeof(struct inode_list));
+    for (size_t i = 0; i < count; i++)
+    {
+        inodes.inodes[i].index = indexes[i];
+        inodes.inodes[i].name = i;
+    }
+    inodes.count = count;
+
+    sort_inodes(&inodes);
+
+    ext2_ino_t sorted[] = { 3, 12, 12, 500, 70000 };
+    size_t names[] = { 2, 0, 3, 4, 1 };
+    for (size_t i = 0; i < count; i++)
+    {
+        ck_assert_uint_eq(inodes.inodes[i].index, sorted[i]);
+        ck_assert_uint_eq(inodes.inodes[i].name, names[i]);
+    }
+
+    free(inodes.inodes);
+}
+END_TEST
+
+Suite *radix_sort_suite(void)
+{
+    Suite *suite = suite_create("radix_sort");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_test(tcase, test_radix_sort_keys);
+    tcase_add_test(tcase, test_radix_sort_same_keys);
+    tcase_add_test(tcase, test_sort_blocks);
+    tcase_add_test(tcase, test_sort_inodes);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
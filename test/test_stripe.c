@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "stripe.h"
+#include "test.h"
+#include "util.h"
+
+#define TEST_BLOCK_SIZE 1024
+#define TEST_BLOCKS 64
+
+static struct struct_ext2_filsys fs;
+static char dev_path[] = "/tmp/dj_test_devXXXXXX";
+static int dev_fd;
+
+static int chunks_count;
+static uint64_t last_pos;
+static char last_byte;
+
+static void stripe_setup(void)
+{
+    memset(&fs, 0, sizeof(fs));
+    fs.blocksize = TEST_BLOCK_SIZE;
+
+    // each block of the device is filled with its own number
+    strcpy(dev_path, "/tmp/dj_test_devXXXXXX");
+    dev_fd = mkstemp(dev_path);
+    ck_assert_int_ne(dev_fd, -1);
+    char block[TEST_BLOCK_SIZE];
+    for (int i = 0; i < TEST_BLOCKS; i++)
+    {
+        memset(block, i, sizeof(block));
+        ck_assert_int_eq(write(dev_fd, block, sizeof(block)), sizeof(block));
+    }
+
+    chunks_count = 0;
+}
+
+static void stripe_teardown(void)
+{
+    close(dev_fd);
+    unlink(dev_path);
+}
+
+static int count_cb(uint32_t inode, char *path, uint64_t pos,
+                    uint64_t file_len, char *data, uint64_t data_len,
+                    void **private)
+{
+    chunks_count++;
+    last_pos = pos;
+    last_byte = data[0];
+    return 0;
+}
+
+/*
+ * Read the stripe starting at the first of count blocks, as read_batches()
+ * would, and return how many of the blocks it took.
+ */
+static size_t read_next_stripe(struct buffer_pool *pool,
+                               struct block_list *blocks, size_t count,
+                               int *open_inodes_count)
+{
+    struct stripe *stripe = next_stripe(TEST_BLOCK_SIZE, 0, 0, SIZE_MAX,
+                                        blocks, count);
+    size_t taken = stripe->blocks_count;
+    if (stripe->consecutive_blocks > 0)
+    {
+        read_stripe_data(pool, TEST_BLOCK_SIZE, stripe->physical_block, 0,
+                         dev_fd, stripe);
+    }
+    heapify_stripe(&fs, count_cb, stripe, 0, open_inodes_count);
+    return taken;
+}
+
+START_TEST(test_skip_fragmented_file)
+{
+    struct path_arena paths;
+    path_arena_init(&paths, "/");
+
+    // a file whose blocks are out of order on disk, and too far apart to be
+    // read in one stripe
+    struct inode_cb_info *inode_info = ecalloc(sizeof(struct inode_cb_info));
+    inode_info->inode = 12;
+    inode_info->paths = &paths;
+    inode_info->name = path_arena_add_name(&paths, "frag");
+    inode_info->len = 3 * TEST_BLOCK_SIZE;
+    inode_info->references = 3;
+
+    struct block_list blocks[3];
+    memset(blocks, 0, sizeof(blocks));
+    blk64_t physical[] = { 10, 20, 40 };
+    e2_blkcnt_t logical[] = { 0, 2, 1 };
+    for (int i = 0; i < 3; i++)
+    {
+        blocks[i].inode_info = inode_info;
+        blocks[i].physical_block = physical[i];
+        blocks[i].logical_block = logical[i];
+        blocks[i].num_blocks = 1;
+    }
+
+    struct buffer_pool *pool = buffer_pool_create(1 << 20);
+    int open_inodes_count = 1;
+
+    size_t done = read_next_stripe(pool, blocks, 3, &open_inodes_count);
+    ck_assert_uint_eq(done, 1);
+    ck_assert_int_eq(chunks_count, 1);
+    ck_assert_uint_eq(last_pos, 0);
+    ck_assert_int_eq(last_byte, 10);
+
+    // logical block 2 waits in the heap for block 1
+    done += read_next_stripe(pool, &blocks[done], 3 - done,
+                             &open_inodes_count);
+    ck_assert_uint_eq(done, 2);
+    ck_assert_int_eq(chunks_count, 1);
+
+    // the first chunk's callback, on a callback thread, has asked to skip the
+    // rest; the last block isn't read, and the one in the heap goes with it
+    skip_inode(inode_info);
+    done += read_next_stripe(pool, &blocks[done], 3 - done,
+                             &open_inodes_count);
+    ck_assert_uint_eq(done, 3);
+    ck_assert_int_eq(chunks_count, 1);
+    ck_assert_int_eq(open_inodes_count, 0);
+
+    buffer_pool_destroy(pool);
+    path_arena_free(&paths);
+}
+END_TEST
+
+START_TEST(test_read_past_end)
+{
+    // a stripe that runs off the end of the device fails rather than being
+    // handed over half-read
+    struct stripe *stripe = ecalloc(sizeof(struct stripe));
+    stripe->consecutive_len = 4 * TEST_BLOCK_SIZE;
+    struct buffer_pool *pool = buffer_pool_create(1 << 20);
+
+    static struct error_trap trap;
+    int failed = 0;
+    if (setjmp(trap.jump))
+        failed = 1;
+    else
+    {
+        error_trap_set(&trap);
+        read_stripe_data(pool, TEST_BLOCK_SIZE, TEST_BLOCKS - 2, 0, dev_fd,
+                         stripe);
+        error_trap_clear();
+    }
+
+    ck_assert_int_eq(failed, 1);
+    ck_assert_ptr_ne(strstr(trap.message, "end of block device"), NULL);
+
+    buffer_pool_put(pool, stripe->data, stripe->data_len);
+    free(stripe);
+    buffer_pool_destroy(pool);
+}
+END_TEST
+
+Suite *stripe_suite(void)
+{
+    Suite *suite = suite_create("stripe");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_checked_fixture(tcase, stripe_setup, stripe_teardown);
+    tcase_add_test(tcase, test_skip_fragmented_file);
+    tcase_add_test(tcase, test_read_past_end);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+
+#include "dj_internal.h"
+#include "path_arena.h"
+#include "test.h"
+#include "vec.h"
+
+static void add_file(struct inode_vec *vec, ext2_ino_t index, uint32_t dir,
+                     char *name)
+{
+    struct inode_list *inode = inode_vec_append(vec);
+    inode->index = index;
+    inode->dir = dir;
+    inode->name = path_arena_add_name(&vec->paths, name);
+}
+
+static void check_link(struct inode_vec *vec, struct inode_list *inode,
+                       size_t i, char *expected)
+{
+    struct path_link *link = &vec->paths.links[inode->links_start + i];
+    char *path = path_arena_path(&vec->paths, link->dir, link->name);
+    ck_assert_str_eq(path, expected);
+    free(path);
+}
+
+START_TEST(test_inode_vec_append)
+{
+    struct inode_vec vec = { 0 };
+    path_arena_init(&vec.paths, "/");
+
+    for (ext2_ino_t i = 0; i < 3000; i++)
+        add_file(&vec, i, 0, "f");
+
+    ck_assert_uint_eq(vec.count, 3000);
+    ck_assert_uint_le(vec.count, vec.size);
+    for (ext2_ino_t i = 0; i < 3000; i++)
+    {
+        ck_assert_uint_eq(vec.inodes[i].index, i);
+        ck_assert_uint_eq(vec.inodes[i].links_count, 0);
+    }
+
+    free(vec.inodes);
+    path_arena_free(&vec.paths);
+}
+END_TEST
+
+START_TEST(test_inode_vec_merge_links)
+{
+    struct inode_vec vec = { 0 };
+    path_arena_init(&vec.paths, "/d");
+    uint32_t sub = path_arena_add_dir(&vec.paths, 0, "sub");
+
+    add_file(&vec, 11, 0, "a");
+    add_file(&vec, 12, 0, "b");
+    add_file(&vec, 12, sub, "b2");
+    add_file(&vec, 12, sub, "b3");
+    add_file(&vec, 13, 0, "c");
+    add_file(&vec, 14, sub, "d");
+    add_file(&vec, 14, 0, "d2");
+
+    inode_vec_merge_links(&vec);
+
+    ck_assert_uint_eq(vec.count, 4);
+    ck_assert_uint_eq(vec.inodes[0].index, 11);
+    ck_assert_uint_eq(vec.inodes[0].links_count, 0);
+    ck_assert_uint_eq(vec.inodes[1].index, 12);
+    ck_assert_uint_eq(vec.inodes[1].links_count, 2);
+    check_link(&vec, &vec.inodes[1], 0, "/d/sub/b2");
+    check_link(&vec, &vec.inodes[1], 1, "/d/sub/b3");
+    ck_assert_uint_eq(vec.inodes[2].index, 13);
+    ck_assert_uint_eq(vec.inodes[2].links_count, 0);
+    ck_assert_uint_eq(vec.inodes[3].index, 14);
+    ck_assert_uint_eq(vec.inodes[3].links_count, 1);
+    check_link(&vec, &vec.inodes[3], 0, "/d/d2");
+
+    free(vec.inodes);
+    path_arena_free(&vec.paths);
+}
+END_TEST
+
+START_TEST(test_inode_vec_merge_links_duplicates)
+{
+    struct inode_vec vec = { 0 };
+    path_arena_init(&vec.paths, "/d");
+    uint32_t sub = path_arena_add_dir(&vec.paths, 0, "sub");
+    // a second target nested in the first, as /d/sub
+    uint32_t root = path_arena_add_root(&vec.paths, "/d/sub");
+
+    add_file(&vec, 21, sub, "e");
+    add_file(&vec, 21, root, "e");
+    add_file(&vec, 22, sub, "f");
+    add_file(&vec, 22, 0, "f2");
+    add_file(&vec, 22, root, "f");
+    add_file(&vec, 22, 0, "f2");
+
+    inode_vec_merge_links(&vec);
+
+    ck_assert_uint_eq(vec.count, 2);
+    ck_assert_uint_eq(vec.inodes[0].index, 21);
+    ck_assert_uint_eq(vec.inodes[0].links_count, 0);
+    ck_assert_uint_eq(vec.inodes[1].index, 22);
+    ck_assert_uint_eq(vec.inodes[1].links_count, 1);
+    check_link(&vec, &vec.inodes[1], 0, "/d/f2");
+
+    free(vec.inodes);
+    path_arena_free(&vec.paths);
+}
+END_TEST
+
+START_TEST(test_inode_vec_concat)
+{
+    struct inode_vec vec = { 0 };
+    struct inode_vec other = { 0 };
+    path_arena_init(&vec.paths, "/m");
+    uint32_t top = path_arena_add_dir(&vec.paths, 0, "top");
+    add_file(&vec, 1, 0, "one");
+
+    path_arena_init(&other.paths, "/m/top");
+    add_file(&other, 2, 0, "two");
+
+    inode_vec_concat(&vec, &other, top);
+
+    ck_assert_uint_eq(vec.count, 2);
+    ck_assert_uint_eq(other.count, 0);
+    char *path = path_arena_path(&vec.paths, vec.inodes[1].dir,
+                                 vec.inodes[1].name);
+    ck_assert_str_eq(path, "/m/top/two");
+    free(path);
+
+    free(vec.inodes);
+    path_arena_free(&vec.paths);
+}
+END_TEST
+
+Suite *vec_suite(void)
+{
+    Suite *suite = suite_create("vec");
+    TCase *tcase = tcase_create("core");
+
+    tcase_add_test(tcase, test_inode_vec_append);
+    tcase_add_test(tcase, test_inode_vec_merge_links);
+    tcase_add_test(tcase, test_inode_vec_merge_links_duplicates);
+    tcase_add_test(tcase, test_inode_vec_concat);
+    suite_add_tcase(suite, tcase);
+
+    return suite;
+}